@@ -0,0 +1,43 @@
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "addr.h"
+
+int um_sockaddr_parse(union um_sockaddr *a, const char *str)
+{
+    memset(a, 0, sizeof(*a));
+
+    if (inet_pton(AF_INET, str, &a->v4.sin_addr) == 1) {
+        a->v4.sin_family = AF_INET;
+        return 0;
+    }
+
+    if (inet_pton(AF_INET6, str, &a->v6.sin6_addr) == 1) {
+        a->v6.sin6_family = AF_INET6;
+        return 0;
+    }
+
+    return -1;
+}
+
+const char *um_sockaddr_str(const union um_sockaddr *a, char *buf,
+                            size_t len)
+{
+    char host[INET6_ADDRSTRLEN];
+    struct um_flow_key key;
+
+    um_flow_key_of(&key, a);
+
+    if (key.family == AF_INET) {
+        inet_ntop(AF_INET, key.addr + 12, host, sizeof(host));
+        snprintf(buf, len, "%s:%hu", host, ntohs(key.port));
+    } else if (key.family == AF_INET6) {
+        inet_ntop(AF_INET6, key.addr, host, sizeof(host));
+        snprintf(buf, len, "[%s]:%hu", host, ntohs(key.port));
+    } else {
+        snprintf(buf, len, "none");
+    }
+
+    return buf;
+}
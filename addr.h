@@ -0,0 +1,106 @@
+#ifndef _incl_ADDR_H
+#define _incl_ADDR_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+
+// "[addr]:port" with room to spare
+#define UM_ADDR_STRLEN      (INET6_ADDRSTRLEN + 8)
+
+// Any address a client or the remote may have
+union um_sockaddr {
+    struct sockaddr         sa;
+    struct sockaddr_in      v4;
+    struct sockaddr_in6     v6;
+};
+
+// Flow key, 20 bytes whatever the family. IPv4 addresses are stored
+// v4-mapped (::ffff:a.b.c.d) with family AF_INET, so a client is the same
+// flow whether it arrives on an IPv4 or a dual-stack socket, and hashing
+// and comparing never look at the family. The same client on another
+// tunnel is another flow.
+struct um_flow_key {
+    uint8_t             addr[16];
+    uint16_t            port;       // network order
+    uint8_t             family;     // 0 for no address
+    uint8_t             tunnel;
+};
+
+static inline socklen_t um_sockaddr_len(const union um_sockaddr *a)
+{
+    return a->sa.sa_family == AF_INET6 ? sizeof(a->v6) : sizeof(a->v4);
+}
+
+static inline void um_sockaddr_set_port(union um_sockaddr *a, uint16_t port)
+{
+    if (a->sa.sa_family == AF_INET6) {
+        a->v6.sin6_port = htons(port);
+    } else {
+        a->v4.sin_port = htons(port);
+    }
+}
+
+static inline void um_flow_key_of(struct um_flow_key *key,
+                                  const union um_sockaddr *a)
+{
+    static const uint8_t v4mapped[12] = {
+        0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff
+    };
+
+    if (a->sa.sa_family == AF_INET6) {
+        memcpy(key->addr, &a->v6.sin6_addr, 16);
+        key->port = a->v6.sin6_port;
+        key->family = memcmp(key->addr, v4mapped, 12) == 0 ?
+                      AF_INET : AF_INET6;
+    } else if (a->sa.sa_family == AF_INET) {
+        memcpy(key->addr, v4mapped, 12);
+        memcpy(key->addr + 12, &a->v4.sin_addr, 4);
+        key->port = a->v4.sin_port;
+        key->family = AF_INET;
+    } else {
+        memset(key, 0, sizeof(*key));
+    }
+
+    key->tunnel = 0;
+}
+
+static inline int um_flow_key_eq(const struct um_flow_key *a,
+                                 const struct um_flow_key *b)
+{
+    uint64_t a0, a1, b0, b1;
+    uint32_t a2, b2;
+
+    memcpy(&a0, a, 8);
+    memcpy(&a1, (const char *) a + 8, 8);
+    memcpy(&a2, (const char *) a + 16, 4);
+    memcpy(&b0, b, 8);
+    memcpy(&b1, (const char *) b + 8, 8);
+    memcpy(&b2, (const char *) b + 16, 4);
+
+    return ((a0 ^ b0) | (a1 ^ b1) | (a2 ^ b2)) == 0;
+}
+
+static inline uint64_t um_flow_key_hash(const struct um_flow_key *key)
+{
+    uint64_t w0, w1;
+    uint32_t w2;
+
+    memcpy(&w0, key, 8);
+    memcpy(&w1, (const char *) key + 8, 8);
+    memcpy(&w2, (const char *) key + 16, 4);
+
+    uint64_t h = (w0 ^ w2) * 0xFF51AFD7ED558CCDULL;
+    h = (h ^ w1) * 0xC4CEB9FE1A85EC53ULL;
+    return h ^ (h >> 32);
+}
+
+// Parse a numeric IPv4 or IPv6 address, port 0. Returns 0 on success.
+int um_sockaddr_parse(union um_sockaddr *a, const char *str);
+// "a.b.c.d:port" or "[v6]:port", v4-mapped addresses print as IPv4
+const char *um_sockaddr_str(const union um_sockaddr *a, char *buf,
+                            size_t len);
+
+#endif /* _incl_ADDR_H */
@@ -0,0 +1,22 @@
+#include <time.h>
+
+#include "clock.h"
+
+// Ticks once a jiffy and is read in the vDSO, no system call
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE  CLOCK_MONOTONIC
+#endif
+
+int64_t um_clock_ms;
+
+int64_t um_clock_update(void)
+{
+    struct timespec ts;
+    int64_t ms;
+
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    ms = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    __atomic_store_n(&um_clock_ms, ms, __ATOMIC_RELAXED);
+
+    return ms;
+}
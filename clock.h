@@ -0,0 +1,26 @@
+#ifndef _incl_CLOCK_H
+#define _incl_CLOCK_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Milliseconds on CLOCK_MONOTONIC_COARSE, which steps of the wall clock
+// don't move. The event loop reads the clock once per wakeup with
+// um_clock_update(), everything else, on any thread, takes what it cached.
+
+extern int64_t um_clock_ms;
+
+int64_t um_clock_update(void);
+
+static inline int64_t um_clock_now(void)
+{
+    return __atomic_load_n(&um_clock_ms, __ATOMIC_RELAXED);
+}
+
+// Whole seconds, what flow expiry and lookups count in
+static inline time_t um_clock_sec(void)
+{
+    return (time_t) (um_clock_now() / 1000);
+}
+
+#endif /* _incl_CLOCK_H */
@@ -0,0 +1,139 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "config.h"
+
+static const char *mode_names[] = {
+    [UM_MODE_SERVER] = "server",
+    [UM_MODE_CLIENT] = "client",
+    [UM_MODE_PASSTHROU] = "passthrough",
+};
+
+enum um_mode um_mode_parse(const char *str)
+{
+    for (int i = 0; i < ARRAY_SIZE(mode_names); i++) {
+        if (strcmp(str, mode_names[i]) == 0) {
+            return (enum um_mode) i;
+        }
+    }
+
+    return UM_MODE_NONE;
+}
+
+const char *um_mode_name(enum um_mode mode)
+{
+    if (mode < 0 || mode >= ARRAY_SIZE(mode_names)) {
+        return "none";
+    }
+
+    return mode_names[mode];
+}
+
+// Returns the port, or 0 if str isn't one
+static uint16_t parse_port(const char *str)
+{
+    char *end;
+    long port = strtol(str, &end, 10);
+
+    if (*end != '\0' || port <= 0 || port > 65535) {
+        return 0;
+    }
+
+    return (uint16_t) port;
+}
+
+int um_config_line(const char *line, struct um_tunnel_conf *conf)
+{
+    char buf[512];
+    char *field[6];
+    char *save;
+    int n = 0;
+
+    if (strlen(line) >= sizeof(buf)) {
+        return -1;
+    }
+    strcpy(buf, line);
+
+    // Comments run to the end of the line
+    char *hash = strchr(buf, '#');
+    if (hash) {
+        *hash = '\0';
+    }
+
+    for (char *tok = strtok_r(buf, " \t\r\n", &save); tok;
+         tok = strtok_r(NULL, " \t\r\n", &save)) {
+        if (n == ARRAY_SIZE(field)) {
+            return -1;
+        }
+        field[n++] = tok;
+    }
+
+    if (n == 0) {
+        return 0;
+    }
+    if (n != 5) {
+        return -1;
+    }
+
+    memset(conf, 0, sizeof(*conf));
+
+    conf->mode = um_mode_parse(field[0]);
+    if (conf->mode == UM_MODE_NONE) {
+        return -1;
+    }
+
+    if (strcmp(field[1], "*") != 0 &&
+        um_sockaddr_parse(&conf->listen, field[1]) < 0) {
+        return -1;
+    }
+
+    conf->port = parse_port(field[2]);
+    conf->port_conn = parse_port(field[4]);
+    if (conf->port == 0 || conf->port_conn == 0 ||
+        strlen(field[3]) >= sizeof(conf->host)) {
+        return -1;
+    }
+    strcpy(conf->host, field[3]);
+
+    return 1;
+}
+
+int um_config_load(const char *path, struct um_tunnel_conf **conf, int *n)
+{
+    struct um_tunnel_conf tun, *p;
+    char line[512];
+    int lineno = 0;
+    int r = 0;
+    FILE *fp = fopen(path, "r");
+
+    if (!fp) {
+        return -1;
+    }
+
+    while (r == 0 && fgets(line, sizeof(line), fp)) {
+        lineno++;
+
+        switch (um_config_line(line, &tun)) {
+        case 0:
+            break;
+        case 1:
+            p = realloc(*conf, sizeof(*p) * (*n + 1));
+            if (!p) {
+                r = -1;
+                break;
+            }
+            p[(*n)++] = tun;
+            *conf = p;
+            break;
+        default:
+            r = lineno;
+            break;
+        }
+    }
+
+    fclose(fp);
+
+    return r;
+}
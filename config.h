@@ -0,0 +1,32 @@
+#ifndef _incl_CONFIG_H
+#define _incl_CONFIG_H
+
+#include <stdint.h>
+
+#include "addr.h"
+#include "resolver.h"
+#include "udpmask.h"
+
+// One listening port forwarded to one remote
+struct um_tunnel_conf {
+    enum um_mode        mode;
+    union um_sockaddr   listen;     // AF_UNSPEC for any, either family
+    uint16_t            port;
+    char                host[UM_HOST_LEN];
+    uint16_t            port_conn;
+};
+
+enum um_mode um_mode_parse(const char *str);
+const char *um_mode_name(enum um_mode mode);
+
+// Parse a tunnel line, "mode listen port remote remote_port" with "*" for
+// any listening address. Returns 1 for a tunnel, 0 for a blank or comment
+// line and -1 if it doesn't parse.
+int um_config_line(const char *line, struct um_tunnel_conf *conf);
+
+// Append the tunnels in the file at path to *conf, which holds *n. Returns
+// 0 on success, -1 with errno set if the file can't be read, or the number
+// of the first line that doesn't parse.
+int um_config_load(const char *path, struct um_tunnel_conf **conf, int *n);
+
+#endif /* _incl_CONFIG_H */
@@ -0,0 +1,373 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/un.h>
+
+#include "handoff.h"
+
+#define UM_HANDOFF_FDS      (2 * UM_HANDOFF_BATCH)
+
+struct msg {
+    uint32_t                magic;
+    int32_t                 status;
+    uint32_t                n_tunnels;  // in the whole handoff
+    uint32_t                n_flows;
+    uint32_t                n;          // records in this message
+    struct um_handoff_rec   rec[UM_HANDOFF_BATCH];
+};
+
+#define MSG_LEN(n)  (offsetof(struct msg, rec) + \
+                     (size_t) (n) * sizeof(struct um_handoff_rec))
+
+union ctl {
+    char            buf[CMSG_SPACE(sizeof(int) * UM_HANDOFF_FDS)];
+    struct cmsghdr  align;
+};
+
+static int set_unix_addr(struct sockaddr_un *addr, const char *path)
+{
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    strcpy(addr->sun_path, path);
+
+    return 0;
+}
+
+// A peer that stops talking mid-handoff must not stall the event loop
+static int set_timeouts(int sock)
+{
+    struct timeval tv = { UM_HANDOFF_TIMEOUT, 0 };
+
+    if (setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv)) < 0 ||
+        setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv)) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+static void close_fds(const int *fds, int n)
+{
+    for (int i = 0; i < n; i++) {
+        close(fds[i]);
+    }
+}
+
+int um_handoff_listen(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (set_unix_addr(&addr, path) < 0) {
+        return -1;
+    }
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    unlink(path);
+
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 ||
+        listen(sock, 1) < 0) {
+        int saved_errno = errno;
+        close(sock);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return sock;
+}
+
+// Accept a successor, which has to run as the same user or root
+int um_handoff_accept(int sock)
+{
+    struct ucred cred;
+    socklen_t len = sizeof(cred);
+    int conn;
+
+    conn = accept4(sock, NULL, NULL, SOCK_CLOEXEC);
+    if (conn < 0) {
+        return -1;
+    }
+
+    if (getsockopt(conn, SOL_SOCKET, SO_PEERCRED, &cred, &len) < 0 ||
+        set_timeouts(conn) < 0) {
+        int saved_errno = errno;
+        close(conn);
+        errno = saved_errno;
+        return -1;
+    }
+
+    if (cred.uid != 0 && cred.uid != geteuid()) {
+        close(conn);
+        errno = EPERM;
+        return -1;
+    }
+
+    return conn;
+}
+
+int um_handoff_connect(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (set_unix_addr(&addr, path) < 0) {
+        return -1;
+    }
+
+    sock = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    if (set_timeouts(sock) < 0 ||
+        connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        int saved_errno = errno;
+        close(sock);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return sock;
+}
+
+void um_handoff_close(int sock, const char *path)
+{
+    if (sock >= 0) {
+        close(sock);
+        if (path) {
+            unlink(path);
+        }
+    }
+}
+
+int um_handoff_nfd(const struct um_handoff_rec *rec, int n)
+{
+    int nfd = 0;
+
+    for (int i = 0; i < n; i++) {
+        nfd += rec[i].nfd;
+    }
+
+    return nfd;
+}
+
+static int send_msg(int sock, const struct msg *m, const int *fds, int nfd)
+{
+    union ctl ctl;
+    struct iovec iov = { (void *) m, MSG_LEN(m->n) };
+    struct msghdr msg;
+    ssize_t r;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+
+    if (nfd > 0) {
+        struct cmsghdr *cmsg;
+
+        memset(&ctl, 0, sizeof(ctl));
+        msg.msg_control = ctl.buf;
+        msg.msg_controllen = CMSG_SPACE(sizeof(int) * nfd);
+
+        cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(int) * nfd);
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(int) * nfd);
+    }
+
+    do {
+        r = sendmsg(sock, &msg, MSG_NOSIGNAL);
+    } while (r < 0 && errno == EINTR);
+
+    return r < 0 ? -1 : 0;
+}
+
+// Receive one message and the sockets attached to it, which are closed
+// again if the message is malformed
+static int recv_msg(int sock, struct msg *m, int *fds, int *nfd)
+{
+    union ctl ctl;
+    struct iovec iov = { m, sizeof(*m) };
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    ssize_t r;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = ctl.buf;
+    msg.msg_controllen = sizeof(ctl.buf);
+
+    do {
+        r = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    } while (r < 0 && errno == EINTR);
+
+    if (r < 0) {
+        return -1;
+    }
+    if (r == 0) {
+        errno = ECONNRESET;
+        return -1;
+    }
+
+    *nfd = 0;
+    for (cmsg = CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_SOCKET &&
+            cmsg->cmsg_type == SCM_RIGHTS) {
+            int n = (int) ((cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int));
+
+            if (n > UM_HANDOFF_FDS - *nfd) {
+                n = UM_HANDOFF_FDS - *nfd;
+            }
+            memcpy(fds + *nfd, CMSG_DATA(cmsg), sizeof(int) * n);
+            *nfd += n;
+        }
+    }
+
+    if ((msg.msg_flags & (MSG_TRUNC | MSG_CTRUNC)) ||
+        (size_t) r < offsetof(struct msg, rec) ||
+        m->magic != UM_HANDOFF_MAGIC || m->n > UM_HANDOFF_BATCH ||
+        (size_t) r != MSG_LEN(m->n)) {
+        goto bad;
+    }
+
+    for (uint32_t i = 0; i < m->n; i++) {
+        if (m->rec[i].nfd < 0 || m->rec[i].nfd > 2) {
+            goto bad;
+        }
+    }
+
+    if (m->status == 0 && um_handoff_nfd(m->rec, (int) m->n) != *nfd) {
+        goto bad;
+    }
+
+    return 0;
+
+bad:
+    close_fds(fds, *nfd);
+    errno = EPROTO;
+    return -1;
+}
+
+int um_handoff_send(int sock, int status, const struct um_handoff_rec *rec,
+                    int n_tunnels, int n_flows, const int *fds)
+{
+    struct msg m;
+    int total = n_tunnels + n_flows;
+    int i = 0;
+
+    memset(&m, 0, offsetof(struct msg, rec));
+    m.magic = UM_HANDOFF_MAGIC;
+    m.status = status;
+    m.n_tunnels = (uint32_t) n_tunnels;
+    m.n_flows = (uint32_t) n_flows;
+
+    // At least one message, even with nothing in it
+    do {
+        int n = total - i < UM_HANDOFF_BATCH ? total - i : UM_HANDOFF_BATCH;
+        int nfd = um_handoff_nfd(rec + i, n);
+
+        m.n = (uint32_t) n;
+        if (n > 0) {
+            memcpy(m.rec, rec + i, sizeof(*rec) * n);
+        }
+
+        if (send_msg(sock, &m, fds, nfd) < 0) {
+            return -1;
+        }
+
+        fds += nfd;
+        i += n;
+    } while (i < total);
+
+    return 0;
+}
+
+int um_handoff_recv(int sock, struct um_handoff_rec **rec, int *n_tunnels,
+                    int *n_flows, int **fds)
+{
+    struct msg m;
+    struct um_handoff_rec *r = NULL;
+    int *f = NULL;
+    int total = -1;
+    int got = 0;
+    int nfd_got = 0;
+
+    do {
+        int mfds[UM_HANDOFF_FDS];
+        int mn;
+
+        if (recv_msg(sock, &m, mfds, &mn) < 0) {
+            goto fail;
+        }
+
+        if (m.status != 0) {
+            close_fds(mfds, mn);
+            errno = m.status > 0 ? m.status : EPROTO;
+            goto fail;
+        }
+
+        if (total < 0) {
+            if (m.n_tunnels > 0xffff || m.n_flows > 0xffffff) {
+                close_fds(mfds, mn);
+                errno = EPROTO;
+                goto fail;
+            }
+
+            *n_tunnels = (int) m.n_tunnels;
+            *n_flows = (int) m.n_flows;
+            total = *n_tunnels + *n_flows;
+
+            r = malloc(sizeof(*r) * (total + 1));
+            f = malloc(sizeof(*f) * (2 * total + 1));
+            if (!r || !f) {
+                close_fds(mfds, mn);
+                goto fail;
+            }
+        }
+
+        if ((int) m.n > total - got) {
+            close_fds(mfds, mn);
+            errno = EPROTO;
+            goto fail;
+        }
+
+        memcpy(r + got, m.rec, sizeof(*r) * m.n);
+        memcpy(f + nfd_got, mfds, sizeof(*f) * mn);
+        got += (int) m.n;
+        nfd_got += mn;
+    } while (got < total);
+
+    *rec = r;
+    *fds = f;
+
+    return 0;
+
+fail:
+    {
+        int saved_errno = errno;
+
+        close_fds(f, nfd_got);
+        free(r);
+        free(f);
+        errno = saved_errno;
+    }
+
+    return -1;
+}
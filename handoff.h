@@ -0,0 +1,45 @@
+#ifndef _incl_HANDOFF_H
+#define _incl_HANDOFF_H
+
+#include <stdint.h>
+
+#include "addr.h"
+
+// A process started with -H path takes over the sockets and flows of the
+// one listening there, over a SOCK_SEQPACKET UNIX socket. The new process
+// sends a record per tunnel it wants, the old one answers with a record
+// per tunnel and per flow, sockets attached, and stops serving once the
+// new one acknowledges them. Either side gives up by sending a status.
+
+#define UM_HANDOFF_MAGIC    0x756d6831  // "umh1"
+#define UM_HANDOFF_BATCH    64          // records per message
+#define UM_HANDOFF_TIMEOUT  2           // seconds to wait for the peer
+
+struct um_handoff_rec {
+    int32_t             tunnel;
+    int32_t             nfd;        // sockets passed with it, 0 to 2
+    int64_t             last_use;
+    union um_sockaddr   from;       // listening address for a tunnel
+    struct um_flow_key  conn;
+};
+
+int um_handoff_listen(const char *path);
+int um_handoff_accept(int sock);
+int um_handoff_connect(const char *path);
+// Leaves path alone if NULL, once a successor has taken it
+void um_handoff_close(int sock, const char *path);
+
+// Send status and records, tunnels first. fds holds the sockets of every
+// record in turn. Returns 0, or -1 with errno set.
+int um_handoff_send(int sock, int status, const struct um_handoff_rec *rec,
+                    int n_tunnels, int n_flows, const int *fds);
+
+// Receive what um_handoff_send() sent, into arrays the caller frees.
+// Returns 0, or -1 with errno set, to the peer's status if it gave up.
+int um_handoff_recv(int sock, struct um_handoff_rec **rec, int *n_tunnels,
+                    int *n_flows, int **fds);
+
+// Number of sockets attached to rec[0, n)
+int um_handoff_nfd(const struct um_handoff_rec *rec, int n);
+
+#endif /* _incl_HANDOFF_H */
@@ -1,78 +1,585 @@
+#include <errno.h>
 #include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <syslog.h>
 #include <time.h>
 #include <unistd.h>
 
+#include "clock.h"
 #include "log.h"
 
 const static char *logname;
-static int loglevel = LOG_INFO;
+int log_level = LOG_INFO;
 
 int use_syslog = 0;
 
+/////////////////////////////////////////////////////////////////////
+// Records
+/////////////////////////////////////////////////////////////////////
+
+// While the event loop runs, messages go into a ring of fixed size records
+// holding the format and a copy of the arguments, and are formatted and
+// written when the loop flushes the ring. Formats the records can't hold
+// (%*d, %n$, %m, long double) are formatted right away instead.
+
+#define UM_LOG_RING     1024    // records, a power of two
+#define UM_LOG_ARGS     8
+#define UM_LOG_STR      200     // copies of string arguments
+#define UM_LOG_LINE     512
+#define UM_LOG_OUT      16384   // lines written to stderr at once
+
+enum arg_type {
+    T_BAD,
+    T_INT,
+    T_LONG,
+    T_LLONG,
+    T_INTMAX,
+    T_SIZE,
+    T_PTRDIFF,
+    T_DOUBLE,
+    T_PTR,
+    T_STR,
+};
+
+union log_arg {
+    int                 i;
+    long                l;
+    long long           ll;
+    intmax_t            j;
+    size_t              z;
+    ptrdiff_t           t;
+    double              d;
+    const void         *p;
+    unsigned int        s;      // offset into str
+};
+
+struct log_rec {
+    unsigned int        seq;    // claimed and published by seq, see below
+    int                 priority;
+    time_t              time;
+    const char         *fmt;    // NULL if str holds the message
+    int                 nargs;
+    unsigned char       type[UM_LOG_ARGS];
+    union log_arg       arg[UM_LOG_ARGS];
+    char                str[UM_LOG_STR];
+};
+
+// Bounded multi-producer ring. A slot whose seq equals the producer
+// position is free to claim, seq = position + 1 publishes it to the
+// consumer, which hands it back one lap later. A full ring drops the
+// message rather than wait.
+static struct log_rec ring[UM_LOG_RING];
+static unsigned int ring_head;
+static unsigned int ring_tail;          // owned by the flushing thread
+static unsigned int ring_dropped;
+static int log_async = 0;
+static pid_t log_pid;
+
+static const char *level_name(int priority)
+{
+    switch (priority) {
+    case LOG_ERR:
+        return "ERROR";
+    case LOG_WARNING:
+        return "WARNING";
+    case LOG_INFO:
+        return "INFO";
+    case LOG_DEBUG:
+    default:
+        return "DEBUG";
+    }
+}
+
+// Parse the conversion at p, just past a '%', into spec and return where
+// it ends. *type is T_BAD for what the records can't hold.
+static const char *next_spec(const char *p, char *spec, size_t len,
+                             enum arg_type *type)
+{
+    const char *start = p - 1;
+    int mod = 0;    // 'h', 'l', 'L' for ll, 'j', 'z', 't' or 'D' for L
+
+    *type = T_BAD;
+
+    while (*p && strchr("-+ #0'", *p)) {
+        p++;
+    }
+    while (*p >= '0' && *p <= '9') {
+        p++;
+    }
+    if (*p == '$' || *p == '*') {
+        return p;
+    }
+    if (*p == '.') {
+        p++;
+        if (*p == '*') {
+            return p;
+        }
+        while (*p >= '0' && *p <= '9') {
+            p++;
+        }
+    }
+
+    switch (*p) {
+    case 'h':
+        mod = 'h';
+        p += p[1] == 'h' ? 2 : 1;
+        break;
+    case 'l':
+        mod = p[1] == 'l' ? 'L' : 'l';
+        p += p[1] == 'l' ? 2 : 1;
+        break;
+    case 'q':
+        mod = 'L';
+        p++;
+        break;
+    case 'j':
+    case 'z':
+    case 't':
+        mod = *p++;
+        break;
+    case 'L':
+        mod = 'D';
+        p++;
+        break;
+    }
+
+    if (!*p) {
+        return p;
+    }
+
+    switch (*p) {
+    case 'd':
+    case 'i':
+    case 'o':
+    case 'u':
+    case 'x':
+    case 'X':
+    case 'c':
+        *type = mod == 'l' ? T_LONG :
+                mod == 'L' ? T_LLONG :
+                mod == 'j' ? T_INTMAX :
+                mod == 'z' ? T_SIZE :
+                mod == 't' ? T_PTRDIFF :
+                mod == 'D' || (*p == 'c' && mod) ? T_BAD : T_INT;
+        break;
+    case 'e':
+    case 'E':
+    case 'f':
+    case 'F':
+    case 'g':
+    case 'G':
+    case 'a':
+    case 'A':
+        *type = mod == 0 || mod == 'l' ? T_DOUBLE : T_BAD;
+        break;
+    case 's':
+        *type = mod == 0 ? T_STR : T_BAD;
+        break;
+    case 'p':
+        *type = mod == 0 ? T_PTR : T_BAD;
+        break;
+    }
+
+    p++;
+
+    if ((size_t) (p - start) >= len) {
+        *type = T_BAD;
+    } else {
+        memcpy(spec, start, p - start);
+        spec[p - start] = '\0';
+    }
+
+    return p;
+}
+
+// Copy the arguments fmt takes into rec. Returns -1 if it can't.
+static int rec_capture(struct log_rec *rec, const char *fmt, va_list ap)
+{
+    char spec[32];
+    enum arg_type type;
+    unsigned int s = 0;
+    int n = 0;
+
+    for (const char *p = fmt; *p; ) {
+        if (*p++ != '%') {
+            continue;
+        }
+        if (*p == '%') {
+            p++;
+            continue;
+        }
+
+        p = next_spec(p, spec, sizeof(spec), &type);
+        if (type == T_BAD || n == UM_LOG_ARGS) {
+            return -1;
+        }
+
+        union log_arg *a = &rec->arg[n];
+
+        switch (type) {
+        case T_INT:
+            a->i = va_arg(ap, int);
+            break;
+        case T_LONG:
+            a->l = va_arg(ap, long);
+            break;
+        case T_LLONG:
+            a->ll = va_arg(ap, long long);
+            break;
+        case T_INTMAX:
+            a->j = va_arg(ap, intmax_t);
+            break;
+        case T_SIZE:
+            a->z = va_arg(ap, size_t);
+            break;
+        case T_PTRDIFF:
+            a->t = va_arg(ap, ptrdiff_t);
+            break;
+        case T_DOUBLE:
+            a->d = va_arg(ap, double);
+            break;
+        case T_PTR:
+            a->p = va_arg(ap, const void *);
+            break;
+        case T_STR: {
+            // The string may live on the caller's stack, keep a copy
+            const char *str = va_arg(ap, const char *);
+            size_t len;
+
+            if (!str) {
+                str = "(null)";
+            }
+            len = strlen(str);
+            if (s + len + 1 > UM_LOG_STR) {
+                return -1;
+            }
+            memcpy(rec->str + s, str, len + 1);
+            a->s = s;
+            s += (unsigned int) len + 1;
+            break;
+        }
+        default:
+            return -1;
+        }
+
+        rec->type[n++] = (unsigned char) type;
+    }
+
+    rec->fmt = fmt;
+    rec->nargs = n;
+
+    return 0;
+}
+
+// Format the message of rec into buf, truncated to len
+static void rec_format(const struct log_rec *rec, char *buf, size_t len)
+{
+    char spec[32];
+    enum arg_type type;
+    size_t pos = 0;
+    int n = 0;
+    int r;
+
+    if (!rec->fmt) {
+        snprintf(buf, len, "%s", rec->str);
+        return;
+    }
+
+    for (const char *p = rec->fmt; *p && pos + 1 < len; ) {
+        if (*p != '%') {
+            buf[pos++] = *p++;
+            continue;
+        }
+        if (p[1] == '%') {
+            buf[pos++] = '%';
+            p += 2;
+            continue;
+        }
+
+        p = next_spec(p + 1, spec, sizeof(spec), &type);
+
+        const union log_arg *a = &rec->arg[n++];
+
+        switch (type) {
+        case T_INT:
+            r = snprintf(buf + pos, len - pos, spec, a->i);
+            break;
+        case T_LONG:
+            r = snprintf(buf + pos, len - pos, spec, a->l);
+            break;
+        case T_LLONG:
+            r = snprintf(buf + pos, len - pos, spec, a->ll);
+            break;
+        case T_INTMAX:
+            r = snprintf(buf + pos, len - pos, spec, a->j);
+            break;
+        case T_SIZE:
+            r = snprintf(buf + pos, len - pos, spec, a->z);
+            break;
+        case T_PTRDIFF:
+            r = snprintf(buf + pos, len - pos, spec, a->t);
+            break;
+        case T_DOUBLE:
+            r = snprintf(buf + pos, len - pos, spec, a->d);
+            break;
+        case T_PTR:
+            r = snprintf(buf + pos, len - pos, spec, a->p);
+            break;
+        case T_STR:
+            r = snprintf(buf + pos, len - pos, spec, rec->str + a->s);
+            break;
+        default:
+            r = 0;
+            break;
+        }
+
+        if (r > 0) {
+            pos += (size_t) r < len - pos ? (size_t) r : len - pos - 1;
+        }
+    }
+
+    buf[pos] = '\0';
+}
+
+static void rec_push(int priority, const char *fmt, va_list ap)
+{
+    unsigned int pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+    struct log_rec *rec;
+    va_list aq;
+
+    for (;;) {
+        rec = &ring[pos & (UM_LOG_RING - 1)];
+
+        int diff = (int) (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) - pos);
+
+        if (diff == 0) {
+            if (__atomic_compare_exchange_n(&ring_head, &pos, pos + 1, 1,
+                                            __ATOMIC_RELAXED,
+                                            __ATOMIC_RELAXED)) {
+                break;
+            }
+        } else if (diff < 0) {
+            __atomic_fetch_add(&ring_dropped, 1, __ATOMIC_RELAXED);
+            return;
+        } else {
+            pos = __atomic_load_n(&ring_head, __ATOMIC_RELAXED);
+        }
+    }
+
+    rec->priority = priority;
+    rec->time = time(NULL);
+
+    va_copy(aq, ap);
+    if (rec_capture(rec, fmt, aq) < 0) {
+        rec->fmt = NULL;
+        vsnprintf(rec->str, sizeof(rec->str), fmt, ap);
+    }
+    va_end(aq);
+
+    __atomic_store_n(&rec->seq, pos + 1, __ATOMIC_RELEASE);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Output
+/////////////////////////////////////////////////////////////////////
+
+static char out[UM_LOG_OUT];
+static size_t out_len;
+
+static void out_flush(void)
+{
+    size_t done = 0;
+
+    while (done < out_len) {
+        ssize_t r = write(STDERR_FILENO, out + done, out_len - done);
+
+        if (r < 0 && errno == EINTR) {
+            continue;
+        }
+        if (r <= 0) {
+            break;
+        }
+        done += (size_t) r;
+    }
+
+    out_len = 0;
+}
+
+// Write one line, to syslog or batched for stderr
+static void out_line(int priority, time_t t, pid_t pid, const char *msg)
+{
+    char line[UM_LOG_LINE];
+    int n;
+
+    if (use_syslog) {
+        syslog(priority, "%s", msg);
+        return;
+    }
+
+    n = snprintf(line, sizeof(line), "[%lu] %s[%d]: %s: %s\n",
+                 (unsigned long) t, logname, (int) pid,
+                 level_name(priority), msg);
+    if (n < 0) {
+        return;
+    }
+    if ((size_t) n >= sizeof(line)) {
+        n = sizeof(line) - 1;
+        line[n - 1] = '\n';
+    }
+
+    if (out_len + (size_t) n > sizeof(out)) {
+        out_flush();
+    }
+    memcpy(out + out_len, line, n);
+    out_len += (size_t) n;
+}
+
+/////////////////////////////////////////////////////////////////////
+
 void startlog(const char *ident)
 {
     if (use_syslog) {
         openlog(ident, LOG_PID, LOG_USER);
-        setlogmask(LOG_UPTO(loglevel));
+        setlogmask(LOG_UPTO(log_level));
     } else {
         logname = ident;
     }
+
+    for (unsigned int i = 0; i < UM_LOG_RING; i++) {
+        ring[i].seq = i;
+    }
 }
 
 void mylog(int priority, const char *message, ...)
 {
+    char msg[UM_LOG_LINE];
     va_list ap;
 
-    if (use_syslog) {
-        va_start(ap, message);
-        vsyslog(priority, message, ap);
-        va_end(ap);
+    if (priority > log_level) {
+        return;
+    }
+
+    va_start(ap, message);
+
+    if (__atomic_load_n(&log_async, __ATOMIC_RELAXED)) {
+        rec_push(priority, message, ap);
     } else {
-        if (priority > loglevel) {
-            return;
-        }
+        vsnprintf(msg, sizeof(msg), message, ap);
+        out_line(priority, time(NULL), getpid(), msg);
+        out_flush();
+    }
 
-        time_t t = time(NULL);
-        char tmp[256];
-        memset((void *) tmp, 0, sizeof(tmp));
+    va_end(ap);
+}
 
-        char *loglevel;
-        switch (priority) {
-        case LOG_ERR:
-            loglevel = "ERROR";
-            break;
+void log_set_async(int on)
+{
+    if (on) {
+        log_pid = getpid();
+    } else {
+        log_flush(0);
+    }
 
-        case LOG_WARNING:
-            loglevel = "WARNING";
-            break;
+    __atomic_store_n(&log_async, on, __ATOMIC_RELAXED);
 
-        case LOG_INFO:
-            loglevel = "INFO";
-            break;
+    if (!on) {
+        // Whatever came in while switching over
+        log_flush(0);
+    }
+}
 
-        case LOG_DEBUG:
-        default:
-            loglevel = "DEBUG";
+int log_flush(int max)
+{
+    char msg[UM_LOG_LINE];
+    unsigned int dropped;
+    int n = 0;
+
+    while (max <= 0 || n < max) {
+        struct log_rec *rec = &ring[ring_tail & (UM_LOG_RING - 1)];
+
+        if (__atomic_load_n(&rec->seq, __ATOMIC_ACQUIRE) != ring_tail + 1) {
             break;
         }
 
-        snprintf(tmp, sizeof(tmp), "[%lu] %s[%d]: %s: ",
-                 t, logname, getpid(), loglevel);
+        rec_format(rec, msg, sizeof(msg));
+        out_line(rec->priority, rec->time, log_pid, msg);
+
+        __atomic_store_n(&rec->seq, ring_tail + UM_LOG_RING,
+                         __ATOMIC_RELEASE);
+        ring_tail++;
+        n++;
+    }
+
+    dropped = __atomic_exchange_n(&ring_dropped, 0, __ATOMIC_RELAXED);
+    if (dropped > 0) {
+        snprintf(msg, sizeof(msg), "%u log messages dropped, ring full",
+                 dropped);
+        out_line(LOG_WARNING, time(NULL), log_pid, msg);
+    }
+
+    out_flush();
+
+    return n;
+}
+
+// Token bucket per call site. The pipeline threads may share a site with
+// the loop; a race there only miscounts, it never blocks.
+int log_ratelimit(struct log_ratelimit *rl, int priority, const char *fmt)
+{
+    int64_t now;
+
+    if (priority > log_level) {
+        return 0;
+    }
+
+    // Only the loop runs hot, startup and shutdown log everything
+    if (!__atomic_load_n(&log_async, __ATOMIC_RELAXED) && !rl->suppressed) {
+        return 1;
+    }
+
+    // A token every 1000 / UM_LOG_RATE ms, what is left over carries on
+    now = um_clock_now();
+    if (rl->last == 0) {
+        // First message from the site, or the loop hasn't read the clock
+        rl->tokens = UM_LOG_BURST;
+        rl->last = now;
+    } else if (now - rl->last >= 1000 / UM_LOG_RATE) {
+        int64_t add = (now - rl->last) * UM_LOG_RATE / 1000;
+
+        if (add >= UM_LOG_BURST - rl->tokens) {
+            rl->tokens = UM_LOG_BURST;
+            rl->last = now;
+        } else {
+            rl->tokens += (int) add;
+            rl->last += add * 1000 / UM_LOG_RATE;
+        }
+    }
+
+    if (rl->tokens == 0 && __atomic_load_n(&log_async, __ATOMIC_RELAXED)) {
+        rl->suppressed++;
+        return 0;
+    }
 
-        char out[strlen(tmp) + strlen(message) + 2];
-        snprintf(out, sizeof(out), "%s%s\n", tmp, message);
+    if (rl->tokens > 0) {
+        rl->tokens--;
+    }
 
-        va_start(ap, message);
-        vfprintf(stderr, out, ap);
-        va_end(ap);
+    if (rl->suppressed) {
+        mylog(LOG_WARNING, "%u messages suppressed like \"%s\"",
+              rl->suppressed, fmt);
+        rl->suppressed = 0;
     }
+
+    return 1;
 }
 
 void endlog(void)
 {
+    log_set_async(0);
+
     if (use_syslog) {
         closelog();
     }
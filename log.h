@@ -1,17 +1,60 @@
 #ifndef _incl_LOG_H
 #define _incl_LOG_H
 
+#include <stdint.h>
 #include <syslog.h>
 
+// Messages less important than UM_LOG_LEVEL are compiled out, so their
+// arguments aren't even evaluated. Build with -DUM_LOG_LEVEL=LOG_INFO to
+// drop log_debug().
+#ifndef UM_LOG_LEVEL
+#define UM_LOG_LEVEL        LOG_DEBUG
+#endif
+
 extern int use_syslog;
+// Least important priority logged, LOG_INFO unless set before startlog()
+extern int log_level;
 
 void startlog(const char *ident);
 void mylog(int priority, const char *message, ...);
 void endlog(void);
 
-#define log_err(msg...)     mylog(LOG_ERR, msg)
-#define log_warn(msg...)    mylog(LOG_WARNING, msg)
-#define log_info(msg...)    mylog(LOG_INFO, msg)
-#define log_debug(msg...)   mylog(LOG_DEBUG, msg)
+// While on, messages are queued in memory and only formatted and written
+// by log_flush(), which the event loop calls when it is about to wait.
+// Turning it off flushes what is queued.
+void log_set_async(int on);
+// Write up to max queued messages, all of them if max <= 0. Returns the
+// number written. Only one thread may flush.
+int log_flush(int max);
+
+// Each log_* call site may log UM_LOG_RATE messages a second, in bursts of
+// up to UM_LOG_BURST, while the event loop runs. What is over is counted,
+// and the next message let through from the site is preceded by how many
+// were suppressed. Call mylog() directly to log without a limit.
+#define UM_LOG_RATE         10
+#define UM_LOG_BURST        20
+
+struct log_ratelimit {
+    int64_t         last;       // um_clock_now() tokens were added at
+    int             tokens;
+    unsigned int    suppressed;
+};
+
+// Returns 1 if a message of priority from the site of rl may be logged
+int log_ratelimit(struct log_ratelimit *rl, int priority, const char *fmt);
+
+#define log_rl(priority, fmt, args...)                                  \
+    do {                                                                \
+        static struct log_ratelimit log_rl_;                            \
+        if ((priority) <= UM_LOG_LEVEL && (priority) <= log_level &&    \
+            log_ratelimit(&log_rl_, priority, fmt)) {                   \
+            mylog(priority, fmt, ##args);                               \
+        }                                                               \
+    } while (0)
+
+#define log_err(msg...)     log_rl(LOG_ERR, msg)
+#define log_warn(msg...)    log_rl(LOG_WARNING, msg)
+#define log_info(msg...)    log_rl(LOG_INFO, msg)
+#define log_debug(msg...)   log_rl(LOG_DEBUG, msg)
 
 #endif /* _incl_LOG_H */
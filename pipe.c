@@ -0,0 +1,90 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pipe.h"
+
+int um_spsc_init(struct um_spsc *r, unsigned int size)
+{
+    memset(r, 0, sizeof(*r));
+
+    if (size == 0 || (size & (size - 1))) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    if (posix_memalign((void **) &r->slot, 64, size * sizeof(*r->slot))) {
+        r->slot = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    r->mask = size - 1;
+
+    return 0;
+}
+
+void um_spsc_free(struct um_spsc *r)
+{
+    free(r->slot);
+    r->slot = NULL;
+}
+
+#ifdef UM_HAVE_PIPELINE
+
+#define UM_BELL_SPIN        2048    // polls of the ring before sleeping
+
+int um_bell_init(struct um_bell *b)
+{
+    b->sleeping = 0;
+
+    if (pthread_mutex_init(&b->lock, NULL) != 0) {
+        return -1;
+    }
+    if (pthread_cond_init(&b->cond, NULL) != 0) {
+        pthread_mutex_destroy(&b->lock);
+        return -1;
+    }
+
+    return 0;
+}
+
+void um_bell_destroy(struct um_bell *b)
+{
+    pthread_cond_destroy(&b->cond);
+    pthread_mutex_destroy(&b->lock);
+}
+
+// Return once r has something to pop or *stop is set. Spins for a while
+// first, a busy ring never gets as far as the lock.
+void um_bell_wait(struct um_bell *b, const struct um_spsc *r,
+                  const int *stop)
+{
+    for (int i = 0; i < UM_BELL_SPIN; i++) {
+        if (!um_spsc_empty(r) || __atomic_load_n(stop, __ATOMIC_RELAXED)) {
+            return;
+        }
+    }
+
+    pthread_mutex_lock(&b->lock);
+
+    // Either the producer sees sleeping set, or this sees its push
+    __atomic_store_n(&b->sleeping, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+
+    while (um_spsc_empty(r) && !__atomic_load_n(stop, __ATOMIC_RELAXED)) {
+        pthread_cond_wait(&b->cond, &b->lock);
+    }
+
+    __atomic_store_n(&b->sleeping, 0, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&b->lock);
+}
+
+void um_bell_wake(struct um_bell *b)
+{
+    pthread_mutex_lock(&b->lock);
+    pthread_cond_signal(&b->cond);
+    pthread_mutex_unlock(&b->lock);
+}
+
+#endif /* UM_HAVE_PIPELINE */
@@ -0,0 +1,96 @@
+#ifndef _incl_PIPE_H
+#define _incl_PIPE_H
+
+#include "udpmask.h"
+
+#include <stddef.h>
+
+// Lock-free ring of pointers between one producer and one consumer thread.
+// Each side keeps a stale copy of the other's index and only rereads it
+// when the ring looks full or empty.
+struct um_spsc {
+    // Producer
+    unsigned int        head __attribute__((aligned(64)));
+    unsigned int        tail_cache;
+
+    // Consumer
+    unsigned int        tail __attribute__((aligned(64)));
+    unsigned int        head_cache;
+
+    unsigned int        mask __attribute__((aligned(64)));
+    void              **slot;
+};
+
+int um_spsc_init(struct um_spsc *r, unsigned int size);
+void um_spsc_free(struct um_spsc *r);
+
+// Returns 0, or -1 if the ring is full
+static inline int um_spsc_push(struct um_spsc *r, void *p)
+{
+    if (r->head - r->tail_cache > r->mask) {
+        r->tail_cache = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+        if (r->head - r->tail_cache > r->mask) {
+            return -1;
+        }
+    }
+
+    r->slot[r->head & r->mask] = p;
+    __atomic_store_n(&r->head, r->head + 1, __ATOMIC_RELEASE);
+
+    return 0;
+}
+
+// Returns the oldest entry, or NULL if the ring is empty
+static inline void *um_spsc_pop(struct um_spsc *r)
+{
+    void *p;
+
+    if (r->tail == r->head_cache) {
+        r->head_cache = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+        if (r->tail == r->head_cache) {
+            return NULL;
+        }
+    }
+
+    p = r->slot[r->tail & r->mask];
+    __atomic_store_n(&r->tail, r->tail + 1, __ATOMIC_RELEASE);
+
+    return p;
+}
+
+// Consumer side
+static inline int um_spsc_empty(const struct um_spsc *r)
+{
+    return r->tail == __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+}
+
+#ifdef UM_HAVE_PIPELINE
+
+#include <pthread.h>
+
+// Lets the consumer of a ring sleep once it ran dry. The producer only
+// takes the lock when the consumer says it is asleep.
+struct um_bell {
+    pthread_mutex_t     lock;
+    pthread_cond_t      cond;
+    int                 sleeping;
+};
+
+int um_bell_init(struct um_bell *b);
+void um_bell_destroy(struct um_bell *b);
+void um_bell_wait(struct um_bell *b, const struct um_spsc *r,
+                  const int *stop);
+void um_bell_wake(struct um_bell *b);
+
+// Call after pushing to the ring the bell's consumer pops from
+static inline void um_bell_ring(struct um_bell *b)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&b->sleeping, __ATOMIC_RELAXED)) {
+        um_bell_wake(b);
+    }
+}
+
+#endif /* UM_HAVE_PIPELINE */
+
+#endif /* _incl_PIPE_H */
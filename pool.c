@@ -0,0 +1,103 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "pool.h"
+
+int um_pool_init(struct um_pool *pool, int n_small, int n_large)
+{
+    size_t size = (size_t) n_small * UM_POOL_SLAB +
+                  (size_t) n_large * UM_POOL_LARGE;
+    unsigned char *p;
+
+    memset(pool, 0, sizeof(*pool));
+
+    pool->desc = calloc(n_small + n_large, sizeof(*pool->desc));
+    if (!pool->desc || posix_memalign((void **) &pool->mem, 64, size) != 0) {
+        free(pool->desc);
+        pool->desc = NULL;
+        pool->mem = NULL;
+        return -1;
+    }
+
+    p = pool->mem;
+    pool->n[0] = n_small;
+    pool->n[1] = n_large;
+
+    for (int i = 0; i < n_small + n_large; i++) {
+        struct um_pkt *pkt = &pool->desc[i];
+        int large = i >= n_small;
+
+        pkt->data = p;
+        pkt->large = (uint8_t) large;
+        pkt->next = pool->free[large];
+        pool->free[large] = pkt;
+        pool->avail[large]++;
+
+        p += large ? UM_POOL_LARGE : UM_POOL_SLAB;
+    }
+
+    return 0;
+}
+
+void um_pool_free(struct um_pool *pool)
+{
+    free(pool->desc);
+    free(pool->mem);
+    memset(pool, 0, sizeof(*pool));
+}
+
+// A packet with room for len bytes and one reference, or NULL if the pool
+// is out of them. Small datagrams spill into the overflow class.
+struct um_pkt *um_pool_get(struct um_pool *pool, size_t len)
+{
+    struct um_pkt *pkt;
+    int large = len > UM_POOL_SLAB;
+
+    if (len > UM_POOL_LARGE) {
+        return NULL;
+    }
+
+    if (!pool->free[large] && !large) {
+        large = 1;
+    }
+
+    pkt = pool->free[large];
+    if (!pkt) {
+        return NULL;
+    }
+
+    pool->free[large] = pkt->next;
+    pool->avail[large]--;
+
+    pkt->next = NULL;
+    pkt->len = 0;
+    pkt->has_to = 0;
+    pkt->flow = -1;
+
+    return pkt;
+}
+
+void um_pool_put(struct um_pool *pool, struct um_pkt *pkt)
+{
+    pkt->next = pool->free[pkt->large];
+    pool->free[pkt->large] = pkt;
+    pool->avail[pkt->large]++;
+}
+
+void um_txq_clear(struct um_txq *q, struct um_pool *pool)
+{
+    struct um_pkt *pkt;
+
+    while ((pkt = um_txq_pop(q))) {
+        um_pool_put(pool, pkt);
+    }
+}
+
+void um_txq_disown(struct um_txq *q, int flow)
+{
+    for (struct um_pkt *pkt = q->head; pkt; pkt = pkt->next) {
+        if (pkt->flow == flow) {
+            pkt->flow = -1;
+        }
+    }
+}
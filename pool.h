@@ -0,0 +1,99 @@
+#ifndef _incl_POOL_H
+#define _incl_POOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <netinet/in.h>
+
+#include "addr.h"
+#include "udpmask.h"
+
+#define UM_POOL_SLAB        2048    // an MTU sized datagram plus mask
+#define UM_POOL_LARGE       ((UM_BUFFER + 63) & ~63)
+#define UM_POOL_SMALL_N     1024
+#define UM_POOL_LARGE_N     16
+
+struct um_transform;
+
+// A datagram waiting to be sent, data is a slab of the pool
+struct um_pkt {
+    struct um_pkt      *next;       // free list or queue link
+    unsigned char      *data;
+    uint32_t            len;
+    uint8_t             large;      // data is from the overflow class
+    uint8_t             has_to;     // to is set, else the socket is connected
+    uint8_t             op;         // enum um_transform_op still to apply
+    uint8_t             dir;        // enum um_dir
+    int                 flow;       // map index, -1 if none
+    int                 sock;       // to send on, when handed between threads
+    struct um_transform *ctx;       // mask op is applied with, likewise
+    union um_sockaddr   to;
+};
+
+// Preallocated packets in two classes, MTU sized slabs and an overflow
+// class for anything larger
+struct um_pool {
+    struct um_pkt      *desc;
+    unsigned char      *mem;
+    struct um_pkt      *free[2];
+    int                 avail[2];
+    int                 n[2];
+};
+
+// FIFO of packets waiting for a socket to become writable
+struct um_txq {
+    struct um_pkt      *head;
+    struct um_pkt      *tail;
+    int                 n;
+    int                 sock;
+    int                 idx;        // event index of sock
+    int                 dir;        // enum um_dir of the traffic
+};
+
+int um_pool_init(struct um_pool *pool, int n_small, int n_large);
+void um_pool_free(struct um_pool *pool);
+struct um_pkt *um_pool_get(struct um_pool *pool, size_t len);
+void um_pool_put(struct um_pool *pool, struct um_pkt *pkt);
+
+static inline void um_txq_init(struct um_txq *q, int sock, int idx, int dir)
+{
+    q->head = q->tail = NULL;
+    q->n = 0;
+    q->sock = sock;
+    q->idx = idx;
+    q->dir = dir;
+}
+
+static inline void um_txq_push(struct um_txq *q, struct um_pkt *pkt)
+{
+    pkt->next = NULL;
+    if (q->tail) {
+        q->tail->next = pkt;
+    } else {
+        q->head = pkt;
+    }
+    q->tail = pkt;
+    q->n++;
+}
+
+static inline struct um_pkt *um_txq_pop(struct um_txq *q)
+{
+    struct um_pkt *pkt = q->head;
+
+    if (pkt) {
+        q->head = pkt->next;
+        if (!q->head) {
+            q->tail = NULL;
+        }
+        q->n--;
+    }
+
+    return pkt;
+}
+
+// Drop every queued packet
+void um_txq_clear(struct um_txq *q, struct um_pool *pool);
+// Mark the packets of flow as no one's, it is going away
+void um_txq_disown(struct um_txq *q, int flow);
+
+#endif /* _incl_POOL_H */
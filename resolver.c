@@ -0,0 +1,195 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include "resolver.h"
+
+// Blocking lookup of an address of family, or of either family in the
+// order getaddrinfo() prefers. Returns 0 and fills addr on success.
+int resolver_lookup(const char *host, int family, union um_sockaddr *addr)
+{
+    struct addrinfo hints, *res, *ai;
+    int r = -1;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_family = family;
+    hints.ai_socktype = SOCK_DGRAM;
+    hints.ai_flags = AI_ADDRCONFIG;
+
+    if (getaddrinfo(host, NULL, &hints, &res) != 0) {
+        return -1;
+    }
+
+    for (ai = res; ai; ai = ai->ai_next) {
+        if ((ai->ai_family == AF_INET || ai->ai_family == AF_INET6) &&
+            ai->ai_addrlen <= sizeof(*addr)) {
+            memset(addr, 0, sizeof(*addr));
+            memcpy(addr, ai->ai_addr, ai->ai_addrlen);
+            um_sockaddr_set_port(addr, 0);
+            r = 0;
+            break;
+        }
+    }
+
+    freeaddrinfo(res);
+    return r;
+}
+
+// The child needs nothing but sock. A socket it kept from the event loop
+// would stay open after the loop closes it, and a connected one would go
+// on taking its peer's datagrams.
+static void close_inherited(int sock)
+{
+#ifdef SYS_close_range
+    if ((sock == 0 || syscall(SYS_close_range, 0, sock - 1, 0) == 0) &&
+        syscall(SYS_close_range, sock + 1, ~0U, 0) == 0) {
+        return;
+    }
+#endif
+
+    long max = sysconf(_SC_OPEN_MAX);
+
+    for (int fd = 0; fd < max; fd++) {
+        if (fd != sock) {
+            close(fd);
+        }
+    }
+}
+
+static void resolver_main(int sock)
+{
+    struct um_resolve_req req;
+    struct um_resolve_rep rep;
+    ssize_t len;
+
+    signal(SIGHUP, SIG_DFL);
+    signal(SIGINT, SIG_DFL);
+    signal(SIGTERM, SIG_DFL);
+
+    // Serve requests until the event loop closes its end
+    while ((len = recv(sock, &req, sizeof(req), 0)) != 0) {
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        if ((size_t) len != sizeof(req)) {
+            continue;
+        }
+
+        req.host[sizeof(req.host) - 1] = '\0';
+
+        memset(&rep, 0, sizeof(rep));
+        rep.tag = req.tag;
+        rep.ok = resolver_lookup(req.host, req.family, &rep.addr) == 0;
+
+        if (send(sock, &rep, sizeof(rep), 0) < 0 && errno != EINTR) {
+            break;
+        }
+    }
+
+    close(sock);
+    _exit(0);
+}
+
+int resolver_start(struct um_resolver *res)
+{
+    int sv[2];
+
+    res->sock = -1;
+    res->pid = -1;
+
+    if (socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) < 0) {
+        return -1;
+    }
+
+    res->pid = fork();
+    if (res->pid < 0) {
+        close(sv[0]);
+        close(sv[1]);
+        return -1;
+    }
+
+    if (res->pid == 0) {
+        close_inherited(sv[1]);
+        resolver_main(sv[1]);
+    }
+
+    close(sv[1]);
+
+    int flags = fcntl(sv[0], F_GETFL, 0);
+    if (flags < 0 || fcntl(sv[0], F_SETFL, flags | O_NONBLOCK) < 0) {
+        res->sock = sv[0];
+        resolver_stop(res);
+        return -1;
+    }
+
+    res->sock = sv[0];
+
+    return 0;
+}
+
+void resolver_stop(struct um_resolver *res)
+{
+    if (res->sock >= 0) {
+        close(res->sock);
+        res->sock = -1;
+    }
+
+    if (res->pid > 0) {
+        // Don't wait for a lookup that may be stuck
+        kill(res->pid, SIGTERM);
+        waitpid(res->pid, NULL, 0);
+        res->pid = -1;
+    }
+}
+
+// Returns 0 once the request is queued, -1 otherwise
+int resolver_request(struct um_resolver *res, uint32_t tag, int family,
+                     const char *host)
+{
+    struct um_resolve_req req;
+
+    memset(&req, 0, sizeof(req));
+    req.tag = tag;
+    req.family = family;
+    strncpy(req.host, host, sizeof(req.host) - 1);
+
+    if (send(res->sock, &req, sizeof(req), 0) < 0) {
+        return -1;
+    }
+
+    return 0;
+}
+
+// Returns 1 and fills rep when a reply is ready, 0 if none is pending and
+// -1 if the child is gone
+int resolver_reply(struct um_resolver *res, struct um_resolve_rep *rep)
+{
+    ssize_t len;
+
+    for (;;) {
+        len = recv(res->sock, rep, sizeof(*rep), 0);
+
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return errno == EAGAIN || errno == EWOULDBLOCK ? 0 : -1;
+        }
+        if (len == 0) {
+            return -1;
+        }
+        if ((size_t) len == sizeof(*rep)) {
+            return 1;
+        }
+    }
+}
@@ -0,0 +1,38 @@
+#ifndef _incl_RESOLVER_H
+#define _incl_RESOLVER_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <netinet/in.h>
+
+#include "addr.h"
+
+#define UM_HOST_LEN     256
+
+struct um_resolve_req {
+    uint32_t            tag;
+    int                 family;     // AF_UNSPEC for any
+    char                host[UM_HOST_LEN];
+};
+
+struct um_resolve_rep {
+    uint32_t            tag;
+    int                 ok;
+    union um_sockaddr   addr;       // port 0
+};
+
+// Lookups run in a child process so the event loop never blocks on DNS
+struct um_resolver {
+    int                 sock;   // -1 if the child could not be started
+    pid_t               pid;
+};
+
+int resolver_lookup(const char *host, int family, union um_sockaddr *addr);
+
+int resolver_start(struct um_resolver *res);
+void resolver_stop(struct um_resolver *res);
+int resolver_request(struct um_resolver *res, uint32_t tag, int family,
+                     const char *host);
+int resolver_reply(struct um_resolver *res, struct um_resolve_rep *rep);
+
+#endif /* _incl_RESOLVER_H */
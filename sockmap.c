@@ -0,0 +1,295 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "log.h"
+#include "sockmap.h"
+#include "udpmask.h"
+
+static int slot_alloc(struct um_sockmap_tab *tab, int cap)
+{
+    unsigned int bits = 1;
+    void *p;
+
+    // Keep the load factor at or below 1/2
+    while ((1U << bits) < (unsigned int) cap * 2) {
+        bits++;
+    }
+
+    if (posix_memalign(&p, 64, sizeof(*tab->slot) << bits) != 0) {
+        return -1;
+    }
+
+    memset(p, 0, sizeof(*tab->slot) << bits);
+    tab->slot = p;
+    tab->slot_bits = bits;
+
+    return 0;
+}
+
+static void slot_put(struct um_sockmap_tab *tab, int idx)
+{
+    unsigned int mask = (1U << tab->slot_bits) - 1;
+    struct um_flow_key key;
+    uint32_t hash;
+    unsigned int h;
+
+    um_flow_key_of(&key, &tab->ent[idx].from);
+    key.tunnel = (uint8_t) tab->ent[idx].tunnel;
+    hash = um_sockmap_hash(&key);
+    h = hash & mask;
+
+    while (tab->slot[h].key.family) {
+        h = (h + 1) & mask;
+    }
+
+    tab->slot[h].key = key;
+    tab->slot[h].hash = hash;
+    tab->slot[h].sock = tab->ent[idx].sock;
+    tab->slot[h].idx = idx;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Timer wheel
+/////////////////////////////////////////////////////////////////////
+
+static inline int *wheel_head(struct um_sockmap_tab *tab, time_t expire)
+{
+    return &tab->wheel[(unsigned long) expire % UM_WHEEL_SIZE];
+}
+
+static void wheel_link(struct um_sockmap_tab *tab, int *head, int idx,
+                       time_t expire)
+{
+    struct um_sockmap *e = &tab->ent[idx];
+
+    e->expire = expire;
+    e->wheel_prev = -1;
+    e->wheel_next = *head;
+    if (*head >= 0) {
+        tab->ent[*head].wheel_prev = idx;
+    }
+    *head = idx;
+}
+
+static void wheel_unlink(struct um_sockmap_tab *tab, int *head, int idx)
+{
+    struct um_sockmap *e = &tab->ent[idx];
+
+    if (e->wheel_prev >= 0) {
+        tab->ent[e->wheel_prev].wheel_next = e->wheel_next;
+    } else {
+        *head = e->wheel_next;
+    }
+    if (e->wheel_next >= 0) {
+        tab->ent[e->wheel_next].wheel_prev = e->wheel_prev;
+    }
+
+    e->expire = TIME_INVALID;
+}
+
+// Unlink and return the next entry idle for at least timeout seconds as of
+// now, or -1. Call until it returns -1; entries deleted in between, those
+// still waiting to be looked at included, are skipped.
+int um_sockmap_expired(struct um_sockmap_tab *tab, time_t now)
+{
+    if (tab->timeout <= 0 || tab->wheel_time == TIME_INVALID) {
+        return -1;
+    }
+
+    for (;;) {
+        while (tab->wheel_due >= 0) {
+            int idx = tab->wheel_due;
+            struct um_sockmap *e = &tab->ent[idx];
+            time_t deadline = e->last_use == TIME_INVALID ?
+                              e->expire : e->last_use + tab->timeout;
+
+            wheel_unlink(tab, &tab->wheel_due, idx);
+
+            if (deadline <= now) {
+                return idx;
+            }
+
+            wheel_link(tab, wheel_head(tab, deadline), idx, deadline);
+        }
+
+        if (tab->wheel_time >= now) {
+            return -1;
+        }
+
+        // A full turn visits every slot, skip the rest of a long gap
+        if (now - tab->wheel_time > UM_WHEEL_SIZE) {
+            tab->wheel_time = now - UM_WHEEL_SIZE;
+        }
+
+        tab->wheel_time++;
+        tab->wheel_due = *wheel_head(tab, tab->wheel_time);
+        *wheel_head(tab, tab->wheel_time) = -1;
+
+        if (tab->wheel_due >= 0) {
+            tab->ent[tab->wheel_due].wheel_prev = -1;
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+
+static int grow(struct um_sockmap_tab *tab)
+{
+    int cap = tab->cap * 2 < tab->max ? tab->cap * 2 : tab->max;
+    struct um_sockmap_slot *old_slot = tab->slot;
+    unsigned int old_bits = tab->slot_bits;
+    struct um_sockmap *ent;
+    int *free_idx;
+
+    if (cap <= tab->cap) {
+        return -1;
+    }
+
+    ent = realloc(tab->ent, sizeof(*ent) * cap);
+    if (!ent) {
+        return -1;
+    }
+    tab->ent = ent;
+    memset(ent + tab->cap, 0, sizeof(*ent) * (cap - tab->cap));
+
+    free_idx = realloc(tab->free, sizeof(*free_idx) * cap);
+    if (!free_idx) {
+        return -1;
+    }
+    tab->free = free_idx;
+
+    if (slot_alloc(tab, cap) < 0) {
+        tab->slot = old_slot;
+        tab->slot_bits = old_bits;
+        return -1;
+    }
+
+    // Lowest new index on top of the stack
+    for (int i = cap - 1; i >= tab->cap; i--) {
+        tab->free[tab->free_n++] = i;
+    }
+    tab->cap = cap;
+
+    for (int i = 0; i < tab->cap; i++) {
+        if (tab->ent[i].in_use) {
+            slot_put(tab, i);
+        }
+    }
+
+    free(old_slot);
+
+    log_debug("Grew sockmap to %d entries", cap);
+
+    return 0;
+}
+
+int um_sockmap_init(struct um_sockmap_tab *tab, int max, int timeout)
+{
+    memset(tab, 0, sizeof(*tab));
+
+    tab->max = max;
+    tab->timeout = timeout;
+    tab->wheel_due = -1;
+    tab->wheel_time = TIME_INVALID;
+
+    for (int i = 0; i < UM_WHEEL_SIZE; i++) {
+        tab->wheel[i] = -1;
+    }
+
+    tab->cap = max < UM_SOCKMAP_INIT ? max : UM_SOCKMAP_INIT;
+    tab->ent = calloc(tab->cap, sizeof(*tab->ent));
+    tab->free = calloc(tab->cap, sizeof(*tab->free));
+
+    if (!tab->ent || !tab->free || slot_alloc(tab, tab->cap) < 0) {
+        um_sockmap_free(tab);
+        return -1;
+    }
+
+    for (int i = tab->cap - 1; i >= 0; i--) {
+        tab->free[tab->free_n++] = i;
+    }
+
+    return 0;
+}
+
+void um_sockmap_free(struct um_sockmap_tab *tab)
+{
+    free(tab->ent);
+    free(tab->free);
+    free(tab->slot);
+    memset(tab, 0, sizeof(*tab));
+}
+
+// The entry expires one second from now unless last_use gets set, and
+// timeout seconds after last_use otherwise
+int um_sockmap_ins(struct um_sockmap_tab *tab, int sock, int tunnel,
+                   const union um_sockaddr *addr, time_t now)
+{
+    int idx;
+
+    if (tab->free_n == 0 && grow(tab) < 0) {
+        return -1;
+    }
+
+    idx = tab->free[--tab->free_n];
+
+    tab->ent[idx].in_use = 1;
+    tab->ent[idx].sock = sock;
+    tab->ent[idx].tunnel = tunnel;
+    tab->ent[idx].last_use = TIME_INVALID;
+    tab->ent[idx].from = *addr;
+    tab->ent[idx].reply_sock = -1;
+    memset(&tab->ent[idx].conn, 0, sizeof(tab->ent[idx].conn));
+    memset(&tab->ent[idx].stats, 0, sizeof(tab->ent[idx].stats));
+    tab->used++;
+
+    slot_put(tab, idx);
+
+    if (tab->wheel_time == TIME_INVALID) {
+        tab->wheel_time = now;
+    }
+    wheel_link(tab, wheel_head(tab, now + 1), idx, now + 1);
+
+    return idx;
+}
+
+void um_sockmap_del(struct um_sockmap_tab *tab, int idx)
+{
+    unsigned int mask = (1U << tab->slot_bits) - 1;
+    const struct um_sockmap *e = &tab->ent[idx];
+    struct um_flow_key key;
+    unsigned int i;
+
+    um_flow_key_of(&key, &e->from);
+    key.tunnel = (uint8_t) e->tunnel;
+    i = um_sockmap_hash(&key) & mask;
+
+    while (tab->slot[i].idx != idx || !tab->slot[i].key.family) {
+        i = (i + 1) & mask;
+    }
+
+    // Backward shift deletion, no tombstones left behind
+    for (unsigned int j = (i + 1) & mask; tab->slot[j].key.family;
+         j = (j + 1) & mask) {
+        unsigned int h = tab->slot[j].hash & mask;
+
+        // Move slot j into the hole unless its home lies in (i, j]
+        if (((j - h) & mask) >= ((j - i) & mask)) {
+            tab->slot[i] = tab->slot[j];
+            i = j;
+        }
+    }
+
+    tab->slot[i].key.family = 0;
+
+    // The head of the detached slot has no wheel slot of its own
+    if (tab->wheel_due == idx) {
+        wheel_unlink(tab, &tab->wheel_due, idx);
+    } else if (e->expire != TIME_INVALID) {
+        wheel_unlink(tab, wheel_head(tab, e->expire), idx);
+    }
+
+    tab->ent[idx].in_use = 0;
+    tab->free[tab->free_n++] = idx;
+    tab->used--;
+}
@@ -0,0 +1,93 @@
+#ifndef _incl_SOCKMAP_H
+#define _incl_SOCKMAP_H
+
+#include <stdint.h>
+#include <time.h>
+#include <netinet/in.h>
+
+#include "addr.h"
+#include "pool.h"
+#include "stats.h"
+
+#define UM_SOCKMAP_INIT     16      // initial number of entries
+#define UM_WHEEL_SIZE       256     // one second timer wheel slots
+
+struct um_sockmap {
+    int                 in_use;
+    int                 sock;
+    int                 tunnel;
+    int                 pending;    // owned by the event loop
+    int                 reply_sock; // connected to the client, or -1
+    int                 reply_pending;
+    struct um_flow_key  conn;       // address sock is connected to, if any
+    struct um_txq       txq;        // waiting for sock to become writable
+    struct um_txq       reply_txq;
+    time_t              last_use;
+    time_t              expire;     // wheel deadline, TIME_INVALID if unarmed
+    int                 wheel_next;
+    int                 wheel_prev;
+    union um_sockaddr   from;
+    struct um_flow_stats stats;
+};
+
+// Open addressing index, 32 bytes so two share a line
+struct um_sockmap_slot {
+    struct um_flow_key  key;        // family 0 if unused
+    int32_t             sock;
+    int32_t             idx;
+    uint32_t            hash;       // home slot, before masking
+};
+
+struct um_sockmap_tab {
+    struct um_sockmap       *ent;   // indices are stable while in use
+    int                      cap;
+    int                      used;
+    int                      max;
+    int                     *free;  // stack of unused indices
+    int                      free_n;
+    struct um_sockmap_slot  *slot;
+    unsigned int             slot_bits;
+
+    // Idle expiry. Entries sit in the slot of their deadline and are only
+    // looked at when it comes up, refreshing last_use doesn't touch the
+    // wheel. An entry still in use is moved to its new deadline then.
+    int                      timeout;
+    int                      wheel[UM_WHEEL_SIZE];
+    int                      wheel_due;     // detached slot being expired
+    time_t                   wheel_time;    // last second expired
+};
+
+int um_sockmap_init(struct um_sockmap_tab *tab, int max, int timeout);
+void um_sockmap_free(struct um_sockmap_tab *tab);
+int um_sockmap_ins(struct um_sockmap_tab *tab, int sock, int tunnel,
+                   const union um_sockaddr *addr, time_t now);
+void um_sockmap_del(struct um_sockmap_tab *tab, int idx);
+int um_sockmap_expired(struct um_sockmap_tab *tab, time_t now);
+
+static inline uint32_t um_sockmap_hash(const struct um_flow_key *key)
+{
+    return (uint32_t) (um_flow_key_hash(key) >> 32);
+}
+
+// Returns the index of the entry for key and stores its socket in *sock,
+// or returns -1
+static inline int um_sockmap_find(const struct um_sockmap_tab *tab,
+                                  const struct um_flow_key *key, int *sock)
+{
+    unsigned int mask = (1U << tab->slot_bits) - 1;
+    unsigned int h = um_sockmap_hash(key) & mask;
+
+    for (;; h = (h + 1) & mask) {
+        const struct um_sockmap_slot *s = &tab->slot[h];
+
+        if (!s->key.family) {
+            return -1;
+        }
+        if (um_flow_key_eq(&s->key, key)) {
+            *sock = s->sock;
+            return s->idx;
+        }
+    }
+}
+
+#endif /* _incl_SOCKMAP_H */
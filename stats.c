@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sockmap.h"
+#include "stats.h"
+#include "udpmask.h"
+
+// Room kept at the end of the reply to say how many flows didn't fit
+#define UM_STATS_TRUNC      32
+
+static const char *dir_name[UM_DIR_N] = { "up", "down" };
+
+struct out {
+    char       *buf;
+    size_t      len;
+    size_t      pos;
+    int         full;
+};
+
+// Append one line, or nothing once a line didn't fit
+static void out_line(struct out *o, const char *fmt, ...)
+{
+    va_list ap;
+    int n;
+
+    if (o->full) {
+        return;
+    }
+
+    va_start(ap, fmt);
+    n = vsnprintf(o->buf + o->pos, o->len - o->pos, fmt, ap);
+    va_end(ap);
+
+    if (n < 0 || (size_t) n >= o->len - o->pos) {
+        o->buf[o->pos] = '\0';
+        o->full = 1;
+        return;
+    }
+
+    o->pos += (size_t) n;
+}
+
+// Write counters as "name value" lines, followed by one line per flow if
+// flows is set. Returns the length written, lines that don't fit in buf
+// are left out. Flows that don't fit are counted in a last "truncated N"
+// line.
+size_t um_stats_format(char *buf, size_t len, const struct um_stats *st,
+                       const struct um_sockmap_tab *map, time_t now,
+                       int flows)
+{
+    struct out o = { buf, len, 0, 0 };
+    char addr[UM_ADDR_STRLEN];
+    int left_out = 0;
+
+    if (len == 0) {
+        return 0;
+    }
+    buf[0] = '\0';
+
+    out_line(&o, "uptime %ld\n", (long) (now - st->start));
+    out_line(&o, "flows %d\n", map->used);
+    out_line(&o, "flows_max %d\n", map->max);
+    out_line(&o, "flows_new %llu\n", (unsigned long long) st->flows_new);
+    out_line(&o, "flows_spare %llu\n",
+             (unsigned long long) st->flows_spare);
+    out_line(&o, "flows_purged %llu\n",
+             (unsigned long long) st->flows_purged);
+
+    for (int d = 0; d < UM_DIR_N; d++) {
+        const struct um_dir_stats *s = &st->dir[d];
+
+        out_line(&o, "%s_rx_pkts %llu\n", dir_name[d],
+                 (unsigned long long) s->rx_pkts);
+        out_line(&o, "%s_rx_bytes %llu\n", dir_name[d],
+                 (unsigned long long) s->rx_bytes);
+        out_line(&o, "%s_tx_pkts %llu\n", dir_name[d],
+                 (unsigned long long) s->tx_pkts);
+        out_line(&o, "%s_tx_bytes %llu\n", dir_name[d],
+                 (unsigned long long) s->tx_bytes);
+        out_line(&o, "%s_drop_transform %llu\n", dir_name[d],
+                 (unsigned long long) s->drop_transform);
+        out_line(&o, "%s_drop_send %llu\n", dir_name[d],
+                 (unsigned long long) s->drop_send);
+        out_line(&o, "%s_drop_eagain %llu\n", dir_name[d],
+                 (unsigned long long) s->drop_eagain);
+        out_line(&o, "%s_drop_queue %llu\n", dir_name[d],
+                 (unsigned long long) s->drop_queue);
+        out_line(&o, "%s_queued %llu\n", dir_name[d],
+                 (unsigned long long) s->queued);
+    }
+
+    out_line(&o, "drop_max_client %llu\n",
+             (unsigned long long) st->drop_max_client);
+    out_line(&o, "drop_no_addr %llu\n",
+             (unsigned long long) st->drop_no_addr);
+    out_line(&o, "drop_sock_err %llu\n",
+             (unsigned long long) st->drop_sock_err);
+
+    if (!flows || o.full) {
+        return o.pos;
+    }
+
+    if (len > UM_STATS_TRUNC) {
+        o.len = len - UM_STATS_TRUNC;
+    }
+
+    for (int i = 0; i < map->cap; i++) {
+        const struct um_sockmap *e = &map->ent[i];
+
+        if (!e->in_use) {
+            continue;
+        }
+
+        if (o.full) {
+            left_out++;
+            continue;
+        }
+
+        out_line(&o, "flow %s tunnel %d idle %ld up_pkts %llu up_bytes %llu "
+                     "down_pkts %llu down_bytes %llu up_queued %u "
+                     "down_queued %u drop_queue %llu\n",
+                 um_sockaddr_str(&e->from, addr, sizeof(addr)), e->tunnel,
+                 e->last_use == TIME_INVALID ? 0L :
+                 (long) (now - e->last_use),
+                 (unsigned long long) e->stats.up_pkts,
+                 (unsigned long long) e->stats.up_bytes,
+                 (unsigned long long) e->stats.down_pkts,
+                 (unsigned long long) e->stats.down_bytes,
+                 e->stats.queued[UM_DIR_UP], e->stats.queued[UM_DIR_DOWN],
+                 (unsigned long long) e->stats.drop_queue);
+        left_out += o.full;
+    }
+
+    if (left_out) {
+        o.len = len;
+        o.full = 0;
+        out_line(&o, "truncated %d\n", left_out);
+    }
+
+    return o.pos;
+}
+
+// Bind a nonblocking UNIX datagram socket at path, replacing a stale one
+int um_stats_open(const char *path)
+{
+    struct sockaddr_un addr;
+    int sock;
+
+    if (strlen(path) >= sizeof(addr.sun_path)) {
+        errno = ENAMETOOLONG;
+        return -1;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strcpy(addr.sun_path, path);
+
+    sock = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sock < 0) {
+        return -1;
+    }
+
+    unlink(path);
+
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        int saved_errno = errno;
+        close(sock);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return sock;
+}
+
+void um_stats_close(int sock, const char *path)
+{
+    if (sock >= 0) {
+        close(sock);
+        if (path) {
+            unlink(path);
+        }
+    }
+}
@@ -0,0 +1,59 @@
+#ifndef _incl_STATS_H
+#define _incl_STATS_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+// Counters are plain integers, each process owns its own and only the
+// event loop writes them. With -T the send thread counts what it sends
+// and drops in a copy of its own, which the loop adds in when it reports.
+
+enum um_dir {
+    UM_DIR_UP,          // from clients towards the remote
+    UM_DIR_DOWN,        // from the remote back to clients
+    UM_DIR_N,
+};
+
+struct um_dir_stats {
+    uint64_t    rx_pkts;
+    uint64_t    rx_bytes;
+    uint64_t    tx_pkts;
+    uint64_t    tx_bytes;
+    uint64_t    drop_transform; // too big or too short to (un)mask
+    uint64_t    drop_send;      // send failed
+    uint64_t    drop_eagain;    // socket buffer full, no room to queue
+    uint64_t    drop_queue;     // socket buffer full, flow's queue too
+    uint64_t    queued;         // waiting for a socket to drain
+};
+
+struct um_stats {
+    time_t              start;
+    struct um_dir_stats dir[UM_DIR_N];
+    uint64_t            flows_new;
+    uint64_t            flows_spare;    // of those, on a spare socket
+    uint64_t            flows_purged;
+    uint64_t            drop_max_client;
+    uint64_t            drop_no_addr;   // remote not resolved yet
+    uint64_t            drop_sock_err;  // no socket for a new flow
+};
+
+struct um_flow_stats {
+    uint64_t    up_pkts;
+    uint64_t    up_bytes;
+    uint64_t    down_pkts;
+    uint64_t    down_bytes;
+    uint64_t    drop_queue;     // no room to queue, in its queue or the pool
+    uint32_t    queued[UM_DIR_N];
+};
+
+struct um_sockmap_tab;
+
+size_t um_stats_format(char *buf, size_t len, const struct um_stats *st,
+                       const struct um_sockmap_tab *map, time_t now,
+                       int flows);
+
+int um_stats_open(const char *path);
+void um_stats_close(int sock, const char *path);
+
+#endif /* _incl_STATS_H */
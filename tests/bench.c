@@ -0,0 +1,433 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+// Loopback benchmark: bench -> udpmask client -> udpmask server -> sink,
+// the sink echoes every datagram back along the same path.
+
+#define BENCH_PORT      29000   // sink, server and client use the next ones
+#define BENCH_BURST     64
+#define BENCH_MIN_SIZE  ((int) sizeof(struct bench_hdr))
+#define BENCH_MAX_SIZE  65000
+#define BENCH_MAX_ARGS  32
+#define BENCH_SAMPLES   2000000 // latencies kept per run, the first ones
+
+struct bench_hdr {
+    uint64_t    seq;
+    uint64_t    ts_ns;
+};
+
+struct bench_result {
+    int         size;
+    long        rate;
+    uint64_t    sent;
+    uint64_t    recv;
+    uint64_t    echoed;
+    double      secs;
+    double      cpu_secs;
+    double      owd_us[3];      // one-way p50, p99, p999
+    double      rtt_us[3];
+};
+
+static const char *udpmask_path = "./udpmask";
+static char *udpmask_args[BENCH_MAX_ARGS];
+static int udpmask_args_n = 0;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + (uint64_t) ts.tv_nsec;
+}
+
+static int usage(void)
+{
+    const char ubuf[] =
+    "Usage: bench [-u udpmask] [-a \"udpmask args\"]\n"
+    "             [-s size[,size...]] [-r pps] [-d seconds]\n"
+    "             [-p base_port] [-o output]\n"
+    "             [-h]\n";
+    fprintf(stderr, ubuf);
+    return 1;
+}
+
+static int udp_sock(uint16_t port)
+{
+    struct sockaddr_in addr;
+    int size = 4 * 1024 * 1024;
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    if (sock < 0) {
+        return -1;
+    }
+
+    setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+    setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+    fcntl(sock, F_SETFL, fcntl(sock, F_GETFL, 0) | O_NONBLOCK);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    addr.sin_port = htons(port);
+
+    if (bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    return sock;
+}
+
+static pid_t spawn_udpmask(const char *mode, uint16_t port,
+                           uint16_t port_conn)
+{
+    char port_s[8], port_conn_s[8];
+    char *argv[BENCH_MAX_ARGS + 16];
+    int argc = 0;
+    pid_t pid;
+
+    snprintf(port_s, sizeof(port_s), "%hu", port);
+    snprintf(port_conn_s, sizeof(port_conn_s), "%hu", port_conn);
+
+    argv[argc++] = (char *) udpmask_path;
+    argv[argc++] = "-m";
+    argv[argc++] = (char *) mode;
+    argv[argc++] = "-l";
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = "-p";
+    argv[argc++] = port_s;
+    argv[argc++] = "-c";
+    argv[argc++] = "127.0.0.1";
+    argv[argc++] = "-o";
+    argv[argc++] = port_conn_s;
+    for (int i = 0; i < udpmask_args_n; i++) {
+        argv[argc++] = udpmask_args[i];
+    }
+    argv[argc] = NULL;
+
+    pid = fork();
+    if (pid == 0) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) {
+            dup2(null, STDERR_FILENO);
+        }
+        execv(udpmask_path, argv);
+        _exit(127);
+    }
+
+    return pid;
+}
+
+static double cpu_children(void)
+{
+    struct rusage ru;
+
+    getrusage(RUSAGE_CHILDREN, &ru);
+    return ru.ru_utime.tv_sec + ru.ru_utime.tv_usec / 1e6 +
+           ru.ru_stime.tv_sec + ru.ru_stime.tv_usec / 1e6;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+    uint64_t x = *(const uint64_t *) a, y = *(const uint64_t *) b;
+    return x < y ? -1 : x > y;
+}
+
+static void percentiles(uint64_t *v, uint64_t n, double *out)
+{
+    const double q[3] = { 0.50, 0.99, 0.999 };
+
+    qsort(v, n, sizeof(*v), cmp_u64);
+
+    for (int i = 0; i < 3; i++) {
+        out[i] = n ? v[(uint64_t) (q[i] * (n - 1))] / 1e3 : 0;
+    }
+}
+
+// Move everything queued on the sink back to where it came from and record
+// the one-way delay, then collect the echoes at the sender
+static void drain(int sink, int src, unsigned char *buf,
+                  struct bench_result *res, uint64_t *owd, uint64_t *rtt,
+                  uint64_t cap)
+{
+    struct sockaddr_in from;
+    socklen_t from_len;
+    struct bench_hdr hdr;
+    ssize_t len;
+
+    for (;;) {
+        from_len = sizeof(from);
+        len = recvfrom(sink, buf, BENCH_MAX_SIZE, 0,
+                       (struct sockaddr *) &from, &from_len);
+        if (len < (ssize_t) sizeof(hdr)) {
+            break;
+        }
+
+        memcpy(&hdr, buf, sizeof(hdr));
+        if (res->recv < cap) {
+            owd[res->recv] = now_ns() - hdr.ts_ns;
+        }
+        res->recv++;
+
+        sendto(sink, buf, len, 0, (struct sockaddr *) &from, from_len);
+    }
+
+    for (;;) {
+        len = recv(src, buf, BENCH_MAX_SIZE, 0);
+        if (len < (ssize_t) sizeof(hdr)) {
+            break;
+        }
+
+        memcpy(&hdr, buf, sizeof(hdr));
+        if (res->echoed < cap) {
+            rtt[res->echoed] = now_ns() - hdr.ts_ns;
+        }
+        res->echoed++;
+    }
+}
+
+static int run(uint16_t base, int size, long rate, double secs,
+               struct bench_result *res)
+{
+    struct sockaddr_in to;
+    struct bench_hdr hdr;
+    unsigned char *buf = calloc(1, BENCH_MAX_SIZE);
+    uint64_t cap = rate > 0 && rate * (secs + 1) < BENCH_SAMPLES ?
+                   (uint64_t) (rate * (secs + 1)) : BENCH_SAMPLES;
+    uint64_t *owd = malloc(sizeof(*owd) * cap);
+    uint64_t *rtt = malloc(sizeof(*rtt) * cap);
+    uint64_t t_start, t_end, t_now;
+    pid_t server, client;
+    double cpu_start;
+    int sink, src;
+    int ret = 0;
+
+    memset(res, 0, sizeof(*res));
+    res->size = size;
+    res->rate = rate;
+
+    sink = udp_sock(base);
+    src = udp_sock(0);
+    if (!buf || !owd || !rtt || sink < 0 || src < 0) {
+        perror("bench setup");
+        ret = -1;
+        goto out;
+    }
+
+    cpu_start = cpu_children();
+    server = spawn_udpmask("server", base + 1, base);
+    client = spawn_udpmask("client", base + 2, base + 1);
+
+    memset(&to, 0, sizeof(to));
+    to.sin_family = AF_INET;
+    to.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    to.sin_port = htons(base + 2);
+
+    // Wait for the path to come up
+    t_end = now_ns() + 3000000000ULL;
+    while (res->recv == 0 && now_ns() < t_end) {
+        hdr.seq = 0;
+        hdr.ts_ns = now_ns();
+        memcpy(buf, &hdr, sizeof(hdr));
+        sendto(src, buf, size, 0, (struct sockaddr *) &to, sizeof(to));
+        usleep(20000);
+        drain(sink, src, buf, res, owd, rtt, 0);
+    }
+
+    if (res->recv == 0) {
+        fprintf(stderr, "bench: no traffic through %s\n", udpmask_path);
+        ret = -1;
+        goto exit;
+    }
+
+    // Flush the warm-up echoes so they don't count towards the run
+    usleep(100000);
+    drain(sink, src, buf, res, owd, rtt, 0);
+
+    memset(res, 0, sizeof(*res));
+    res->size = size;
+    res->rate = rate;
+
+    t_start = now_ns();
+    t_end = t_start + (uint64_t) (secs * 1e9);
+
+    while ((t_now = now_ns()) < t_end) {
+        uint64_t due = rate > 0 ?
+                       (uint64_t) ((t_now - t_start) / 1e9 * rate) :
+                       res->sent + BENCH_BURST;
+
+        for (int i = 0; i < BENCH_BURST && res->sent < due; i++) {
+            hdr.seq = res->sent;
+            hdr.ts_ns = now_ns();
+            memcpy(buf, &hdr, sizeof(hdr));
+            if (sendto(src, buf, size, 0,
+                       (struct sockaddr *) &to, sizeof(to)) < 0) {
+                break;
+            }
+            res->sent++;
+        }
+
+        drain(sink, src, buf, res, owd, rtt, cap);
+    }
+
+    // Let the tail arrive
+    t_end = now_ns() + 200000000ULL;
+    while (now_ns() < t_end) {
+        drain(sink, src, buf, res, owd, rtt, cap);
+    }
+
+    res->secs = secs;
+
+exit:
+    kill(client, SIGTERM);
+    kill(server, SIGTERM);
+    waitpid(client, NULL, 0);
+    waitpid(server, NULL, 0);
+
+    res->cpu_secs = cpu_children() - cpu_start;
+
+    percentiles(owd, res->recv < cap ? res->recv : cap, res->owd_us);
+    percentiles(rtt, res->echoed < cap ? res->echoed : cap, res->rtt_us);
+
+out:
+    if (sink >= 0) {
+        close(sink);
+    }
+    if (src >= 0) {
+        close(src);
+    }
+    free(buf);
+    free(owd);
+    free(rtt);
+
+    return ret;
+}
+
+static void report(FILE *fp, const struct bench_result *res)
+{
+    double pps = res->recv / res->secs;
+    double loss = res->sent ? 100.0 * (res->sent - res->recv) / res->sent : 0;
+    // Each datagram crosses both udpmask instances twice
+    uint64_t pkts = res->recv + res->echoed;
+    double cpu_ns = pkts ? res->cpu_secs * 1e9 / pkts : 0;
+
+    fprintf(fp, "size=%d rate=%ld sent=%llu recv=%llu echoed=%llu "
+                "loss_pct=%.3f pps=%.0f gbps=%.4f "
+                "owd_p50_us=%.1f owd_p99_us=%.1f owd_p999_us=%.1f "
+                "rtt_p50_us=%.1f rtt_p99_us=%.1f rtt_p999_us=%.1f "
+                "cpu_ns_per_pkt=%.0f\n",
+            res->size, res->rate, (unsigned long long) res->sent,
+            (unsigned long long) res->recv,
+            (unsigned long long) res->echoed,
+            loss, pps, pps * res->size * 8 / 1e9,
+            res->owd_us[0], res->owd_us[1], res->owd_us[2],
+            res->rtt_us[0], res->rtt_us[1], res->rtt_us[2], cpu_ns);
+}
+
+int main(int argc, char **argv)
+{
+    const char *sizes = "64,512,1400";
+    const char *output = "bench_output.txt";
+    uint16_t base = BENCH_PORT;
+    long rate = 0;
+    double secs = 2;
+    char *args = NULL;
+    FILE *fp;
+    int c;
+
+    while ((c = getopt(argc, argv, "u:a:s:r:d:p:o:h")) != -1) {
+        switch (c) {
+        case 'u':
+            udpmask_path = optarg;
+            break;
+
+        case 'a':
+            args = optarg;
+            break;
+
+        case 's':
+            sizes = optarg;
+            break;
+
+        case 'r':
+            rate = atol(optarg);
+            break;
+
+        case 'd':
+            secs = atof(optarg);
+            break;
+
+        case 'p':
+            base = (uint16_t) atoi(optarg);
+            break;
+
+        case 'o':
+            output = optarg;
+            break;
+
+        case 'h':
+        case '?':
+        default:
+            return usage();
+        }
+    }
+
+    if (secs <= 0 || rate < 0) {
+        return usage();
+    }
+
+    for (char *tok = args ? strtok(args, " ") : NULL;
+         tok && udpmask_args_n < BENCH_MAX_ARGS;
+         tok = strtok(NULL, " ")) {
+        udpmask_args[udpmask_args_n++] = tok;
+    }
+
+    fp = fopen(output, "w");
+    if (!fp) {
+        perror(output);
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    char *list = strdup(sizes);
+    int ret = 0;
+
+    for (char *tok = strtok(list, ","); tok; tok = strtok(NULL, ",")) {
+        struct bench_result res;
+        int size = atoi(tok);
+
+        if (size < BENCH_MIN_SIZE || size > BENCH_MAX_SIZE) {
+            fprintf(stderr, "bench: size %d out of range [%d, %d]\n",
+                    size, BENCH_MIN_SIZE, BENCH_MAX_SIZE);
+            ret = 1;
+            continue;
+        }
+
+        if (run(base, size, rate, secs, &res) < 0) {
+            ret = 1;
+            continue;
+        }
+
+        report(stdout, &res);
+        report(fp, &res);
+        fflush(fp);
+    }
+
+    free(list);
+    fclose(fp);
+
+    return ret;
+}
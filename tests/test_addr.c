@@ -0,0 +1,69 @@
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+#include "addr.h"
+
+int main(void)
+{
+    union um_sockaddr a, b;
+    struct um_flow_key ka, kb;
+    char buf[UM_ADDR_STRLEN];
+
+    assert(sizeof(struct um_flow_key) == 20);
+
+    assert(um_sockaddr_parse(&a, "192.0.2.1") == 0);
+    assert(a.sa.sa_family == AF_INET);
+    assert(um_sockaddr_len(&a) == sizeof(struct sockaddr_in));
+    um_sockaddr_set_port(&a, 4242);
+    assert(strcmp(um_sockaddr_str(&a, buf, sizeof(buf)),
+                  "192.0.2.1:4242") == 0);
+
+    assert(um_sockaddr_parse(&b, "2001:db8::1") == 0);
+    assert(b.sa.sa_family == AF_INET6);
+    assert(um_sockaddr_len(&b) == sizeof(struct sockaddr_in6));
+    um_sockaddr_set_port(&b, 53);
+    assert(strcmp(um_sockaddr_str(&b, buf, sizeof(buf)),
+                  "[2001:db8::1]:53") == 0);
+
+    assert(um_sockaddr_parse(&b, "host") < 0);
+    assert(um_sockaddr_parse(&b, "1.2.3") < 0);
+
+    // A v4-mapped source is the same flow as the IPv4 one
+    assert(um_sockaddr_parse(&b, "::ffff:192.0.2.1") == 0);
+    um_sockaddr_set_port(&b, 4242);
+    assert(strcmp(um_sockaddr_str(&b, buf, sizeof(buf)),
+                  "192.0.2.1:4242") == 0);
+
+    um_flow_key_of(&ka, &a);
+    um_flow_key_of(&kb, &b);
+    assert(ka.family == AF_INET && kb.family == AF_INET);
+    assert(um_flow_key_eq(&ka, &kb));
+    assert(um_flow_key_hash(&ka) == um_flow_key_hash(&kb));
+
+    // Any other field tells flows apart
+    um_sockaddr_set_port(&b, 4243);
+    um_flow_key_of(&kb, &b);
+    assert(!um_flow_key_eq(&ka, &kb));
+
+    um_sockaddr_set_port(&b, 4242);
+    um_flow_key_of(&kb, &b);
+    kb.tunnel = 1;
+    assert(!um_flow_key_eq(&ka, &kb));
+
+    assert(um_sockaddr_parse(&b, "::c000:201") == 0);
+    um_sockaddr_set_port(&b, 4242);
+    um_flow_key_of(&kb, &b);
+    assert(kb.family == AF_INET6);
+    assert(!um_flow_key_eq(&ka, &kb));
+
+    // No address, no key
+    memset(&a, 0, sizeof(a));
+    um_flow_key_of(&ka, &a);
+    assert(ka.family == 0);
+
+    printf("addr: ok\n");
+
+    return 0;
+}
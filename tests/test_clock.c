@@ -0,0 +1,54 @@
+#include <stdio.h>
+#include <assert.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "clock.h"
+
+int main(void)
+{
+    struct timespec ts;
+    int64_t t0, t1, mono;
+
+    // Nothing moves until the loop asks
+    assert(um_clock_now() == 0);
+    t0 = um_clock_update();
+    assert(t0 > 0 && um_clock_now() == t0);
+    assert(um_clock_sec() == (time_t) (t0 / 1000));
+
+    // Follows the monotonic clock, to a tick or so
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    mono = (int64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    assert(mono - t0 >= -20 && mono - t0 <= 20);
+
+    usleep(50000);
+    assert(um_clock_now() == t0);
+    t1 = um_clock_update();
+    assert(t1 - t0 >= 40 && t1 - t0 <= 200);
+
+    int iter = 1000000;
+    struct timeval t_start, t_end;
+    double t_diff;
+    volatile int64_t sink = 0;
+
+    gettimeofday(&t_start, NULL);
+    for (int i = 0; i < iter; i++) {
+        sink += um_clock_update();
+    }
+    gettimeofday(&t_end, NULL);
+    t_diff = (double) ((t_end.tv_sec - t_start.tv_sec) * 1e6 + (t_end.tv_usec - t_start.tv_usec));
+    printf("Time for um_clock_update, 1 iterations: %f us\n", t_diff / iter);
+
+    gettimeofday(&t_start, NULL);
+    for (int i = 0; i < iter; i++) {
+        sink += time(NULL);
+    }
+    gettimeofday(&t_end, NULL);
+    t_diff = (double) ((t_end.tv_sec - t_start.tv_sec) * 1e6 + (t_end.tv_usec - t_start.tv_usec));
+    printf("Time for time(NULL), 1 iterations: %f us\n", t_diff / iter);
+
+    printf("clock: ok\n");
+
+    return 0;
+}
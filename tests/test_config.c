@@ -0,0 +1,80 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "config.h"
+
+int main(void)
+{
+    struct um_tunnel_conf conf, *all = NULL;
+    int n = 0;
+
+    assert(um_mode_parse("server") == UM_MODE_SERVER);
+    assert(um_mode_parse("client") == UM_MODE_CLIENT);
+    assert(um_mode_parse("passthrough") == UM_MODE_PASSTHROU);
+    assert(um_mode_parse("proxy") == UM_MODE_NONE);
+    assert(strcmp(um_mode_name(UM_MODE_CLIENT), "client") == 0);
+
+    assert(um_config_line("client * 61194 vpn.example.com 51194\n",
+                          &conf) == 1);
+    assert(conf.mode == UM_MODE_CLIENT);
+    assert(conf.listen.sa.sa_family == AF_UNSPEC);
+    assert(conf.port == 61194);
+    assert(strcmp(conf.host, "vpn.example.com") == 0);
+    assert(conf.port_conn == 51194);
+
+    assert(um_config_line("\tserver  ::1 51194 10.0.0.1 1194 # vpn\n",
+                          &conf) == 1);
+    assert(conf.mode == UM_MODE_SERVER);
+    assert(conf.listen.sa.sa_family == AF_INET6);
+
+    assert(um_config_line("\n", &conf) == 0);
+    assert(um_config_line("  # comment\n", &conf) == 0);
+
+    assert(um_config_line("proxy * 1 a 2\n", &conf) < 0);
+    assert(um_config_line("server * 1 a\n", &conf) < 0);
+    assert(um_config_line("server * 1 a 2 3\n", &conf) < 0);
+    assert(um_config_line("server * 0 a 2\n", &conf) < 0);
+    assert(um_config_line("server * 70000 a 2\n", &conf) < 0);
+    assert(um_config_line("server * 1x a 2\n", &conf) < 0);
+    assert(um_config_line("server host 1 a 2\n", &conf) < 0);
+
+    // Files
+    const char *path = "/tmp/udpmask_test_config.conf";
+    FILE *fp = fopen(path, "w");
+
+    assert(fp);
+    fputs("# tunnels\n"
+          "client * 61194 vpn.example.com 51194\n"
+          "\n"
+          "passthrough 127.0.0.1 5353 8.8.8.8 53\n", fp);
+    fclose(fp);
+
+    assert(um_config_load(path, &all, &n) == 0);
+    assert(n == 2);
+    assert(all[0].mode == UM_MODE_CLIENT);
+    assert(all[1].mode == UM_MODE_PASSTHROU);
+    assert(all[1].port == 5353 && all[1].port_conn == 53);
+
+    // Appended to what is there, the bad line is reported
+    fp = fopen(path, "w");
+    assert(fp);
+    fputs("server * 51194 10.0.0.1 1194\n"
+          "server * 51195\n", fp);
+    fclose(fp);
+
+    assert(um_config_load(path, &all, &n) == 2);
+    assert(n == 3);
+    assert(all[2].mode == UM_MODE_SERVER);
+
+    unlink(path);
+    assert(um_config_load(path, &all, &n) < 0);
+    free(all);
+
+    printf("config: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,138 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "handoff.h"
+
+// More flows than fit in one message, every third with a reply socket
+#define N_TUNNELS   2
+#define N_FLOWS     150
+
+static ino_t ino_of(int fd)
+{
+    struct stat st;
+
+    assert(fstat(fd, &st) == 0);
+    return st.st_ino;
+}
+
+int main(void)
+{
+    struct um_handoff_rec rec[N_TUNNELS + N_FLOWS], *got;
+    int fds[2 * (N_TUNNELS + N_FLOWS)], *got_fds;
+    int nfd = 0;
+    int n_t, n_f;
+    int sv[2];
+
+    memset(rec, 0, sizeof(rec));
+
+    for (int i = 0; i < N_TUNNELS + N_FLOWS; i++) {
+        rec[i].tunnel = i < N_TUNNELS ? i : i % N_TUNNELS;
+        rec[i].nfd = i >= N_TUNNELS && i % 3 == 0 ? 2 : 1;
+        rec[i].last_use = 1000 + i;
+        assert(um_sockaddr_parse(&rec[i].from, i % 2 ? "2001:db8::1" :
+                                 "192.0.2.1") == 0);
+        um_sockaddr_set_port(&rec[i].from, (uint16_t) (1024 + i));
+        for (int k = 0; k < rec[i].nfd; k++) {
+            fds[nfd] = socket(AF_INET, SOCK_DGRAM, 0);
+            assert(fds[nfd] >= 0);
+            nfd++;
+        }
+    }
+
+    assert(um_handoff_nfd(rec, N_TUNNELS + N_FLOWS) == nfd);
+
+    // Records and sockets arrive in order, across several messages
+    assert(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, sv) == 0);
+    assert(um_handoff_send(sv[0], 0, rec, N_TUNNELS, N_FLOWS, fds) == 0);
+    assert(um_handoff_recv(sv[1], &got, &n_t, &n_f, &got_fds) == 0);
+    assert(n_t == N_TUNNELS && n_f == N_FLOWS);
+    assert(memcmp(got, rec, sizeof(rec)) == 0);
+
+    for (int i = 0; i < nfd; i++) {
+        assert(got_fds[i] != fds[i]);
+        assert(ino_of(got_fds[i]) == ino_of(fds[i]));
+        close(got_fds[i]);
+    }
+    free(got);
+    free(got_fds);
+
+    // Nothing but a status
+    assert(um_handoff_send(sv[0], 0, NULL, 0, 0, NULL) == 0);
+    assert(um_handoff_recv(sv[1], &got, &n_t, &n_f, &got_fds) == 0);
+    assert(n_t == 0 && n_f == 0);
+    free(got);
+    free(got_fds);
+
+    assert(um_handoff_send(sv[1], EINVAL, NULL, 0, 0, NULL) == 0);
+    assert(um_handoff_recv(sv[0], &got, &n_t, &n_f, &got_fds) < 0);
+    assert(errno == EINVAL);
+
+    // A peer gone mid-way
+    assert(um_handoff_send(sv[0], 0, rec, N_TUNNELS, N_FLOWS, fds) == 0);
+    close(sv[0]);
+    assert(um_handoff_recv(sv[1], &got, &n_t, &n_f, &got_fds) == 0);
+    for (int i = 0; i < nfd; i++) {
+        close(got_fds[i]);
+    }
+    free(got);
+    free(got_fds);
+    assert(um_handoff_recv(sv[1], &got, &n_t, &n_f, &got_fds) < 0);
+    close(sv[1]);
+
+    // Over a path, as between two processes
+    const char *path = "/tmp/udpmask_test_handoff.sock";
+    int lsock = um_handoff_listen(path);
+
+    assert(lsock >= 0);
+    assert(um_handoff_accept(lsock) < 0 && errno == EAGAIN);
+
+    pid_t pid = fork();
+    assert(pid >= 0);
+    if (pid == 0) {
+        int sock = um_handoff_connect(path);
+
+        if (sock < 0 ||
+            um_handoff_send(sock, 0, rec, 1, 0, fds) < 0 ||
+            um_handoff_recv(sock, &got, &n_t, &n_f, &got_fds) < 0) {
+            _exit(1);
+        }
+        _exit(n_t == 0 && n_f == 0 ? 0 : 1);
+    }
+
+    int sock = -1;
+    int status;
+
+    while (sock < 0) {
+        sock = um_handoff_accept(lsock);
+        assert(sock >= 0 || errno == EAGAIN);
+    }
+    assert(um_handoff_recv(sock, &got, &n_t, &n_f, &got_fds) == 0);
+    assert(n_t == 1 && n_f == 0 && got[0].last_use == 1000);
+    assert(ino_of(got_fds[0]) == ino_of(fds[0]));
+    close(got_fds[0]);
+    free(got);
+    free(got_fds);
+    assert(um_handoff_send(sock, 0, NULL, 0, 0, NULL) == 0);
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    close(sock);
+
+    um_handoff_close(lsock, path);
+    assert(um_handoff_connect(path) < 0 && errno == ENOENT);
+
+    for (int i = 0; i < nfd; i++) {
+        close(fds[i]);
+    }
+
+    printf("handoff: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,173 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/time.h>
+
+#include "clock.h"
+#include "log.h"
+
+static const char *path = "/tmp/udpmask_test_log.txt";
+static char text[1 << 20];
+
+// Everything written to stderr since the last call
+static const char *take(void)
+{
+    static long pos;
+    FILE *fp = fopen(path, "r");
+    size_t n;
+
+    assert(fp);
+    fseek(fp, pos, SEEK_SET);
+    n = fread(text, 1, sizeof(text) - 1, fp);
+    text[n] = '\0';
+    pos += (long) n;
+    fclose(fp);
+
+    return text;
+}
+
+static int count_lines(const char *s)
+{
+    int n = 0;
+
+    for (; *s; s++) {
+        n += *s == '\n';
+    }
+
+    return n;
+}
+
+int main(void)
+{
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+    int saved = dup(STDERR_FILENO);
+    char buf[16];
+    int evals = 0;
+
+    assert(fd >= 0 && saved >= 0);
+    dup2(fd, STDERR_FILENO);
+    close(fd);
+
+    startlog("test_log");
+
+    // Written right away until the loop turns the ring on
+    log_info("sync %d", 1);
+    assert(strstr(take(), "test_log[") && strstr(text, "]: INFO: sync 1\n"));
+
+    log_set_async(1);
+
+    strcpy(buf, "first");
+    log_warn("a %s b %d c %zu d %hu e %u f %5.2f g %p %%", buf, -3,
+             (size_t) 7, (unsigned short) 65535, 9u, 2.5, (void *) 0);
+    strcpy(buf, "XXXX");
+    log_debug("filtered %d", 2);
+    // A filtered message evaluates none of its arguments
+    log_debug("filtered %d", ++evals);
+    assert(evals == 0);
+    log_err("wide %*d", 4, 5);
+
+    assert(strlen(take()) == 0);
+    assert(log_flush(0) == 2);
+    take();
+    assert(count_lines(text) == 2);
+    assert(strstr(text, "WARNING: a first b -3 c 7 d 65535 e 9 f  2.50 g "
+                        "(nil) %\n"));
+    assert(strstr(text, "ERROR: wide    5\n"));
+
+    // A batch at a time
+    for (int i = 0; i < 10; i++) {
+        log_info("line %d", i);
+    }
+    assert(log_flush(4) == 4);
+    assert(log_flush(4) == 4);
+    assert(log_flush(4) == 2);
+    take();
+    assert(count_lines(text) == 10);
+    assert(strstr(text, "INFO: line 0\n") && strstr(text, "INFO: line 9\n"));
+
+    // A full ring drops, and says so. mylog() isn't rate limited.
+    for (int i = 0; i < 1500; i++) {
+        mylog(LOG_INFO, "flood %d from %s", i, "192.0.2.1:4242");
+    }
+    assert(log_flush(0) == 1024);
+    take();
+    assert(count_lines(text) == 1025);
+    assert(strstr(text, "INFO: flood 1023 from 192.0.2.1:4242\n"));
+    assert(!strstr(text, "flood 1024 "));
+    assert(strstr(text, "WARNING: 476 log messages dropped, ring full\n"));
+
+    // Turning it off writes what is left
+    log_info("last %s", "one");
+    log_set_async(0);
+    assert(strstr(take(), "INFO: last one\n"));
+
+    // Filtered at the call site, arguments and all
+    int evaluated = 0;
+
+    log_debug("counted %d", evaluated++);
+    assert(evaluated == 0);
+    log_level = LOG_DEBUG;
+    log_debug("counted %d", evaluated++);
+    assert(evaluated == 1 && strstr(take(), "DEBUG: counted 0\n"));
+    log_level = LOG_INFO;
+
+    // A call site over its burst is held back, then owns up to it
+    struct log_ratelimit rl;
+    int allowed = 0;
+
+    memset(&rl, 0, sizeof(rl));
+    um_clock_update();
+    log_set_async(1);
+    for (int i = 0; i < UM_LOG_BURST + 5; i++) {
+        allowed += log_ratelimit(&rl, LOG_INFO, "burst %d");
+    }
+    assert(allowed == UM_LOG_BURST && rl.suppressed == 5);
+    assert(!log_ratelimit(&rl, LOG_DEBUG, "burst %d"));
+    um_clock_ms += 1000;
+    assert(log_ratelimit(&rl, LOG_INFO, "burst %d"));
+    assert(rl.suppressed == 0 && rl.tokens == UM_LOG_RATE - 1);
+    log_flush(0);
+    assert(strstr(take(), "WARNING: 5 messages suppressed like \"burst %d\"\n"));
+
+    for (int i = 0; i < 100; i++) {
+        log_warn("scan from port %d", i);
+    }
+    log_flush(0);
+    assert(count_lines(take()) == UM_LOG_BURST);
+    log_set_async(0);
+
+    // Cost of a message on the hot path
+    int iter = 1000;
+    struct timeval t_start, t_end;
+    double t_async, t_sync;
+
+    log_set_async(1);
+    gettimeofday(&t_start, NULL);
+    for (int i = 0; i < iter; i++) {
+        log_info("New connection from [%s]", "192.0.2.1:4242");
+    }
+    gettimeofday(&t_end, NULL);
+    t_async = (double) ((t_end.tv_sec - t_start.tv_sec) * 1e6 + (t_end.tv_usec - t_start.tv_usec));
+    log_set_async(0);
+
+    gettimeofday(&t_start, NULL);
+    for (int i = 0; i < iter; i++) {
+        log_info("New connection from [%s]", "192.0.2.1:4242");
+    }
+    gettimeofday(&t_end, NULL);
+    t_sync = (double) ((t_end.tv_sec - t_start.tv_sec) * 1e6 + (t_end.tv_usec - t_start.tv_usec));
+
+    endlog();
+    dup2(saved, STDERR_FILENO);
+    close(saved);
+    unlink(path);
+
+    printf("Time for log_info queued, 1 message: %f us\n", t_async / iter);
+    printf("Time for log_info written, 1 message: %f us\n", t_sync / iter);
+    printf("log: ok\n");
+
+    return 0;
+}
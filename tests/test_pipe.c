@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+
+#include "pipe.h"
+
+#ifdef UM_HAVE_PIPELINE
+
+#define ITEMS       (1 << 20)
+
+static struct um_spsc ring;
+static struct um_bell bell;
+static int stop;
+
+static void *producer(void *arg)
+{
+    for (uintptr_t i = 1; i <= ITEMS; i++) {
+        while (um_spsc_push(&ring, (void *) i) < 0) {
+        }
+        if ((i & 63) == 0) {
+            um_bell_ring(&bell);
+        }
+    }
+    um_bell_ring(&bell);
+
+    return NULL;
+}
+
+// Items arrive once each and in order across threads, and the consumer
+// sleeping on the bell doesn't miss any
+static void test_threads(void)
+{
+    pthread_t thr;
+    uintptr_t next = 1;
+    void *p;
+
+    assert(um_spsc_init(&ring, 256) == 0);
+    assert(um_bell_init(&bell) == 0);
+    assert(pthread_create(&thr, NULL, &producer, NULL) == 0);
+
+    while (next <= ITEMS) {
+        p = um_spsc_pop(&ring);
+        if (!p) {
+            um_bell_wait(&bell, &ring, &stop);
+            continue;
+        }
+        assert((uintptr_t) p == next);
+        next++;
+    }
+
+    assert(pthread_join(thr, NULL) == 0);
+    assert(um_spsc_pop(&ring) == NULL);
+
+    um_bell_destroy(&bell);
+    um_spsc_free(&ring);
+}
+
+#endif /* UM_HAVE_PIPELINE */
+
+int main(void)
+{
+    struct um_spsc r;
+    int v[8];
+
+    assert(um_spsc_init(&r, 6) < 0);
+    assert(um_spsc_init(&r, 4) == 0);
+
+    assert(um_spsc_empty(&r));
+    assert(um_spsc_pop(&r) == NULL);
+
+    // Fill, overflow, then drain in order, across the wrap point
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < 4; i++) {
+            assert(um_spsc_push(&r, &v[i]) == 0);
+        }
+        assert(um_spsc_push(&r, &v[4]) < 0);
+        assert(!um_spsc_empty(&r));
+
+        assert(um_spsc_pop(&r) == &v[0]);
+        assert(um_spsc_push(&r, &v[5]) == 0);
+
+        for (int i = 1; i < 4; i++) {
+            assert(um_spsc_pop(&r) == &v[i]);
+        }
+        assert(um_spsc_pop(&r) == &v[5]);
+        assert(um_spsc_pop(&r) == NULL);
+    }
+
+    um_spsc_free(&r);
+
+#ifdef UM_HAVE_PIPELINE
+    test_threads();
+    printf("pipe: ok\n");
+#else
+    printf("pipe: ok, threads skipped, build with -DUM_PIPELINE -pthread\n");
+#endif
+
+    return 0;
+}
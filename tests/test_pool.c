@@ -0,0 +1,79 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "pool.h"
+#include "udpmask.h"
+
+int main(void)
+{
+    struct um_pool pool;
+    struct um_txq q;
+    struct um_pkt *pkt, *big, *got[4];
+
+    assert(um_pool_init(&pool, 4, 1) == 0);
+    assert(pool.avail[0] == 4 && pool.avail[1] == 1);
+
+    // Slabs are cache aligned and don't overlap
+    pkt = um_pool_get(&pool, 1500);
+    assert(pkt && !pkt->large && pkt->flow == -1);
+    assert(((uintptr_t) pkt->data & 63) == 0);
+    memset(pkt->data, 0xaa, UM_POOL_SLAB);
+
+    big = um_pool_get(&pool, UM_BUFFER);
+    assert(big && big->large);
+    assert(((uintptr_t) big->data & 63) == 0);
+    memset(big->data, 0x55, UM_BUFFER);
+    assert(pkt->data[UM_POOL_SLAB - 1] == 0xaa);
+
+    // Nothing larger than a datagram, and the overflow class is empty now
+    assert(um_pool_get(&pool, UM_POOL_LARGE + 1) == NULL);
+    assert(um_pool_get(&pool, UM_POOL_SLAB + 1) == NULL);
+
+    // Putting it back makes it available again
+    um_pool_put(&pool, pkt);
+    assert(pool.avail[0] == 4);
+    um_pool_put(&pool, big);
+    assert(pool.avail[1] == 1);
+
+    // Small datagrams spill into the overflow class, then run out
+    for (int i = 0; i < 4; i++) {
+        got[i] = um_pool_get(&pool, 64);
+        assert(got[i] && !got[i]->large);
+    }
+    big = um_pool_get(&pool, 64);
+    assert(big && big->large);
+    assert(um_pool_get(&pool, 64) == NULL);
+
+    // Queues hand packets back in order
+    um_txq_init(&q, 3, 7, 0);
+    for (int i = 0; i < 4; i++) {
+        got[i]->len = (uint32_t) i;
+        um_txq_push(&q, got[i]);
+    }
+    assert(q.n == 4 && q.sock == 3 && q.idx == 7);
+
+    for (int i = 0; i < 2; i++) {
+        pkt = um_txq_pop(&q);
+        assert(pkt == got[i] && pkt->len == (uint32_t) i);
+        um_pool_put(&pool, pkt);
+    }
+    big->flow = 1;
+    got[3]->flow = 2;
+    um_txq_push(&q, big);
+    um_txq_disown(&q, 1);
+    assert(big->flow == -1 && got[3]->flow == 2);
+    assert(um_txq_pop(&q) == got[2]);
+    um_pool_put(&pool, got[2]);
+
+    um_txq_clear(&q, &pool);
+    assert(q.n == 0 && !q.head && !q.tail && !um_txq_pop(&q));
+    assert(pool.avail[0] == 4 && pool.avail[1] == 1);
+
+    um_pool_free(&pool);
+
+    printf("pool: ok\n");
+
+    return 0;
+}
@@ -0,0 +1,227 @@
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <sys/time.h>
+#include <arpa/inet.h>
+
+#include "sockmap.h"
+#include "udpmask.h"
+
+// Odd clients are IPv6, even ones IPv4
+static union um_sockaddr client_addr(int n)
+{
+    union um_sockaddr addr;
+
+    memset(&addr, 0, sizeof(addr));
+    if (n % 2) {
+        addr.v6.sin6_family = AF_INET6;
+        addr.v6.sin6_addr.s6_addr[0] = 0x20;
+        addr.v6.sin6_addr.s6_addr[1] = 0x01;
+        addr.v6.sin6_addr.s6_addr[14] = (uint8_t) (n / 16 >> 8);
+        addr.v6.sin6_addr.s6_addr[15] = (uint8_t) (n / 16);
+        addr.v6.sin6_port = htons(1024 + n % 16);
+    } else {
+        addr.v4.sin_family = AF_INET;
+        addr.v4.sin_addr.s_addr = htonl(0x0A000000 | (n / 16));
+        addr.v4.sin_port = htons(1024 + n % 16);
+    }
+
+    return addr;
+}
+
+static int find(const struct um_sockmap_tab *tab,
+                const union um_sockaddr *addr, int *sock)
+{
+    struct um_flow_key key;
+
+    um_flow_key_of(&key, addr);
+    return um_sockmap_find(tab, &key, sock);
+}
+
+int main(void)
+{
+    struct um_sockmap_tab tab;
+    union um_sockaddr addr;
+    int n = 1000;
+    int idx, sock;
+
+    assert(um_sockmap_init(&tab, n, 0) == 0);
+
+    for (int i = 0; i < n; i++) {
+        addr = client_addr(i);
+        assert(find(&tab, &addr, &sock) < 0);
+        idx = um_sockmap_ins(&tab, 100 + i, 0, &addr, 0);
+        assert(idx >= 0);
+        assert(tab.ent[idx].last_use == TIME_INVALID);
+    }
+
+    assert(tab.used == n);
+    assert(tab.cap == n);
+
+    // Full
+    addr = client_addr(n);
+    assert(um_sockmap_ins(&tab, 100 + n, 0, &addr, 0) < 0);
+
+    for (int i = 0; i < n; i++) {
+        addr = client_addr(i);
+        idx = find(&tab, &addr, &sock);
+        assert(idx >= 0);
+        assert(sock == 100 + i);
+        assert(tab.ent[idx].sock == sock);
+    }
+
+    // Drop every other entry, the rest must stay reachable
+    for (int i = 0; i < n; i += 2) {
+        addr = client_addr(i);
+        idx = find(&tab, &addr, &sock);
+        um_sockmap_del(&tab, idx);
+    }
+
+    assert(tab.used == n / 2);
+
+    for (int i = 0; i < n; i++) {
+        addr = client_addr(i);
+        idx = find(&tab, &addr, &sock);
+        if (i % 2 == 0) {
+            assert(idx < 0);
+        } else {
+            assert(idx >= 0 && sock == 100 + i);
+        }
+    }
+
+    // Freed indices are reused
+    addr = client_addr(0);
+    idx = um_sockmap_ins(&tab, 42, 0, &addr, 0);
+    assert(idx >= 0 && idx < n);
+    assert(find(&tab, &addr, &sock) == idx && sock == 42);
+
+    // The same client on another tunnel is another flow
+    struct um_flow_key key;
+    int idx2 = um_sockmap_ins(&tab, 43, 1, &addr, 0);
+
+    assert(idx2 >= 0 && idx2 != idx);
+    um_flow_key_of(&key, &addr);
+    key.tunnel = 1;
+    assert(um_sockmap_find(&tab, &key, &sock) == idx2 && sock == 43);
+    key.tunnel = 2;
+    assert(um_sockmap_find(&tab, &key, &sock) < 0);
+    um_sockmap_del(&tab, idx2);
+    assert(find(&tab, &addr, &sock) == idx && sock == 42);
+
+    int iter = 1000000;
+    struct timeval t_start, t_end;
+    double t_diff;
+
+    gettimeofday(&t_start, NULL);
+    for (int i = 0; i < iter; i++) {
+        addr = client_addr(i % n | 1);
+        idx = find(&tab, &addr, &sock);
+        assert(idx >= 0);
+    }
+    gettimeofday(&t_end, NULL);
+    t_diff = (double) ((t_end.tv_sec - t_start.tv_sec) * 1e6 + (t_end.tv_usec - t_start.tv_usec));
+    printf("Time for um_sockmap_find, %d entries, %d iterations: %f us\n",
+           tab.used, iter, t_diff);
+    printf("Time for um_sockmap_find, 1 iterations: %f us\n", t_diff / iter);
+
+    um_sockmap_free(&tab);
+
+    // Idle expiry, timeout 10s, longer than a wheel turn as well
+    int timeouts[] = { 10, UM_WHEEL_SIZE + 44 };
+
+    for (int t = 0; t < ARRAY_SIZE(timeouts); t++) {
+        int tmo = timeouts[t];
+        time_t now = 1000;
+
+        assert(um_sockmap_init(&tab, 64, tmo) == 0);
+
+        for (int i = 0; i < 64; i++) {
+            addr = client_addr(i);
+            idx = um_sockmap_ins(&tab, i, 0, &addr, now);
+            // Entries never used go after a second, like before
+            if (i % 4 != 0) {
+                tab.ent[idx].last_use = now;
+            }
+        }
+
+        assert(um_sockmap_expired(&tab, now) < 0);
+
+        int expired = 0;
+        while ((idx = um_sockmap_expired(&tab, now + 1)) >= 0) {
+            assert(tab.ent[idx].sock % 4 == 0);
+            um_sockmap_del(&tab, idx);
+            expired++;
+        }
+        assert(expired == 16);
+
+        // Keep half of the rest busy, one second at a time
+        for (now = 1001; now < 1000 + 3 * tmo; now++) {
+            for (int i = 1; i < 64; i += 2) {
+                addr = client_addr(i);
+                idx = find(&tab, &addr, &sock);
+                assert(idx >= 0);
+                tab.ent[idx].last_use = now;
+            }
+
+            while ((idx = um_sockmap_expired(&tab, now)) >= 0) {
+                assert(tab.ent[idx].sock % 2 == 0);
+                assert(now - tab.ent[idx].last_use >= tmo);
+                assert(now - 1 - tab.ent[idx].last_use < tmo);
+                um_sockmap_del(&tab, idx);
+                expired++;
+            }
+        }
+
+        assert(expired == 32);
+        assert(tab.used == 32);
+
+        // Long gap, everything goes at once
+        now += 10 * UM_WHEEL_SIZE;
+        while ((idx = um_sockmap_expired(&tab, now)) >= 0) {
+            um_sockmap_del(&tab, idx);
+        }
+        assert(tab.used == 0);
+
+        um_sockmap_free(&tab);
+    }
+
+    // Deleting entries of the slot being expired, its head as well, leaves
+    // the wheel intact
+    time_t now = 1000;
+
+    assert(um_sockmap_init(&tab, 64, 10) == 0);
+    for (int i = 0; i < 8; i++) {
+        addr = client_addr(i);
+        um_sockmap_ins(&tab, i, 0, &addr, now);
+    }
+    // Shares the wheel slot the detached one came from
+    addr = client_addr(8);
+    idx = um_sockmap_ins(&tab, 8, 0, &addr, now);
+    tab.ent[idx].last_use = now + 1 - 10 + UM_WHEEL_SIZE;
+
+    idx = um_sockmap_expired(&tab, now + 1);
+    assert(idx >= 0);
+    um_sockmap_del(&tab, idx);
+    assert(tab.wheel_due >= 0);
+    um_sockmap_del(&tab, tab.wheel_due);
+    assert(tab.wheel_due >= 0 && tab.ent[tab.wheel_due].wheel_next >= 0);
+    um_sockmap_del(&tab, tab.ent[tab.wheel_due].wheel_next);
+
+    int left = 0;
+    while ((idx = um_sockmap_expired(&tab, now + 1)) >= 0) {
+        assert(tab.ent[idx].sock < 8);
+        um_sockmap_del(&tab, idx);
+        left++;
+    }
+    assert(left == 5 && tab.used == 1);
+
+    now += 2 * UM_WHEEL_SIZE;
+    idx = um_sockmap_expired(&tab, now);
+    assert(idx >= 0 && tab.ent[idx].sock == 8);
+    um_sockmap_del(&tab, idx);
+    assert(um_sockmap_expired(&tab, now) < 0 && tab.used == 0);
+
+    um_sockmap_free(&tab);
+
+    return 0;
+}
@@ -0,0 +1,115 @@
+#include <stdio.h>
+#include <assert.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include "sockmap.h"
+#include "stats.h"
+
+int main(void)
+{
+    struct um_sockmap_tab tab;
+    struct um_stats st;
+    union um_sockaddr addr;
+    char buf[4096];
+    size_t n;
+    int idx;
+
+    assert(um_sockmap_init(&tab, 4, 0) == 0);
+
+    memset(&addr, 0, sizeof(addr));
+    addr.v4.sin_family = AF_INET;
+    addr.v4.sin_addr.s_addr = htonl(0x0A000001);
+    addr.v4.sin_port = htons(4242);
+
+    idx = um_sockmap_ins(&tab, 100, 0, &addr, 0);
+    assert(idx >= 0);
+    assert(tab.ent[idx].stats.up_pkts == 0);
+    tab.ent[idx].stats.up_pkts = 3;
+    tab.ent[idx].stats.down_bytes = 1234;
+    tab.ent[idx].stats.queued[UM_DIR_DOWN] = 5;
+    tab.ent[idx].stats.drop_queue = 6;
+    tab.ent[idx].last_use = 5;
+
+    memset(&st, 0, sizeof(st));
+    st.start = 10;
+    st.dir[UM_DIR_UP].rx_pkts = 7;
+    st.dir[UM_DIR_DOWN].drop_eagain = 2;
+    st.dir[UM_DIR_UP].drop_queue = 8;
+    st.dir[UM_DIR_UP].queued = 9;
+    st.drop_max_client = 1;
+    st.flows_spare = 3;
+
+    n = um_stats_format(buf, sizeof(buf), &st, &tab, 12, 0);
+    assert(n == strlen(buf));
+    assert(strstr(buf, "uptime 2\n"));
+    assert(strstr(buf, "flows 1\n"));
+    assert(strstr(buf, "flows_max 4\n"));
+    assert(strstr(buf, "flows_spare 3\n"));
+    assert(strstr(buf, "up_rx_pkts 7\n"));
+    assert(strstr(buf, "down_drop_eagain 2\n"));
+    assert(strstr(buf, "up_drop_queue 8\n"));
+    assert(strstr(buf, "up_queued 9\n"));
+    assert(strstr(buf, "drop_max_client 1\n"));
+    assert(!strstr(buf, "flow 10.0.0.1"));
+
+    n = um_stats_format(buf, sizeof(buf), &st, &tab, 12, 1);
+    assert(strstr(buf, "flow 10.0.0.1:4242 tunnel 0 idle 7 up_pkts 3 "
+                       "up_bytes 0 down_pkts 0 down_bytes 1234 up_queued 0 "
+                       "down_queued 5 drop_queue 6\n"));
+
+    // Only whole lines make it into a short buffer
+    n = um_stats_format(buf, 20, &st, &tab, 12, 1);
+    assert(n == strlen(buf));
+    assert(strcmp(buf, "uptime 2\nflows 1\n") == 0);
+
+    // IPv6 clients print bracketed
+    assert(um_sockaddr_parse(&addr, "2001:db8::1") == 0);
+    um_sockaddr_set_port(&addr, 53);
+    idx = um_sockmap_ins(&tab, 101, 1, &addr, 0);
+    assert(idx >= 0);
+    n = um_stats_format(buf, sizeof(buf), &st, &tab, 12, 1);
+    assert(strstr(buf, "flows 2\n"));
+    assert(strstr(buf, "flow [2001:db8::1]:53 tunnel 1 idle 0 "));
+    assert(strstr(buf, "flow 10.0.0.1:4242 "));
+    assert(!strstr(buf, "truncated"));
+
+    // Flows that don't fit are counted
+    size_t whole = n;
+
+    n = um_stats_format(buf, whole - 10, &st, &tab, 12, 1);
+    assert(n == strlen(buf) && n < whole - 10);
+    assert(strstr(buf, "\nflow ") &&
+           !strstr(strstr(buf, "\nflow ") + 1, "\nflow "));
+    assert(strlen(strstr(buf, "truncated 1\n")) == strlen("truncated 1\n"));
+
+    um_sockmap_free(&tab);
+
+    // Query round trip
+    const char *path = "/tmp/udpmask_test_stats.sock";
+    struct sockaddr_un to;
+    int srv, cli;
+
+    srv = um_stats_open(path);
+    assert(srv >= 0);
+
+    cli = socket(AF_UNIX, SOCK_DGRAM, 0);
+    assert(cli >= 0);
+
+    memset(&to, 0, sizeof(to));
+    to.sun_family = AF_UNIX;
+    strcpy(to.sun_path, path);
+    assert(sendto(cli, "x", 1, 0, (struct sockaddr *) &to, sizeof(to)) == 1);
+    assert(recv(srv, buf, sizeof(buf), 0) == 1);
+
+    close(cli);
+    um_stats_close(srv, path);
+    assert(access(path, F_OK) < 0);
+
+    printf("stats: ok\n");
+
+    return 0;
+}
@@ -1,4 +1,5 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
 #include <string.h>
 #include <sys/time.h>
@@ -46,6 +47,73 @@ int main(void)
     struct timeval t_start, t_end;
     double t_diff;
 
+    // Every kernel the CPU supports must match the scalar reference, at an
+    // odd offset and without touching the byte past the end
+    static unsigned char ref[4096 + 2], out[4096 + 2], jumbo[9000];
+
+    for (int v = 0; v < transform_impls_n; v++) {
+        const struct um_transform_impl *impl = &transform_impls[v];
+
+        if (!(*impl->supported)()) {
+            printf("Transform %s: not supported\n", impl->name);
+            continue;
+        }
+
+        for (size_t len = 0; len <= 4096; len++) {
+            for (size_t i = 0; i < sizeof(ref); i++) {
+                ref[i] = out[i] = (unsigned char) rand();
+            }
+
+            transformbuf_scalar(ref + 1, len, transform_mask);
+            (*impl->func)(out + 1, len, transform_mask);
+            assert(memcmp(ref, out, sizeof(ref)) == 0);
+        }
+
+        gettimeofday(&t_start, NULL);
+        for (int i = 0; i < iter; i++) {
+            (*impl->func)(jumbo, sizeof(jumbo), transform_mask);
+        }
+        gettimeofday(&t_end, NULL);
+        t_diff = (double) ((t_end.tv_sec - t_start.tv_sec) * 1e6 + (t_end.tv_usec - t_start.tv_usec));
+        printf("Time for transform %s, %zu bytes, 1 iterations: %f us\n",
+               impl->name, sizeof(jumbo), t_diff / iter);
+    }
+
+    printf("Transform kernel: %s\n", transform_init());
+
+    // Masks never have a zero byte, and don't repeat
+    unsigned char mask_a[64], mask_b[64];
+    genmask(mask_a, sizeof(mask_a));
+    for (int i = 0; i < 1000; i++) {
+        genmask(mask_b, sizeof(mask_b));
+        assert(memchr(mask_b, 0, sizeof(mask_b)) == NULL);
+        assert(memcmp(mask_a, mask_b, sizeof(mask_a)) != 0);
+    }
+
+    // The rand() loop genmask() replaced, for comparison
+    gettimeofday(&t_start, NULL);
+    for (int i = 0; i < iter; i++) {
+        for (size_t k = 0; k < MASK_LEN; k++) {
+            for (int j = 0; j < 10; j++) {
+                tran.mask[k] = (unsigned char) (rand() % 256);
+                if (tran.mask[k] != 0) break;
+            }
+        }
+    }
+    gettimeofday(&t_end, NULL);
+    t_diff = (double) ((t_end.tv_sec - t_start.tv_sec) * 1e6 + (t_end.tv_usec - t_start.tv_usec));
+    printf("Time for rand() mask, %d iterations: %f us\n", iter, t_diff);
+    printf("Time for rand() mask, 1 iterations: %f us\n", t_diff / iter);
+
+    gettimeofday(&t_start, NULL);
+    for (int i = 0; i < iter; i++) {
+        genmask(tran.mask, MASK_LEN);
+    }
+    gettimeofday(&t_end, NULL);
+    t_diff = (double) ((t_end.tv_sec - t_start.tv_sec) * 1e6 + (t_end.tv_usec - t_start.tv_usec));
+    printf("Time for genmask, %d iterations: %f us\n", iter, t_diff);
+    printf("Time for genmask, 1 iterations: %f us\n", t_diff / iter);
+
     gettimeofday(&t_start, NULL);
     for (int i = 0; i < iter; i++) {
         check_gen_mask(&tran);
@@ -123,5 +191,65 @@ int main(void)
     }
     printf("\n");
 
+    // transform_op() with a constant op must match the out of line calls
+    unsigned char op_a[64 + MASK_LEN], op_b[64 + MASK_LEN];
+    memset(op_a, 'x', sizeof(op_a));
+    memset(op_b, 'x', sizeof(op_b));
+    assert(transform_op(UM_OP_MASK, &tran, op_a, 64) == 64 + MASK_LEN);
+    memcpy(tran.mask, op_a + 64, MASK_LEN);
+    tran.mask_ct = 0;
+    assert(maskbuf(&tran, op_b, 64) == 64 + MASK_LEN);
+    assert(memcmp(op_a, op_b, sizeof(op_a)) == 0);
+    assert(transform_op(UM_OP_UNMASK, &tran, op_a, 64 + MASK_LEN) == 64);
+    assert(unmaskbuf(&tran, op_b, 64 + MASK_LEN) == 64);
+    assert(memcmp(op_a, op_b, 64) == 0 && op_a[0] == 'x');
+    assert(transform_op(UM_OP_NOOP, &tran, op_a, 64) == 64);
+    assert(transform_op(UM_OP_UNMASK, &tran, op_a, MASK_LEN - 1) == 0);
+
+    // Per datagram cost of the forwarding path, a call through buf_func
+    // against the transform inlined for one mode
+    static unsigned char dgrams[64][1400 + MASK_LEN];
+    size_t sizes[] = { 64, 1400 };
+    buf_func volatile funcs[] = { &maskbuf, &masknoop };
+    const char *names[] = { "mask", "noop" };
+    size_t sum = 0;
+
+    iter = 20000;
+
+    for (int f = 0; f < 2; f++) {
+        for (size_t z = 0; z < ARRAY_SIZE(sizes); z++) {
+            buf_func func = funcs[f];
+
+            gettimeofday(&t_start, NULL);
+            for (int i = 0; i < iter; i++) {
+                for (int d = 0; d < 64; d++) {
+                    sum += (*func)(&tran, dgrams[d], sizes[z]);
+                }
+            }
+            gettimeofday(&t_end, NULL);
+            t_diff = (double) ((t_end.tv_sec - t_start.tv_sec) * 1e6 + (t_end.tv_usec - t_start.tv_usec));
+            printf("Time for %s through buf_func, %zu bytes, 1 datagram: %f ns\n",
+                   names[f], sizes[z], t_diff * 1e3 / iter / 64);
+
+            gettimeofday(&t_start, NULL);
+            for (int i = 0; i < iter; i++) {
+                for (int d = 0; d < 64; d++) {
+                    if (f == 0) {
+                        sum += transform_op(UM_OP_MASK, &tran, dgrams[d],
+                                            sizes[z]);
+                    } else {
+                        sum += transform_op(UM_OP_NOOP, &tran, dgrams[d],
+                                            sizes[z]);
+                    }
+                }
+            }
+            gettimeofday(&t_end, NULL);
+            t_diff = (double) ((t_end.tv_sec - t_start.tv_sec) * 1e6 + (t_end.tv_usec - t_start.tv_usec));
+            printf("Time for %s inlined, %zu bytes, 1 datagram: %f ns\n",
+                   names[f], sizes[z], t_diff * 1e3 / iter / 64);
+        }
+    }
+    printf("(%zu)\n", sum);
+
     return 0;
 }
@@ -0,0 +1,134 @@
+#include <stdio.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+
+#include "uring.h"
+
+#ifdef UM_HAVE_URING
+
+#define NBUFS       8
+#define BUF_LEN     (sizeof(struct io_uring_recvmsg_out) + \
+                     sizeof(struct sockaddr_in) + 64)
+
+static int udp_sock(struct sockaddr_in *addr)
+{
+    socklen_t len = sizeof(*addr);
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+
+    assert(sock >= 0);
+
+    memset(addr, 0, sizeof(*addr));
+    addr->sin_family = AF_INET;
+    addr->sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    assert(bind(sock, (struct sockaddr *) addr, sizeof(*addr)) == 0);
+    assert(getsockname(sock, (struct sockaddr *) addr, &len) == 0);
+
+    return sock;
+}
+
+int main(void)
+{
+    struct um_uring r;
+    struct io_uring_sqe *sqe;
+    struct io_uring_cqe *cqe;
+    struct sockaddr_in rx_addr, tx_addr;
+    struct msghdr recv_msg, send_msg;
+    struct iovec iov;
+    unsigned int slot, head, tail;
+    int rx, tx, got = 0, sent = 0;
+
+    if (um_uring_init(&r, 8) < 0) {
+        printf("uring: skipped (%s)\n", strerror(errno));
+        return 0;
+    }
+
+    if (um_uring_bufs_init(&r, 0, NBUFS, BUF_LEN, 256) < 0) {
+        printf("uring: skipped, no provided buffers (%s)\n", strerror(errno));
+        um_uring_free(&r);
+        return 0;
+    }
+
+    rx = udp_sock(&rx_addr);
+    tx = udp_sock(&tx_addr);
+
+    memset(&recv_msg, 0, sizeof(recv_msg));
+    recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+
+    sqe = um_uring_sqe(&r, &slot);
+    assert(sqe);
+    um_uring_prep_recvmsg_multi(sqe, rx, &recv_msg, 0);
+    sqe->user_data = 1;
+
+    // Three datagrams through sendmsg SQEs
+    iov.iov_base = "abc";
+    iov.iov_len = 3;
+    memset(&send_msg, 0, sizeof(send_msg));
+    send_msg.msg_name = &rx_addr;
+    send_msg.msg_namelen = sizeof(rx_addr);
+    send_msg.msg_iov = &iov;
+    send_msg.msg_iovlen = 1;
+
+    for (int i = 0; i < 3; i++) {
+        sqe = um_uring_sqe(&r, &slot);
+        assert(sqe);
+        um_uring_prep_sendmsg(sqe, tx, &send_msg);
+        sqe->user_data = 2;
+    }
+
+    while (got < 3 || sent < 3) {
+        assert(um_uring_submit(&r, 1) == 0);
+
+        tail = um_uring_cq_ready(&r, &head);
+        for (; head != tail; head++) {
+            cqe = um_uring_cqe(&r, head);
+
+            if (cqe->user_data == 2) {
+                assert(cqe->res == 3);
+                sent++;
+                continue;
+            }
+
+            assert(cqe->user_data == 1);
+            assert(cqe->res > 0);
+            assert(cqe->flags & IORING_CQE_F_BUFFER);
+            assert(cqe->flags & IORING_CQE_F_MORE);
+
+            uint16_t bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+            unsigned char *buf = um_uring_buf(&r, bid);
+            struct io_uring_recvmsg_out out;
+            struct sockaddr_in from;
+
+            memcpy(&out, buf, sizeof(out));
+            memcpy(&from, buf + sizeof(out), sizeof(from));
+            assert(out.payloadlen == 3);
+            assert(from.sin_port == tx_addr.sin_port);
+            assert(memcmp(buf + sizeof(out) + recv_msg.msg_namelen,
+                          "abc", 3) == 0);
+
+            um_uring_buf_put(&r, bid);
+            got++;
+        }
+        um_uring_cq_advance(&r, head);
+    }
+
+    close(rx);
+    close(tx);
+    um_uring_free(&r);
+
+    printf("uring: ok\n");
+
+    return 0;
+}
+
+#else
+
+int main(void)
+{
+    printf("uring: skipped, build with -DUM_IO_URING\n");
+    return 0;
+}
+
+#endif /* UM_HAVE_URING */
@@ -3,51 +3,380 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
+#include <sys/syscall.h>
 
 #include "log.h"
 #include "transform.h"
 #include "udpmask.h"
 
-void check_gen_mask(struct um_transform *ctx)
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define UM_TRANSFORM_X86
+#include <immintrin.h>
+#endif
+
+#if defined(__GNUC__) && (defined(__aarch64__) || defined(__ARM_NEON))
+#define UM_TRANSFORM_NEON
+#include <arm_neon.h>
+#include <sys/auxv.h>
+#endif
+
+/////////////////////////////////////////////////////////////////////
+// transformbuf kernels
+/////////////////////////////////////////////////////////////////////
+
+// Vector widths are multiples of MASK_LEN, so every kernel leaves the
+// tail at a mask aligned offset and can hand it to transformbuf_scalar().
+
+static void transformbuf_generic(unsigned char *buf, size_t buflen,
+                                 const unsigned char *mask)
 {
-    if (ctx->mask_ct++ < MASK_MAXCT) {
-        return;
+    transformbuf_scalar(buf, buflen, mask);
+}
+
+static int supported_always(void)
+{
+    return 1;
+}
+
+#ifdef UM_TRANSFORM_X86
+
+__attribute__((target("sse2")))
+static void transformbuf_sse2(unsigned char *buf, size_t buflen,
+                              const unsigned char *mask)
+{
+    MASK_UNIT mask_word;
+    size_t i = 0;
+
+    memcpy(&mask_word, mask, sizeof(mask_word));
+    __m128i m = _mm_set1_epi32((int) mask_word);
+
+    for (; buflen - i >= 64; i += 64) {
+        __m128i *p = (__m128i *) (buf + i);
+        __m128i a = _mm_loadu_si128(p);
+        __m128i b = _mm_loadu_si128(p + 1);
+        __m128i c = _mm_loadu_si128(p + 2);
+        __m128i d = _mm_loadu_si128(p + 3);
+        _mm_storeu_si128(p, _mm_xor_si128(a, m));
+        _mm_storeu_si128(p + 1, _mm_xor_si128(b, m));
+        _mm_storeu_si128(p + 2, _mm_xor_si128(c, m));
+        _mm_storeu_si128(p + 3, _mm_xor_si128(d, m));
     }
 
-    log_debug("mask used more than %u times ago, update", MASK_MAXCT);
+    for (; buflen - i >= 16; i += 16) {
+        __m128i *p = (__m128i *) (buf + i);
+        _mm_storeu_si128(p, _mm_xor_si128(_mm_loadu_si128(p), m));
+    }
 
-    genmask(ctx->mask, MASK_LEN);
-    ctx->mask_ct = 0;
+    transformbuf_scalar(buf + i, buflen - i, mask);
 }
 
-size_t maskbuf(struct um_transform *ctx, unsigned char *buf, size_t buflen) {
-    if (buflen > UM_BUFFER - MASK_LEN) {
-        return 0;
+__attribute__((target("avx2")))
+static void transformbuf_avx2(unsigned char *buf, size_t buflen,
+                              const unsigned char *mask)
+{
+    MASK_UNIT mask_word;
+    size_t i = 0;
+
+    memcpy(&mask_word, mask, sizeof(mask_word));
+    __m256i m = _mm256_set1_epi32((int) mask_word);
+
+    for (; buflen - i >= 128; i += 128) {
+        __m256i *p = (__m256i *) (buf + i);
+        __m256i a = _mm256_loadu_si256(p);
+        __m256i b = _mm256_loadu_si256(p + 1);
+        __m256i c = _mm256_loadu_si256(p + 2);
+        __m256i d = _mm256_loadu_si256(p + 3);
+        _mm256_storeu_si256(p, _mm256_xor_si256(a, m));
+        _mm256_storeu_si256(p + 1, _mm256_xor_si256(b, m));
+        _mm256_storeu_si256(p + 2, _mm256_xor_si256(c, m));
+        _mm256_storeu_si256(p + 3, _mm256_xor_si256(d, m));
     }
 
-    check_gen_mask(ctx);
+    for (; buflen - i >= 32; i += 32) {
+        __m256i *p = (__m256i *) (buf + i);
+        _mm256_storeu_si256(p, _mm256_xor_si256(_mm256_loadu_si256(p), m));
+    }
 
-    transformbuf(buf, buflen, ctx->mask);
-    memcpy(buf + buflen, ctx->mask, MASK_LEN);
+    transformbuf_scalar(buf + i, buflen - i, mask);
+}
 
-    return buflen + MASK_LEN;
+__attribute__((target("avx512f,avx512bw")))
+static void transformbuf_avx512(unsigned char *buf, size_t buflen,
+                                const unsigned char *mask)
+{
+    MASK_UNIT mask_word;
+    size_t i = 0;
+
+    memcpy(&mask_word, mask, sizeof(mask_word));
+    __m512i m = _mm512_set1_epi32((int) mask_word);
+
+    for (; buflen - i >= 256; i += 256) {
+        unsigned char *p = buf + i;
+        __m512i a = _mm512_loadu_si512(p);
+        __m512i b = _mm512_loadu_si512(p + 64);
+        __m512i c = _mm512_loadu_si512(p + 128);
+        __m512i d = _mm512_loadu_si512(p + 192);
+        _mm512_storeu_si512(p, _mm512_xor_si512(a, m));
+        _mm512_storeu_si512(p + 64, _mm512_xor_si512(b, m));
+        _mm512_storeu_si512(p + 128, _mm512_xor_si512(c, m));
+        _mm512_storeu_si512(p + 192, _mm512_xor_si512(d, m));
+    }
+
+    for (; buflen - i >= 64; i += 64) {
+        unsigned char *p = buf + i;
+        _mm512_storeu_si512(p, _mm512_xor_si512(_mm512_loadu_si512(p), m));
+    }
+
+    // Masked load/store instead of the scalar tail
+    if (i < buflen) {
+        __mmask64 k = ((__mmask64) 1 << (buflen - i)) - 1;
+        __m512i *p = (__m512i *) (buf + i);
+        __m512i r = _mm512_maskz_loadu_epi8(k, p);
+        _mm512_mask_storeu_epi8(p, k, _mm512_xor_si512(r, m));
+    }
 }
 
-size_t unmaskbuf(struct um_transform *ctx, unsigned char *buf, size_t buflen) {
-    unsigned char rcv_mask[MASK_LEN];
-    size_t len;
+static int supported_sse2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse2");
+}
+
+static int supported_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static int supported_avx512(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx512f") &&
+           __builtin_cpu_supports("avx512bw");
+}
+
+#endif /* UM_TRANSFORM_X86 */
+
+#ifdef UM_TRANSFORM_NEON
+
+static void transformbuf_neon(unsigned char *buf, size_t buflen,
+                              const unsigned char *mask)
+{
+    MASK_UNIT mask_word;
+    size_t i = 0;
+
+    memcpy(&mask_word, mask, sizeof(mask_word));
+    uint8x16_t m = vreinterpretq_u8_u32(vdupq_n_u32(mask_word));
+
+    for (; buflen - i >= 64; i += 64) {
+        uint8x16_t a = vld1q_u8(buf + i);
+        uint8x16_t b = vld1q_u8(buf + i + 16);
+        uint8x16_t c = vld1q_u8(buf + i + 32);
+        uint8x16_t d = vld1q_u8(buf + i + 48);
+        vst1q_u8(buf + i, veorq_u8(a, m));
+        vst1q_u8(buf + i + 16, veorq_u8(b, m));
+        vst1q_u8(buf + i + 32, veorq_u8(c, m));
+        vst1q_u8(buf + i + 48, veorq_u8(d, m));
+    }
+
+    for (; buflen - i >= 16; i += 16) {
+        vst1q_u8(buf + i, veorq_u8(vld1q_u8(buf + i), m));
+    }
+
+    transformbuf_scalar(buf + i, buflen - i, mask);
+}
+
+static int supported_neon(void)
+{
+#if defined(__aarch64__)
+    return (getauxval(AT_HWCAP) & HWCAP_ASIMD) != 0;
+#elif defined(HWCAP_ARM_NEON)
+    return (getauxval(AT_HWCAP) & HWCAP_ARM_NEON) != 0;
+#else
+    return (getauxval(AT_HWCAP) & HWCAP_NEON) != 0;
+#endif
+}
+
+#endif /* UM_TRANSFORM_NEON */
+
+const struct um_transform_impl transform_impls[] = {
+    { "scalar", transformbuf_generic, supported_always },
+#ifdef UM_TRANSFORM_X86
+    { "sse2", transformbuf_sse2, supported_sse2 },
+    { "avx2", transformbuf_avx2, supported_avx2 },
+    { "avx512", transformbuf_avx512, supported_avx512 },
+#endif
+#ifdef UM_TRANSFORM_NEON
+    { "neon", transformbuf_neon, supported_neon },
+#endif
+};
+
+const int transform_impls_n = ARRAY_SIZE(transform_impls);
 
-    if (buflen < MASK_LEN) {
+transform_func transformbuf_impl = transformbuf_generic;
+
+// Pick the most preferred kernel this CPU supports, returns its name
+const char *transform_init(void)
+{
+    const struct um_transform_impl *best = &transform_impls[0];
+
+    for (int i = 1; i < transform_impls_n; i++) {
+        if ((*transform_impls[i].supported)()) {
+            best = &transform_impls[i];
+        }
+    }
+
+    transformbuf_impl = best->func;
+
+    return best->name;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Mask generator
+/////////////////////////////////////////////////////////////////////
+
+// xoshiro256**, seeded from the kernel. Each process has its own state,
+// forked workers reseed.
+static uint64_t rng_state[4];
+static int rng_seeded = 0;
+
+static inline uint64_t rotl(uint64_t x, int k)
+{
+    return (x << k) | (x >> (64 - k));
+}
+
+static uint64_t rng_next(void)
+{
+    uint64_t *s = rng_state;
+    uint64_t result = rotl(s[1] * 5, 7) * 9;
+    uint64_t t = s[1] << 17;
+
+    s[2] ^= s[0];
+    s[3] ^= s[1];
+    s[1] ^= s[2];
+    s[0] ^= s[3];
+    s[2] ^= t;
+    s[3] = rotl(s[3], 45);
+
+    return result;
+}
+
+static uint64_t splitmix64(uint64_t *x)
+{
+    uint64_t z = (*x += 0x9E3779B97F4A7C15ULL);
+
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    return z ^ (z >> 31);
+}
+
+// Fill buf from getrandom() or /dev/urandom. Returns 0, or -1 if neither
+// is there.
+static int read_entropy(void *buf, size_t len)
+{
+    unsigned char *p = buf;
+    size_t got = 0;
+    int fd;
+
+#ifdef SYS_getrandom
+    while (got < len) {
+        long ret = syscall(SYS_getrandom, p + got, len - got, 0);
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        got += (size_t) ret;
+    }
+    if (got == len) {
         return 0;
     }
+#endif
+
+    fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
 
-    len = buflen - MASK_LEN;
+    for (got = 0; got < len; ) {
+        ssize_t ret = read(fd, p + got, len - got);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            break;
+        }
+        got += (size_t) ret;
+    }
 
-    memcpy(rcv_mask, buf + len, MASK_LEN);
-    transformbuf(buf, len, rcv_mask);
+    close(fd);
+    return got == len ? 0 : -1;
+}
+
+void genmask_seed(void)
+{
+    uint64_t x;
 
-    return len;
+    if (read_entropy(rng_state, sizeof(rng_state)) < 0) {
+        log_warn("No kernel entropy, seeding masks from the clock");
+        x = (uint64_t) time(NULL) ^ ((uint64_t) getpid() << 32) ^
+            (uint64_t) (uintptr_t) &x;
+        for (int i = 0; i < 4; i++) {
+            rng_state[i] = splitmix64(&x);
+        }
+    }
+
+    // The all zero state is the one xoshiro can't leave
+    if (!(rng_state[0] | rng_state[1] | rng_state[2] | rng_state[3])) {
+        x = 0;
+        rng_state[0] = splitmix64(&x);
+    }
+
+    rng_seeded = 1;
+}
+
+// Fill mask with n random bytes, none of them zero. Each byte takes 32
+// bits of output scaled to 1..255, the bias is below 2^-24.
+void genmask(unsigned char *mask, size_t n)
+{
+    uint64_t r = 0;
+
+    if (!rng_seeded) {
+        genmask_seed();
+    }
+
+    for (size_t i = 0; i < n; i++) {
+        if ((i & 1) == 0) {
+            r = rng_next();
+        }
+        mask[i] = (unsigned char) ((((r & 0xffffffffU) * 255) >> 32) + 1);
+        r >>= 32;
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+
+void check_gen_mask(struct um_transform *ctx)
+{
+    if (ctx->mask_ct++ < MASK_MAXCT) {
+        return;
+    }
+
+    log_debug("mask used more than %u times ago, update", MASK_MAXCT);
+
+    genmask(ctx->mask, MASK_LEN);
+    ctx->mask_ct = 0;
+}
+
+size_t maskbuf(struct um_transform *ctx, unsigned char *buf, size_t buflen) {
+    return transform_op(UM_OP_MASK, ctx, buf, buflen);
+}
+
+size_t unmaskbuf(struct um_transform *ctx, unsigned char *buf, size_t buflen) {
+    return transform_op(UM_OP_UNMASK, ctx, buf, buflen);
 }
 
 size_t masknoop(struct um_transform * ctx, unsigned char *buf, size_t buflen) {
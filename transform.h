@@ -5,6 +5,8 @@
 #include <stdlib.h>
 #include <string.h>
 
+#include "udpmask.h"
+
 #define MASK_UNIT       uint32_t
 #define MASK_LEN        ((int) sizeof(MASK_UNIT))
 #define MASK_MAXCT      ((unsigned int) 100000)
@@ -14,8 +16,25 @@ struct um_transform {
     unsigned int    mask_ct;
 };
 
-static inline void transformbuf(unsigned char *buf, size_t buflen,
-                                const unsigned char *mask)
+typedef void (*transform_func)(unsigned char *, size_t,
+                               const unsigned char *);
+
+struct um_transform_impl {
+    const char     *name;
+    transform_func  func;
+    int           (*supported)(void);
+};
+
+// Available kernels, in order of preference, scalar first
+extern const struct um_transform_impl transform_impls[];
+extern const int transform_impls_n;
+
+// Kernel picked by transform_init(), scalar until then
+extern transform_func transformbuf_impl;
+
+// Reference implementation, vector kernels finish their tail with it
+static inline void transformbuf_scalar(unsigned char *buf, size_t buflen,
+                                       const unsigned char *mask)
 {
     MASK_UNIT mask_word;
     size_t i = 0;
@@ -34,17 +53,15 @@ static inline void transformbuf(unsigned char *buf, size_t buflen,
     }
 }
 
+static inline void transformbuf(unsigned char *buf, size_t buflen,
+                                const unsigned char *mask)
+{
+    (*transformbuf_impl)(buf, buflen, mask);
+}
 
-#define genmask(mask, n)                                        \
-    do {                                                        \
-        for (size_t i = 0; i < n; i++) {                        \
-            for (int j = 0; j < 10; j++) {                      \
-                mask[i] = (unsigned char) (rand() % 256);       \
-                if (mask[i] != 0) break;                        \
-            }                                                   \
-        }                                                       \
-    } while (0)                                                 \
-
+const char *transform_init(void);
+void genmask_seed(void);
+void genmask(unsigned char *mask, size_t n);
 void check_gen_mask(struct um_transform *);
 size_t maskbuf(struct um_transform *, unsigned char *, size_t);
 size_t unmaskbuf(struct um_transform *, unsigned char *, size_t);
@@ -52,4 +69,50 @@ size_t masknoop(struct um_transform *, unsigned char *, size_t);
 
 typedef size_t (*buf_func)(struct um_transform *, unsigned char *, size_t);
 
+enum um_transform_op {
+    UM_OP_NOOP,         // masknoop()
+    UM_OP_MASK,         // maskbuf()
+    UM_OP_UNMASK,       // unmaskbuf()
+};
+
+// Length change of a datagram through op
+#define TRANSFORM_DELTA(op)                                     \
+    ((op) == UM_OP_MASK ? MASK_LEN : (op) == UM_OP_UNMASK ? -MASK_LEN : 0)
+
+// maskbuf(), unmaskbuf() or masknoop() by op. With op a constant the
+// other two fold away, for callers that want the transform inlined.
+static inline size_t transform_op(enum um_transform_op op,
+                                  struct um_transform *ctx,
+                                  unsigned char *buf, size_t buflen)
+{
+    unsigned char rcv_mask[MASK_LEN];
+
+    switch (op) {
+    case UM_OP_MASK:
+        if (buflen > UM_BUFFER - MASK_LEN) {
+            return 0;
+        }
+        if (ctx->mask_ct < MASK_MAXCT) {
+            ctx->mask_ct++;
+        } else {
+            check_gen_mask(ctx);
+        }
+        transformbuf(buf, buflen, ctx->mask);
+        memcpy(buf + buflen, ctx->mask, MASK_LEN);
+        return buflen + MASK_LEN;
+
+    case UM_OP_UNMASK:
+        if (buflen < MASK_LEN) {
+            return 0;
+        }
+        buflen -= MASK_LEN;
+        memcpy(rcv_mask, buf + buflen, MASK_LEN);
+        transformbuf(buf, buflen, rcv_mask);
+        return buflen;
+
+    default:
+        return buflen;
+    }
+}
+
 #endif /* _incl_TRANSFORM_H */
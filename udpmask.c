@@ -1,36 +1,124 @@
+#define _GNU_SOURCE
+
 #include <errno.h>
 #include <fcntl.h>
 #include <libgen.h>
-#include <netdb.h>
 #include <signal.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <poll.h>
 #include <time.h>
 #include <unistd.h>
 #include <arpa/inet.h>
 #include <netinet/in.h>
+#include <sys/resource.h>
 #include <sys/select.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
-
+#include <sys/uio.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
+#include "addr.h"
+#include "clock.h"
+#include "config.h"
+#include "handoff.h"
 #include "log.h"
+#include "pipe.h"
+#include "pool.h"
+#include "resolver.h"
+#include "sockmap.h"
+#include "stats.h"
 #include "transform.h"
 #include "udpmask.h"
+#include "uring.h"
+
+#ifdef UM_HAVE_EPOLL
+#include <sys/epoll.h>
+#endif
+
 
-static int bind_sock = -1;
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+#include <linux/filter.h>
+#endif
 
-static char host_conn[256];
-static uint16_t port_conn = 0;
+#define UM_SPARE_SOCKS      8   // flow sockets kept ready per tunnel
+#define UM_SPARE_MAX        64  // and at most this many in all
+#define UM_FD_RESERVE       64  // descriptors spares leave free
+
+#define UM_HANDOFF_FLUSH_MS 500 // full sockets' grace before a handoff
+
+// A listening port forwarded to one remote. Tunnels share the event loop,
+// the flow map, the packet pool and the resolver.
+struct um_tunnel {
+    struct um_tunnel_conf conf;         // conf.listen has the port set
+    int                 listen_any;     // "*", bound to :: or 0.0.0.0
+    int                 bind_sock;
+    int                 bind_pending;   // owned by the event loop
+    struct um_txq       bind_txq;       // shared by the tunnel's flows
+    struct um_transform tran;
+    enum um_transform_op snd_op;        // towards the remote
+    enum um_transform_op rcv_op;        // back to clients
+
+    // The remote keeps the family it first resolved to, flow sockets are
+    // made for it. conn_key.family is 0 until then.
+    union um_sockaddr   conn_addr;
+    struct um_flow_key  conn_key;
+    time_t              time_conn_addr;
+    int                 resolve_inflight;
+
+    // Flow sockets made while the loop is idle, connected to spare_conn,
+    // so a new client costs no socket setup
+    int                 spare[UM_SPARE_SOCKS];
+    int                 spare_n;
+    struct um_flow_key  spare_conn;
+};
+
+static struct um_tunnel *tunnels;
+static int n_tunnels;
 
 static int timeout = UM_TIMEOUT;
-static struct um_sockmap map[UM_MAX_CLIENT];
+static int max_client = UM_MAX_CLIENT;
+static struct um_sockmap_tab map;
+
+static int mmsg_batch = UM_MMSG_BATCH;
+static int use_gso = 0;
+static int workers = 1;
+static int use_reply_sock = 0;
+static int txq_max = UM_TXQ_MAX;
+
+static const char *stats_path = NULL;
+static int stats_sock = -1;
+static struct um_stats stats;
+
+static struct um_pool pool;     // datagrams waiting for a socket to drain
+
+static const char *handoff_path = NULL;
+static int handoff_sock = -1;   // a new process connects here to take over
+static int handoff_conn = -1;   // one that did, until it says what it wants
+static int handoff_done = 0;    // the paths belong to the new process now
+// Flows handed over by the previous process, for start() to adopt
+static struct um_handoff_rec *handoff_rec;
+static int *handoff_fds;
+static int handoff_n_flows;
 
 static volatile sig_atomic_t signal_term = 0;
+static volatile sig_atomic_t signal_dump = 0;
 
 #define UM_DRAIN_BATCH      64
+#define UM_LOG_FLUSH        64  // log lines written per loop iteration
 #define UM_SOCK_BUF_SIZE    (1024 * 1024)
+#define UM_GSO_MAX_SEGS     64
+// Room for every GRO segment to grow by a mask when spread out in place
+#define UM_BUFFER_STRIDE    ((UM_BUFFER + UM_GSO_MAX_SEGS * MASK_LEN + 63) & ~63)
+
+#ifdef __GNUC__
+#define UM_ALWAYS_INLINE    inline __attribute__((always_inline))
+#else
+#define UM_ALWAYS_INLINE    inline
+#endif
 
 static inline int would_block(void)
 {
@@ -55,14 +143,32 @@ static void tune_sock_buffers(int sock)
     setsockopt(sock, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
 }
 
-static int new_sock_nonblocking(void)
+static void set_sock_gro(int sock)
 {
-    int sock = NEW_SOCK();
+#ifdef UM_HAVE_GSO
+    int on = 1;
+
+    if (use_gso && setsockopt(sock, SOL_UDP, UDP_GRO, &on, sizeof(on)) < 0) {
+        log_warn("UDP_GRO: %s", strerror(errno));
+    }
+#endif
+}
+
+// IPv6 sockets take IPv4 peers too, as v4-mapped addresses
+static int new_sock_nonblocking(int family)
+{
+    int off = 0;
+    int sock = NEW_SOCK(family);
     if (sock < 0) {
         return -1;
     }
 
+    if (family == AF_INET6) {
+        setsockopt(sock, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+    }
+
     tune_sock_buffers(sock);
+    set_sock_gro(sock);
 
     if (set_sock_nonblocking(sock) < 0) {
         int saved_errno = errno;
@@ -80,24 +186,94 @@ static int usage(void)
     "Usage: udpmask -m mode\n"
     "               -c remote -o remote_port\n"
     "               [-l listen] [-p listen_port]\n"
-    "               [-t timeout] [-d] [-P pidfile]\n"
+    "               [-f config]\n"
+    "               [-t timeout] [-n max_clients] [-b batch] [-g]\n"
+    "               [-q queue] [-w workers] [-T] [-R] [-S stats_socket]\n"
+    "               [-H handoff_socket]\n"
+    "               [-d] [-P pidfile] [-v]\n"
     "               [-h]\n";
     fprintf(stderr, ubuf);
     return 1;
 }
 
 /////////////////////////////////////////////////////////////////////
-// sock_fd_max
+// um_event
 /////////////////////////////////////////////////////////////////////
 
+#define UM_EVENT_RESOLVER   -1  // event index of the resolver socket
+#define UM_EVENT_STATS      -2  // event index of the stats socket
+#define UM_EVENT_HANDOFF    -3  // event index of the handoff socket
+#define UM_EVENT_HANDOFF_CONN   -4  // and of a successor connected to it
+// Sockets that are only watched for readiness, never read by the loop
+#define UM_EVENT_IS_CTL(idx)    ((idx) < 0 && (idx) > UM_EVENT_BIND(0))
+// Event index of the listening socket of tunnel t, below the others
+#define UM_EVENT_BIND(t)    (-5 - (t))
+#define UM_EVENT_IS_BIND(idx)   ((idx) <= UM_EVENT_BIND(0))
+#define UM_EVENT_TUNNEL(idx)    (-5 - (idx))
+#define UM_EVENT_MIN        UM_EVENT_BIND(n_tunnels - 1)
+// Event index of the reply socket of map entry i, map entries come first
+#define UM_EVENT_REPLY(i)   ((i) + max_client)
+
+#ifdef UM_HAVE_EPOLL
+
+static int epoll_fd = -1;
+
+static inline int um_poll_init(void)
+{
+    epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return epoll_fd < 0 ? -1 : 0;
+}
+
+static inline void um_poll_fini(void)
+{
+    if (epoll_fd >= 0) {
+        close(epoll_fd);
+        epoll_fd = -1;
+    }
+}
+
+static inline int um_poll_add(int sock, int idx)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLET,
+        .data.u32 = (uint32_t) idx,
+    };
+
+    return epoll_ctl(epoll_fd, EPOLL_CTL_ADD, sock, &ev);
+}
+
+static inline void um_poll_del(int sock, int idx)
+{
+    epoll_ctl(epoll_fd, EPOLL_CTL_DEL, sock, NULL);
+}
+
+// Also report sock once it has room to send, while on is set
+static inline void um_poll_want_write(int sock, int idx, int on)
+{
+    struct epoll_event ev = {
+        .events = EPOLLIN | EPOLLET | (on ? EPOLLOUT : 0),
+        .data.u32 = (uint32_t) idx,
+    };
+
+    epoll_ctl(epoll_fd, EPOLL_CTL_MOD, sock, &ev);
+}
+
+#else
+
+static fd_set active_fd_set;
+static fd_set active_wr_fd_set; // sockets with datagrams waiting
+static int sock_fd_base = -1;   // highest socket not owned by the map
 static int sock_fd_max = -1;
 
 static inline void update_sock_fd_max(void)
 {
-    sock_fd_max = bind_sock;
-    for (int i = 0; i < ARRAY_SIZE(map); i++) {
-        if (map[i].in_use && map[i].sock > sock_fd_max) {
-            sock_fd_max = map[i].sock;
+    sock_fd_max = sock_fd_base;
+    for (int i = 0; i < map.cap; i++) {
+        if (map.ent[i].in_use && map.ent[i].sock > sock_fd_max) {
+            sock_fd_max = map.ent[i].sock;
+        }
+        if (map.ent[i].in_use && map.ent[i].reply_sock > sock_fd_max) {
+            sock_fd_max = map.ent[i].reply_sock;
         }
     }
 }
@@ -116,391 +292,3520 @@ static inline void update_sock_fd_max(void)
         }                                   \
     } while (0)                             \
 
+static inline int um_poll_init(void)
+{
+    FD_ZERO(&active_fd_set);
+    FD_ZERO(&active_wr_fd_set);
+    sock_fd_base = -1;
+    sock_fd_max = -1;
+    return 0;
+}
+
+static inline void um_poll_fini(void)
+{
+}
+
+static inline int um_poll_add(int sock, int idx)
+{
+    if (sock >= FD_SETSIZE) {
+        errno = EMFILE;
+        return -1;
+    }
+
+    if (idx < 0 && sock > sock_fd_base) {
+        sock_fd_base = sock;
+    }
+
+    FD_SET(sock, &active_fd_set);
+    UPDATE_SOCK_FD_MAX_ADD(sock);
+    return 0;
+}
+
+// Call after the map entry owning sock has been released
+static inline void um_poll_del(int sock, int idx)
+{
+    FD_CLR(sock, &active_fd_set);
+    FD_CLR(sock, &active_wr_fd_set);
+    UPDATE_SOCK_FD_MAX_RM(sock);
+}
+
+static inline void um_poll_want_write(int sock, int idx, int on)
+{
+    if (on) {
+        FD_SET(sock, &active_wr_fd_set);
+    } else {
+        FD_CLR(sock, &active_wr_fd_set);
+    }
+}
+
+#endif /* UM_HAVE_EPOLL */
+
+#ifdef UM_HAVE_URING
+
+#define UM_URING_ENTRIES    256
+#define UM_URING_BUFS       256     // provided receive buffers
+#define UM_URING_BGID       0
+#define UM_URING_CTL        CMSG_SPACE(sizeof(int))
+// recvmsg_out header, source address and GRO cmsg ahead of each payload
+#define UM_URING_HDR        (sizeof(struct io_uring_recvmsg_out) +    \
+                             sizeof(union um_sockaddr) + UM_URING_CTL)
+#define UM_URING_BUF_LEN    (UM_URING_HDR + UM_BUFFER)
+#define UM_URING_BUF_STRIDE                                             \
+    ((UM_URING_BUF_LEN + UM_GSO_MAX_SEGS * MASK_LEN + 63) & ~63)
+
+// user_data is the kind in the top two bits, then
+//   UD_EVENT: generation << 32 | event index
+//   UD_SEND:  direction << 16 | buffer id
+#define UD_KIND(ud)         ((ud) >> 62)
+#define UD_EVENT            0ULL
+#define UD_SEND             1ULL
+#define UD_IGNORE           2ULL
+#define UD_GEN_MASK         0x3fffffffU
+
+// Send descriptor of each SQE slot, the kernel has copied it by the time
+// the slot comes around again
+struct um_uring_tx {
+    struct msghdr       msg;
+    struct iovec        iov;
+    union um_sockaddr   to;
+};
+
+static int use_uring = 0;
+static struct um_uring uring = { .fd = -1 };
+static uint32_t *uring_gen;     // by event index - UM_EVENT_MIN
+static uint16_t *uring_refs;    // sends in flight per buffer
+static struct um_uring_tx *uring_tx;
+static const struct msghdr uring_recv_msg = {
+    .msg_namelen = sizeof(union um_sockaddr),
+    .msg_controllen = UM_URING_CTL,
+};
+
+#define URING_GEN(idx)      uring_gen[(idx) - UM_EVENT_MIN]
+#define UD_EVENT_OF(idx)                                                \
+    ((UD_EVENT << 62) | ((uint64_t) (URING_GEN(idx) & UD_GEN_MASK) << 32) \
+     | (uint32_t) (idx))
+
+static void um_uring_fini(void)
+{
+    um_uring_free(&uring);
+    free(uring_gen);
+    free(uring_refs);
+    free(uring_tx);
+    uring_gen = NULL;
+    uring_refs = NULL;
+    uring_tx = NULL;
+    use_uring = 0;
+}
+
+static int um_uring_setup(void)
+{
+    if (um_uring_init(&uring, UM_URING_ENTRIES) < 0) {
+        return -1;
+    }
+
+    uring_gen = calloc(UM_EVENT_REPLY(max_client) - UM_EVENT_MIN,
+                       sizeof(*uring_gen));
+    uring_refs = calloc(UM_URING_BUFS, sizeof(*uring_refs));
+    uring_tx = calloc(uring.sq_entries, sizeof(*uring_tx));
+
+    if (!uring_gen || !uring_refs || !uring_tx ||
+        um_uring_bufs_init(&uring, UM_URING_BGID, UM_URING_BUFS,
+                           UM_URING_BUF_LEN, UM_URING_BUF_STRIDE) < 0) {
+        int saved_errno = errno;
+        um_uring_fini();
+        errno = saved_errno;
+        return -1;
+    }
+
+    use_uring = 1;
+    return 0;
+}
+
+// io_uring sends on a non-blocking socket fail with EAGAIN once its buffer
+// fills, on a blocking one they wait for room in the kernel
+static int set_sock_blocking(int sock)
+{
+    int flags = fcntl(sock, F_GETFL, 0);
+    if (flags < 0) {
+        return -1;
+    }
+
+    return fcntl(sock, F_SETFL, flags & ~O_NONBLOCK);
+}
+
+// Queue a multishot receive on a forwarding socket, or a multishot poll
+// on one of the others, under the current generation of idx
+static int um_uring_arm(int sock, int idx)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int slot;
+
+    sqe = um_uring_sqe(&uring, &slot);
+    if (!sqe) {
+        return -1;
+    }
+
+    if (UM_EVENT_IS_CTL(idx)) {
+        um_uring_prep_poll_multi(sqe, sock, POLLIN);
+    } else {
+        um_uring_prep_recvmsg_multi(sqe, sock, &uring_recv_msg,
+                                    UM_URING_BGID);
+    }
+    sqe->user_data = UD_EVENT_OF(idx);
+
+    return 0;
+}
+
+#endif /* UM_HAVE_URING */
+
+static inline int um_event_init(void)
+{
+#ifdef UM_HAVE_URING
+    if (um_uring_setup() == 0) {
+        return 0;
+    }
+    log_warn("io_uring not available (%s), falling back", strerror(errno));
+#endif
+    return um_poll_init();
+}
+
+static inline void um_event_fini(void)
+{
+#ifdef UM_HAVE_URING
+    if (use_uring) {
+        um_uring_fini();
+        return;
+    }
+#endif
+    um_poll_fini();
+}
+
+static inline int um_event_add(int sock, int idx)
+{
+#ifdef UM_HAVE_URING
+    if (use_uring) {
+        if (!UM_EVENT_IS_CTL(idx) && set_sock_blocking(sock) < 0) {
+            return -1;
+        }
+        URING_GEN(idx)++;
+        return um_uring_arm(sock, idx);
+    }
+#endif
+    return um_poll_add(sock, idx);
+}
+
+// Call before sock is closed
+static inline void um_event_del(int sock, int idx)
+{
+#ifdef UM_HAVE_URING
+    if (use_uring) {
+        struct io_uring_sqe *sqe;
+        unsigned int slot;
+
+        sqe = um_uring_sqe(&uring, &slot);
+        if (sqe) {
+            um_uring_prep_cancel(sqe, UD_EVENT_OF(idx));
+            sqe->user_data = UD_IGNORE << 62;
+        }
+
+        // Completions still queued for idx are stale from here on
+        URING_GEN(idx)++;
+
+        // Queued sends may name sock, get them in before it is closed
+        um_uring_submit(&uring, 0);
+        return;
+    }
+#endif
+    um_poll_del(sock, idx);
+}
+
+// Watch sock for room to send while its tx queue holds datagrams
+static inline void um_event_want_write(int sock, int idx, int on)
+{
+#ifdef UM_HAVE_URING
+    if (use_uring) {
+        return;
+    }
+#endif
+    um_poll_want_write(sock, idx, on);
+}
+
 /////////////////////////////////////////////////////////////////////
 
+#ifdef UM_HAVE_PIPELINE
+
 /////////////////////////////////////////////////////////////////////
-// um_sockmap
+// um_pipe
 /////////////////////////////////////////////////////////////////////
 
-static inline int sockaddr_in_cmp(const struct sockaddr_in *a,
-                                  const struct sockaddr_in *b);
+// With -T the event loop only receives. Each datagram is copied into a
+// pool packet and handed to a transform thread, then to a send thread,
+// over SPSC rings, so datagrams leave in the order they came in. Packets
+// go back to the loop, which owns the pool, on a third ring. The send
+// thread holds back what a full socket won't take in a queue of its own
+// per socket, up to -q datagrams per flow, and carries on with the others.
+
+#define UM_PIPE_RING        2048    // more than the pool has packets
+#define UM_PIPE_DEFER_SOCKS 64      // full sockets waited on at once
+#define UM_PIPE_DEFER_MAX   (UM_POOL_SMALL_N / 2)   // packets held back
+
+static int use_pipeline = 0;
+static struct um_spsc pipe_xf;      // loop to transform thread
+static struct um_spsc pipe_tx;      // transform to send thread
+static struct um_spsc pipe_ret;     // send thread back to the loop
+static struct um_bell bell_xf;
+static struct um_bell bell_tx;
+static struct um_bell bell_ret;
+static pthread_t pipe_thr[2];
+static int pipe_stop;
+static unsigned int pipe_inflight;  // packets handed out, not back yet
+static unsigned int pipe_held;      // of those, held back by the send thread
+static int *pipe_flow_held;         // and by flow, the send thread's
+// Passed down the rings after the last packet for a socket the loop is
+// closing, comes back once the send thread has let go of it
+static struct um_pkt pipe_mark;
+static int pipe_mark_back;
+static struct um_dir_stats pipe_st[UM_DIR_N];   // the send thread's
+
+#define PIPE_ST_FIELDS(F)                                               \
+    F(tx_pkts) F(tx_bytes) F(drop_transform) F(drop_send) F(drop_eagain) \
+    F(drop_queue) F(queued)
+
+// Publish the counters the send thread keeps in st, for the loop to read
+static void um_pipe_publish(const struct um_dir_stats *st)
+{
+    for (int d = 0; d < UM_DIR_N; d++) {
+#define F(f) __atomic_store_n(&pipe_st[d].f, st[d].f, __ATOMIC_RELAXED);
+        PIPE_ST_FIELDS(F)
+#undef F
+    }
+}
+
+// Add what the send thread published to the loop's counters in st
+static void um_pipe_add_stats(struct um_stats *st)
+{
+    for (int d = 0; d < UM_DIR_N; d++) {
+#define F(f) st->dir[d].f += __atomic_load_n(&pipe_st[d].f, __ATOMIC_RELAXED);
+        PIPE_ST_FIELDS(F)
+#undef F
+    }
+}
+
+// Take back the packets the send thread is done with
+static void um_pipe_reclaim(void)
+{
+    struct um_pkt *pkt;
+
+    while ((pkt = um_spsc_pop(&pipe_ret))) {
+        if (pkt == &pipe_mark) {
+            pipe_mark_back = 1;
+            continue;
+        }
+        um_pool_put(&pool, pkt);
+        pipe_inflight--;
+    }
+}
+
+// Wait until the threads are done with sock, of map entry flow, which is
+// about to be closed: what was handed out for it is sent, and what the
+// send thread still holds back for it is dropped. Other sockets keep
+// theirs. A sock of -1 stands for every socket.
+static void um_pipe_forget(int sock, int flow)
+{
+    um_pipe_reclaim();
+    if (pipe_inflight == 0) {
+        return;
+    }
+
+    pipe_mark.op = UM_OP_NOOP;
+    pipe_mark.len = 0;
+    pipe_mark.sock = sock;
+    pipe_mark.flow = flow;
+    pipe_mark_back = 0;
+    um_spsc_push(&pipe_xf, &pipe_mark);
+
+    while (!pipe_mark_back) {
+        um_bell_ring(&bell_xf);
+        um_bell_wait(&bell_ret, &pipe_ret, &pipe_stop);
+        um_pipe_reclaim();
+    }
+}
+
+#endif /* UM_HAVE_PIPELINE */
+
+/////////////////////////////////////////////////////////////////////
+// um_sockmap
+/////////////////////////////////////////////////////////////////////
 
 #define UPDATE_LAST_USE(idx, time_val)          \
     do {                                        \
         if (time_val != TIME_INVALID) {         \
-            map[idx].last_use = time_val;       \
+            map.ent[idx].last_use = time_val;   \
         }                                       \
     } while (0)                                 \
 
-static inline int um_sockmap_ins(int sock, struct sockaddr_in *addr)
-{
-    int i = 0;
+static inline int um_sockmap_clean(time_t time_val)
+{
+    int purged = 0;
+    int i;
+
+    while ((i = um_sockmap_expired(&map, time_val)) >= 0) {
+        int sock = map.ent[i].sock;
+        int reply_sock = map.ent[i].reply_sock;
+        char addr[UM_ADDR_STRLEN];
+
+#ifdef UM_HAVE_PIPELINE
+        if (use_pipeline) {
+            um_pipe_forget(sock, i);
+            if (reply_sock >= 0) {
+                um_pipe_forget(reply_sock, i);
+            }
+        }
+#endif
+
+        stats.dir[UM_DIR_UP].queued -= map.ent[i].txq.n;
+        stats.dir[UM_DIR_DOWN].queued -= map.ent[i].reply_txq.n;
+        um_txq_clear(&map.ent[i].txq, &pool);
+        um_txq_clear(&map.ent[i].reply_txq, &pool);
+        // What it left on the shared queue still goes out
+        um_txq_disown(&tunnels[map.ent[i].tunnel].bind_txq, i);
+
+        log_info("Purged connection from [%s] on tunnel %d",
+                 um_sockaddr_str(&map.ent[i].from, addr, sizeof(addr)),
+                 map.ent[i].tunnel);
+
+        stats.flows_purged++;
+
+        // The entry is free from here on
+        um_sockmap_del(&map, i);
+        um_event_del(sock, i);
+        close(sock);
+
+        if (reply_sock >= 0) {
+            um_event_del(reply_sock, UM_EVENT_REPLY(i));
+            close(reply_sock);
+        }
+
+        if (!purged) {
+            purged = 1;
+        }
+    }
+
+    return purged;
+}
+
+/////////////////////////////////////////////////////////////////////
+
+/////////////////////////////////////////////////////////////////////
+// um_batch
+/////////////////////////////////////////////////////////////////////
+
+#ifdef UM_HAVE_GSO
+union um_cmsg {
+    char            buf[CMSG_SPACE(sizeof(int))];
+    struct cmsghdr  align;
+};
+#endif
+
+struct um_batch {
+    int                 size;
+    int                 tx_size;    // size, or size * UM_GSO_MAX_SEGS
+    unsigned char      *bufs;
+    union um_sockaddr  *addr;
+    struct iovec       *rx_iov;
+    struct mmsghdr     *rx;
+    struct iovec       *tx_iov;
+    struct mmsghdr     *tx;
+    int                *tx_sock;
+    int                *tx_flow;    // map entry behind each tx slot
+#ifdef UM_HAVE_GSO
+    union um_cmsg      *rx_ctl;
+    struct mmsghdr     *gso;        // tx runs coalesced for UDP_SEGMENT
+    union um_cmsg      *gso_ctl;
+    int                *gso_first;
+#endif
+#ifdef UM_HAVE_URING
+    uint16_t           *rx_bid;     // provided buffer behind each rx slot
+    uint16_t           *tx_bid;
+#endif
+};
+
+#define BATCH_BUF(b, k)     ((b)->bufs + (size_t) (k) * UM_BUFFER_STRIDE)
+
+static int um_batch_init(struct um_batch *b, int size)
+{
+    memset(b, 0, sizeof(*b));
+
+    b->size = size;
+    b->tx_size = use_gso ? size * UM_GSO_MAX_SEGS : size;
+    b->bufs = malloc((size_t) size * UM_BUFFER_STRIDE);
+    b->addr = calloc(size, sizeof(*b->addr));
+    b->rx_iov = calloc(size, sizeof(*b->rx_iov));
+    b->rx = calloc(size, sizeof(*b->rx));
+    b->tx_iov = calloc(b->tx_size, sizeof(*b->tx_iov));
+    b->tx = calloc(b->tx_size, sizeof(*b->tx));
+    b->tx_sock = calloc(b->tx_size, sizeof(*b->tx_sock));
+    b->tx_flow = calloc(b->tx_size, sizeof(*b->tx_flow));
+
+    if (!b->bufs || !b->addr || !b->rx_iov || !b->rx ||
+        !b->tx_iov || !b->tx || !b->tx_sock || !b->tx_flow) {
+        return -1;
+    }
+
+#ifdef UM_HAVE_GSO
+    if (use_gso) {
+        b->rx_ctl = calloc(size, sizeof(*b->rx_ctl));
+        b->gso = calloc(b->tx_size, sizeof(*b->gso));
+        b->gso_ctl = calloc(b->tx_size, sizeof(*b->gso_ctl));
+        b->gso_first = calloc(b->tx_size, sizeof(*b->gso_first));
+
+        if (!b->rx_ctl || !b->gso || !b->gso_ctl || !b->gso_first) {
+            return -1;
+        }
+    }
+#endif
+
+#ifdef UM_HAVE_URING
+    b->rx_bid = calloc(size, sizeof(*b->rx_bid));
+    b->tx_bid = calloc(b->tx_size, sizeof(*b->tx_bid));
+
+    if (!b->rx_bid || !b->tx_bid) {
+        return -1;
+    }
+#endif
+
+    for (int k = 0; k < size; k++) {
+        b->rx_iov[k].iov_base = BATCH_BUF(b, k);
+        b->rx[k].msg_hdr.msg_iov = &b->rx_iov[k];
+        b->rx[k].msg_hdr.msg_iovlen = 1;
+    }
+
+    for (int k = 0; k < b->tx_size; k++) {
+        b->tx[k].msg_hdr.msg_iov = &b->tx_iov[k];
+        b->tx[k].msg_hdr.msg_iovlen = 1;
+    }
+
+    return 0;
+}
+
+static void um_batch_free(struct um_batch *b)
+{
+    free(b->bufs);
+    free(b->addr);
+    free(b->rx_iov);
+    free(b->rx);
+    free(b->tx_iov);
+    free(b->tx);
+    free(b->tx_sock);
+    free(b->tx_flow);
+#ifdef UM_HAVE_GSO
+    free(b->rx_ctl);
+    free(b->gso);
+    free(b->gso_ctl);
+    free(b->gso_first);
+#endif
+#ifdef UM_HAVE_URING
+    free(b->rx_bid);
+    free(b->tx_bid);
+#endif
+}
+
+// Receive up to b->size datagrams from sock. Returns the number received,
+// 0 if the socket would block and -1 on error.
+static int um_batch_recv(int sock, struct um_batch *b, int want_addr)
+{
+    int n = mmsg_batch < b->size ? mmsg_batch : b->size;
+
+    for (int k = 0; k < n; k++) {
+        b->rx_iov[k].iov_len = UM_BUFFER;
+        b->rx[k].msg_hdr.msg_name = want_addr ? &b->addr[k] : NULL;
+        b->rx[k].msg_hdr.msg_namelen = want_addr ? sizeof(b->addr[k]) : 0;
+#ifdef UM_HAVE_GSO
+        if (use_gso) {
+            b->rx[k].msg_hdr.msg_control = &b->rx_ctl[k];
+            b->rx[k].msg_hdr.msg_controllen = sizeof(b->rx_ctl[k]);
+        }
+#endif
+    }
+
+    for (;;) {
+        int ret;
+
+#ifdef UM_HAVE_MMSG
+        if (n > 1) {
+            ret = recvmmsg(sock, b->rx, n, 0, NULL);
+            if (ret < 0 && errno == ENOSYS) {
+                log_warn("recvmmsg() not supported, using recvmsg()");
+                mmsg_batch = n = 1;
+                continue;
+            }
+        } else
+#endif
+        {
+            ssize_t len = recvmsg(sock, &b->rx[0].msg_hdr, 0);
+            if (len >= 0) {
+                b->rx[0].msg_len = (unsigned int) len;
+            }
+            ret = len < 0 ? -1 : 1;
+        }
+
+        if (ret < 0) {
+            if (would_block()) {
+                return 0;
+            }
+            if (errno == EINTR) {
+                continue;
+            }
+            log_warn("recvmsg(): %s", strerror(errno));
+            return -1;
+        }
+
+        return ret;
+    }
+}
+
+// Queue an outgoing datagram at tx slot k, to is NULL on connected sockets
+static inline void um_batch_tx(struct um_batch *b, int k, int sock,
+                               unsigned char *buf, size_t buflen,
+                               union um_sockaddr *to)
+{
+    b->tx_iov[k].iov_base = buf;
+    b->tx_iov[k].iov_len = buflen;
+    b->tx[k].msg_hdr.msg_name = to;
+    b->tx[k].msg_hdr.msg_namelen = to ? um_sockaddr_len(to) : 0;
+    b->tx_sock[k] = sock;
+}
+
+// Segment size of a UDP_GRO coalesced datagram at rx slot k, 0 if the
+// datagram was not coalesced
+static inline size_t um_batch_gro_size(struct um_batch *b, int k)
+{
+#ifdef UM_HAVE_GSO
+    struct msghdr *msg = &b->rx[k].msg_hdr;
+    struct cmsghdr *cmsg;
+
+    if (!use_gso) {
+        return 0;
+    }
+
+    for (cmsg = CMSG_FIRSTHDR(msg); cmsg; cmsg = CMSG_NXTHDR(msg, cmsg)) {
+        if (cmsg->cmsg_level == SOL_UDP && cmsg->cmsg_type == UDP_GRO) {
+            int size;
+            memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+            return size > 0 ? (size_t) size : 0;
+        }
+    }
+#endif
+
+    return 0;
+}
+
+// Body of um_batch_transform(), instantiated once per op so that each
+// gets its transform inlined, and passthrough none at all
+static UM_ALWAYS_INLINE int
+um_batch_transform_op(struct um_batch *b, int k, enum um_transform_op op,
+                      struct um_transform *ctx, int sock, int flow,
+                      union um_sockaddr *to, int *tx_n,
+                      struct um_dir_stats *st)
+{
+    const int delta = TRANSFORM_DELTA(op);
+    unsigned char *buf = b->rx_iov[k].iov_base;
+    size_t len = b->rx[k].msg_len;
+    size_t seg = um_batch_gro_size(b, k);
+    size_t nseg, out_seg, seg_len;
+    int queued = 0;
+
+    if (seg == 0 || seg >= len) {
+        seg = len;
+    }
+
+    nseg = (len + seg - 1) / seg;
+    st->rx_pkts += nseg;
+    st->rx_bytes += len;
+
+    if (nseg > UM_GSO_MAX_SEGS || *tx_n + (int) nseg > b->tx_size) {
+        log_debug("Dropping datagram of %zu segments", nseg);
+        st->drop_transform += nseg;
+        return 0;
+    }
+
+    // Spread segments out back to front, so that each can grow in place
+    out_seg = seg;
+    if (delta > 0 && nseg > 1) {
+        out_seg = seg + delta;
+        for (size_t j = nseg - 1; j > 0; j--) {
+            seg_len = j == nseg - 1 ? len - j * seg : seg;
+            memmove(buf + j * out_seg, buf + j * seg, seg_len);
+        }
+    }
+
+    for (size_t j = 0; j < nseg; j++) {
+        unsigned char *p = buf + j * out_seg;
+
+        seg_len = j == nseg - 1 ? len - j * seg : seg;
+        seg_len = transform_op(op, ctx, p, seg_len);
+
+        if (seg_len > 0) {
+#ifdef UM_HAVE_URING
+            b->tx_bid[*tx_n] = b->rx_bid[k];
+#endif
+            b->tx_flow[*tx_n] = flow;
+            um_batch_tx(b, (*tx_n)++, sock, p, seg_len, to);
+            queued++;
+        } else {
+            st->drop_transform++;
+        }
+    }
+
+    return queued;
+}
+
+static inline void um_batch_sent(struct um_dir_stats *st,
+                                 const struct msghdr *msg)
+{
+    st->tx_pkts += msg->msg_iovlen;
+    for (size_t j = 0; j < msg->msg_iovlen; j++) {
+        st->tx_bytes += msg->msg_iov[j].iov_len;
+    }
+}
+
+// Send msgs [0, n) on sock. Returns how many were dealt with before the
+// socket filled up, n unless it did.
+static int um_batch_send(int sock, struct mmsghdr *msgs, int n,
+                         struct um_dir_stats *st)
+{
+    int sent = 0;
+
+    while (sent < n) {
+        int ret;
+
+#ifdef UM_HAVE_MMSG
+        if (mmsg_batch > 1 && n - sent > 1) {
+            ret = sendmmsg(sock, msgs + sent, n - sent, 0);
+        } else
+#endif
+        {
+            ret = sendmsg(sock, &msgs[sent].msg_hdr, 0) < 0 ? -1 : 1;
+        }
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (would_block()) {
+                break;
+            }
+            // Skip the datagram that failed, like a plain sendto() would
+            st->drop_send++;
+            sent++;
+            continue;
+        }
+
+        for (int j = sent; j < sent + ret; j++) {
+            um_batch_sent(st, &msgs[j].msg_hdr);
+        }
+
+        sent += ret;
+    }
+
+    return sent;
+}
+
+#ifdef UM_HAVE_GSO
+
+// Send tx slots [first, first + n) on sock, coalescing each run of same
+// sized datagrams to the same peer into one UDP_SEGMENT send. The last
+// datagram of a run may be shorter. Returns like um_batch_send(), in tx
+// slots.
+static int um_batch_send_gso(struct um_batch *b, int sock, int first, int n,
+                             struct um_dir_stats *st)
+{
+    int end = first + n;
+    int g = 0;
+    int sent = 0;
+
+    for (int k = first; k < end; ) {
+        struct msghdr *msg = &b->gso[g].msg_hdr;
+        size_t seg = b->tx_iov[k].iov_len;
+        size_t total = seg;
+        int cnt = 1;
+
+        while (k + cnt < end && cnt < UM_GSO_MAX_SEGS &&
+               b->tx[k + cnt].msg_hdr.msg_name == b->tx[k].msg_hdr.msg_name &&
+               b->tx_iov[k + cnt].iov_len <= seg &&
+               total + b->tx_iov[k + cnt].iov_len <= UM_BUFFER) {
+            total += b->tx_iov[k + cnt].iov_len;
+            if (b->tx_iov[k + cnt++].iov_len < seg) {
+                break;
+            }
+        }
+
+        *msg = b->tx[k].msg_hdr;
+        msg->msg_iovlen = cnt;
+
+        if (cnt > 1) {
+            uint16_t gso_size = (uint16_t) seg;
+            struct cmsghdr *cmsg;
+
+            msg->msg_control = &b->gso_ctl[g];
+            msg->msg_controllen = CMSG_SPACE(sizeof(gso_size));
+
+            cmsg = CMSG_FIRSTHDR(msg);
+            cmsg->cmsg_level = SOL_UDP;
+            cmsg->cmsg_type = UDP_SEGMENT;
+            cmsg->cmsg_len = CMSG_LEN(sizeof(gso_size));
+            memcpy(CMSG_DATA(cmsg), &gso_size, sizeof(gso_size));
+        }
+
+        b->gso_first[g++] = k;
+        k += cnt;
+    }
+
+    while (sent < g) {
+        int ret;
+
+        if (mmsg_batch > 1 && g - sent > 1) {
+            ret = sendmmsg(sock, b->gso + sent, g - sent, 0);
+        } else {
+            ret = sendmsg(sock, &b->gso[sent].msg_hdr, 0) < 0 ? -1 : 1;
+        }
+
+        if (ret < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            if (would_block()) {
+                return b->gso_first[sent] - first;
+            }
+            // Segments may not fit the path MTU once masked, send them
+            // one by one and let the kernel fragment
+            if (b->gso[sent].msg_hdr.msg_iovlen > 1) {
+                int cnt = (int) b->gso[sent].msg_hdr.msg_iovlen;
+
+                log_debug("UDP_SEGMENT send: %s", strerror(errno));
+                ret = um_batch_send(sock, b->tx + b->gso_first[sent], cnt,
+                                    st);
+                if (ret < cnt) {
+                    return b->gso_first[sent] + ret - first;
+                }
+            } else {
+                st->drop_send++;
+            }
+            sent++;
+            continue;
+        }
+
+        for (int j = sent; j < sent + ret; j++) {
+            um_batch_sent(st, &b->gso[j].msg_hdr);
+        }
+
+        sent += ret;
+    }
+
+    return n;
+}
+
+#endif /* UM_HAVE_GSO */
+
+// The queue of datagrams waiting for sock, which tx slots of map entry flow
+// are sent on
+static inline struct um_txq *um_txq_of(int sock, int flow)
+{
+    struct um_sockmap *e = &map.ent[flow];
+    struct um_tunnel *tn = &tunnels[e->tunnel];
+
+    if (sock == tn->bind_sock) {
+        return &tn->bind_txq;
+    }
+
+    return sock == e->sock ? &e->txq : &e->reply_txq;
+}
+
+// Copy tx slots [first, end) to the back of q, and watch its socket for
+// room while it holds anything. Each flow may have up to txq_max datagrams
+// waiting per direction, a listening socket's queue is shared by all of
+// its tunnel's.
+// Whatever is over that, or the pool has no room for, is lost.
+static void um_txq_defer(struct um_batch *b, struct um_txq *q, int first,
+                         int end)
+{
+    struct um_dir_stats *st = &stats.dir[q->dir];
+    int was_empty = q->n == 0;
+
+    for (int k = first; k < end; k++) {
+        struct msghdr *msg = &b->tx[k].msg_hdr;
+        struct um_flow_stats *fst = &map.ent[b->tx_flow[k]].stats;
+        size_t len = b->tx_iov[k].iov_len;
+        struct um_pkt *pkt;
+
+        if (fst->queued[q->dir] >= (uint32_t) txq_max) {
+            st->drop_queue++;
+            fst->drop_queue++;
+            continue;
+        }
+
+        pkt = um_pool_get(&pool, len);
+        if (!pkt) {
+            st->drop_eagain += end - k;
+            for (; k < end; k++) {
+                map.ent[b->tx_flow[k]].stats.drop_queue++;
+            }
+            break;
+        }
+
+        memcpy(pkt->data, b->tx_iov[k].iov_base, len);
+        pkt->len = (uint32_t) len;
+        pkt->flow = b->tx_flow[k];
+        if (msg->msg_name) {
+            memcpy(&pkt->to, msg->msg_name, sizeof(pkt->to));
+            pkt->has_to = 1;
+        }
+
+        um_txq_push(q, pkt);
+        fst->queued[q->dir]++;
+        st->queued++;
+    }
+
+    if (was_empty && q->n > 0) {
+        um_event_want_write(q->sock, q->idx, 1);
+    }
+}
+
+// Send what q holds, oldest first, until the socket fills up again.
+// Returns the number of datagrams still queued.
+static int um_txq_send(struct um_txq *q)
+{
+    struct um_dir_stats *st = &stats.dir[q->dir];
+    struct mmsghdr msgs[UM_MMSG_MAX];
+    struct iovec iov[UM_MMSG_MAX];
+
+    if (q->n == 0) {
+        return 0;
+    }
+
+    while (q->n > 0) {
+        struct um_pkt *pkt = q->head;
+        int n, sent;
+
+        for (n = 0; pkt && n < UM_MMSG_MAX; pkt = pkt->next, n++) {
+            iov[n].iov_base = pkt->data;
+            iov[n].iov_len = pkt->len;
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            if (pkt->has_to) {
+                msgs[n].msg_hdr.msg_name = &pkt->to;
+                msgs[n].msg_hdr.msg_namelen = um_sockaddr_len(&pkt->to);
+            }
+        }
+
+        sent = um_batch_send(q->sock, msgs, n, st);
+        for (int j = 0; j < sent; j++) {
+            pkt = um_txq_pop(q);
+            if (pkt->flow >= 0) {
+                map.ent[pkt->flow].stats.queued[q->dir]--;
+            }
+            st->queued--;
+            um_pool_put(&pool, pkt);
+        }
+
+        if (sent < n) {
+            return q->n;
+        }
+    }
+
+    um_event_want_write(q->sock, q->idx, 0);
+    return 0;
+}
+
+#ifdef UM_HAVE_URING
+
+// Queue one send per tx slot [0, n), they go out with the next submit. The
+// buffer each was received into is held until its sends complete.
+static void um_uring_flush(struct um_batch *b, int n, struct um_dir_stats *st)
+{
+    uint64_t dir = (uint64_t) (st - stats.dir);
+
+    for (int k = 0; k < n; k++) {
+        struct io_uring_sqe *sqe;
+        struct um_uring_tx *tx;
+        unsigned int slot;
+
+        sqe = um_uring_sqe(&uring, &slot);
+        if (!sqe) {
+            st->drop_send += n - k;
+            return;
+        }
+
+        tx = &uring_tx[slot];
+        tx->iov = b->tx_iov[k];
+        memset(&tx->msg, 0, sizeof(tx->msg));
+        if (b->tx[k].msg_hdr.msg_name) {
+            memcpy(&tx->to, b->tx[k].msg_hdr.msg_name, sizeof(tx->to));
+            tx->msg.msg_name = &tx->to;
+            tx->msg.msg_namelen = um_sockaddr_len(&tx->to);
+        }
+        tx->msg.msg_iov = &tx->iov;
+        tx->msg.msg_iovlen = 1;
+
+        um_uring_prep_sendmsg(sqe, b->tx_sock[k], &tx->msg);
+        sqe->user_data = (UD_SEND << 62) | (dir << 16) | b->tx_bid[k];
+        uring_refs[b->tx_bid[k]]++;
+    }
+}
+
+#endif /* UM_HAVE_URING */
+
+#ifdef UM_HAVE_PIPELINE
+
+// Copy the datagram at rx slot k into pool packets, one per GRO segment,
+// and hand them to the transform thread. Returns the number handed over.
+static int um_pipe_rx(struct um_batch *b, int k, enum um_transform_op op,
+                      struct um_transform *ctx, int sock, int flow,
+                      union um_sockaddr *to, struct um_dir_stats *st)
+{
+    unsigned char *buf = b->rx_iov[k].iov_base;
+    size_t len = b->rx[k].msg_len;
+    size_t seg = um_batch_gro_size(b, k);
+    int queued = 0;
+
+    if (seg == 0 || seg >= len) {
+        seg = len;
+    }
+
+    um_pipe_reclaim();
+
+    st->rx_bytes += len;
+
+    for (size_t off = 0; off < len; off += seg) {
+        size_t seg_len = len - off < seg ? len - off : seg;
+        struct um_pkt *pkt = um_pool_get(&pool, seg_len + MASK_LEN);
+
+        st->rx_pkts++;
+
+        // The threads are behind, leave the backlog to the socket's
+        // receive queue instead of dropping. Sleep until they give some
+        // back, unless all they have is held back for full sockets.
+        while (!pkt && !signal_term &&
+               pipe_inflight > __atomic_load_n(&pipe_held, __ATOMIC_RELAXED)) {
+            um_bell_ring(&bell_xf);
+            um_bell_wait(&bell_ret, &pipe_ret, &pipe_stop);
+            um_pipe_reclaim();
+            pkt = um_pool_get(&pool, seg_len + MASK_LEN);
+        }
+
+        if (!pkt) {
+            st->drop_eagain++;
+            continue;
+        }
+
+        memcpy(pkt->data, buf + off, seg_len);
+        pkt->len = (uint32_t) seg_len;
+        pkt->op = (uint8_t) op;
+        pkt->ctx = ctx;
+        pkt->dir = (uint8_t) (st - stats.dir);
+        pkt->flow = flow;
+        pkt->sock = sock;
+        if (to) {
+            memcpy(&pkt->to, to, sizeof(pkt->to));
+            pkt->has_to = 1;
+        }
+
+        // The ring has room for the whole pool
+        um_spsc_push(&pipe_xf, pkt);
+        pipe_inflight++;
+        queued++;
+    }
+
+    return queued;
+}
+
+static void *um_pipe_xf_main(void *arg)
+{
+    struct um_pkt *pkt;
+    int unrung = 0;
+
+    while (!__atomic_load_n(&pipe_stop, __ATOMIC_RELAXED)) {
+        pkt = um_spsc_pop(&pipe_xf);
+        if (!pkt) {
+            if (unrung) {
+                um_bell_ring(&bell_tx);
+                unrung = 0;
+            }
+            um_bell_wait(&bell_xf, &pipe_xf, &pipe_stop);
+            continue;
+        }
+
+        // A length of 0 tells the send thread to drop it
+        if (pkt != &pipe_mark) {
+            pkt->len = (uint32_t) transform_op(pkt->op, pkt->ctx, pkt->data,
+                                               pkt->len);
+        }
+        um_spsc_push(&pipe_tx, pkt);
+
+        if (++unrung == UM_MMSG_BATCH) {
+            um_bell_ring(&bell_tx);
+            unrung = 0;
+        }
+    }
+
+    return NULL;
+}
+
+// Queues of the send thread, of sockets that were full
+static struct um_txq pipe_defer[UM_PIPE_DEFER_SOCKS];
+static int pipe_defer_n;
+
+static inline void um_pipe_give_back(struct um_pkt *pkt)
+{
+    // The ring has room for the whole pool
+    um_spsc_push(&pipe_ret, pkt);
+}
+
+// pkt, held back, is on its way out of its queue
+static inline void um_pipe_unhold(struct um_pkt *pkt, struct um_dir_stats *st)
+{
+    st[pkt->dir].queued--;
+    if (pkt->flow >= 0) {
+        pipe_flow_held[pkt->flow]--;
+    }
+}
+
+static struct um_txq *um_pipe_defer_of(int sock)
+{
+    for (int i = 0; i < pipe_defer_n; i++) {
+        if (pipe_defer[i].sock == sock) {
+            return &pipe_defer[i];
+        }
+    }
+
+    return NULL;
+}
+
+// Hold back pkts [0, n) for sock, after what it already has waiting.
+// What is over the limits is dropped.
+static void um_pipe_defer(int sock, struct um_pkt **pkts, int n,
+                          struct um_dir_stats *st)
+{
+    struct um_txq *q = um_pipe_defer_of(sock);
+    unsigned int held = __atomic_load_n(&pipe_held, __ATOMIC_RELAXED);
+
+    if (!q && pipe_defer_n < UM_PIPE_DEFER_SOCKS) {
+        q = &pipe_defer[pipe_defer_n++];
+        um_txq_init(q, sock, -1, pkts[0]->dir);
+    }
+
+    for (int k = 0; k < n; k++) {
+        struct um_dir_stats *s = &st[pkts[k]->dir];
+        int flow = pkts[k]->flow;
+
+        if (!q || held >= UM_PIPE_DEFER_MAX) {
+            s->drop_eagain++;
+            um_pipe_give_back(pkts[k]);
+        } else if ((flow >= 0 ? pipe_flow_held[flow] : q->n) >= txq_max) {
+            s->drop_queue++;
+            um_pipe_give_back(pkts[k]);
+        } else {
+            um_txq_push(q, pkts[k]);
+            s->queued++;
+            if (flow >= 0) {
+                pipe_flow_held[flow]++;
+            }
+            held++;
+        }
+    }
+
+    __atomic_store_n(&pipe_held, held, __ATOMIC_RELAXED);
+}
+
+// Send what the full sockets hold back, as far as they take it now
+static void um_pipe_send_deferred(struct um_dir_stats *st)
+{
+    struct mmsghdr msgs[UM_MMSG_MAX];
+    struct iovec iov[UM_MMSG_MAX];
+    unsigned int held = __atomic_load_n(&pipe_held, __ATOMIC_RELAXED);
+
+    for (int i = 0; i < pipe_defer_n; ) {
+        struct um_txq *q = &pipe_defer[i];
+        struct um_pkt *pkt = q->head;
+        int n = 0, sent;
+
+        for (; pkt && n < UM_MMSG_MAX; pkt = pkt->next, n++) {
+            iov[n].iov_base = pkt->data;
+            iov[n].iov_len = pkt->len;
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            if (pkt->has_to) {
+                msgs[n].msg_hdr.msg_name = &pkt->to;
+                msgs[n].msg_hdr.msg_namelen = um_sockaddr_len(&pkt->to);
+            }
+        }
+
+        sent = um_batch_send(q->sock, msgs, n, &st[q->dir]);
+        for (int k = 0; k < sent; k++) {
+            pkt = um_txq_pop(q);
+            um_pipe_unhold(pkt, st);
+            held--;
+            um_pipe_give_back(pkt);
+        }
+
+        if (q->n == 0) {
+            pipe_defer[i] = pipe_defer[--pipe_defer_n];
+        } else {
+            i++;
+        }
+    }
+
+    __atomic_store_n(&pipe_held, held, __ATOMIC_RELAXED);
+}
+
+// Give back, unsent, what is held back for sock, or for every socket if
+// sock is -1. What flow left on other sockets' queues is no one's now.
+static void um_pipe_drop_deferred(int sock, int flow, struct um_dir_stats *st)
+{
+    unsigned int held = __atomic_load_n(&pipe_held, __ATOMIC_RELAXED);
+    struct um_pkt *pkt;
+
+    for (int i = 0; i < pipe_defer_n; ) {
+        struct um_txq *q = &pipe_defer[i];
+
+        if (sock >= 0 && q->sock != sock) {
+            for (pkt = q->head; flow >= 0 && pkt; pkt = pkt->next) {
+                if (pkt->flow == flow) {
+                    pipe_flow_held[flow]--;
+                    pkt->flow = -1;
+                }
+            }
+            i++;
+            continue;
+        }
+
+        while ((pkt = um_txq_pop(q))) {
+            um_pipe_unhold(pkt, st);
+            st[pkt->dir].drop_eagain++;
+            held--;
+            um_pipe_give_back(pkt);
+        }
+        pipe_defer[i] = pipe_defer[--pipe_defer_n];
+    }
+
+    __atomic_store_n(&pipe_held, held, __ATOMIC_RELAXED);
+}
+
+// Wait up to a millisecond for a full socket to take more, new packets
+// from the transform thread are looked at in between
+static void um_pipe_wait_deferred(void)
+{
+    struct pollfd pfd[UM_PIPE_DEFER_SOCKS];
+
+    for (int i = 0; i < pipe_defer_n; i++) {
+        pfd[i].fd = pipe_defer[i].sock;
+        pfd[i].events = POLLOUT;
+    }
+
+    poll(pfd, pipe_defer_n, 1);
+}
+
+// Sent and dropped datagrams are counted in st, and published after
+// every batch. A socket with datagrams held back gets the new ones
+// queued behind them, so each socket's datagrams stay in order. The
+// loop's mark ends a batch, everything before it is dealt with first.
+static void *um_pipe_tx_main(void *arg)
+{
+    struct um_dir_stats st[UM_DIR_N];
+    struct mmsghdr msgs[UM_MMSG_MAX];
+    struct iovec iov[UM_MMSG_MAX];
+    struct um_pkt *pkts[UM_MMSG_MAX];
+    struct um_pkt *pkt;
+
+    memset(st, 0, sizeof(st));
+    pipe_defer_n = 0;
+
+    while (!__atomic_load_n(&pipe_stop, __ATOMIC_RELAXED)) {
+        struct um_pkt *mark = NULL;
+        int n = 0;
+        int start = 0;
+
+        if (pipe_defer_n > 0) {
+            um_pipe_send_deferred(st);
+        }
+
+        while (n < mmsg_batch && (pkt = um_spsc_pop(&pipe_tx))) {
+            if (pkt == &pipe_mark) {
+                mark = pkt;
+                break;
+            }
+            if (pkt->len == 0) {
+                st[pkt->dir].drop_transform++;
+                um_pipe_give_back(pkt);
+                continue;
+            }
+
+            iov[n].iov_base = pkt->data;
+            iov[n].iov_len = pkt->len;
+            memset(&msgs[n], 0, sizeof(msgs[n]));
+            msgs[n].msg_hdr.msg_iov = &iov[n];
+            msgs[n].msg_hdr.msg_iovlen = 1;
+            if (pkt->has_to) {
+                msgs[n].msg_hdr.msg_name = &pkt->to;
+                msgs[n].msg_hdr.msg_namelen = um_sockaddr_len(&pkt->to);
+            }
+            pkts[n++] = pkt;
+        }
+
+        if (n == 0 && !mark) {
+            um_bell_ring(&bell_ret);
+            um_pipe_publish(st);
+            if (pipe_defer_n > 0) {
+                um_pipe_wait_deferred();
+            } else {
+                um_bell_wait(&bell_tx, &pipe_tx, &pipe_stop);
+            }
+            continue;
+        }
+
+        for (int k = 1; k <= n; k++) {
+            if (k == n || pkts[k]->sock != pkts[start]->sock) {
+                int sock = pkts[start]->sock;
+                int sent = 0;
+
+                if (!um_pipe_defer_of(sock)) {
+                    sent = um_batch_send(sock, msgs + start, k - start,
+                                         &st[pkts[start]->dir]);
+                }
+                for (int j = start; j < start + sent; j++) {
+                    um_pipe_give_back(pkts[j]);
+                }
+                if (start + sent < k) {
+                    um_pipe_defer(sock, pkts + start + sent,
+                                  k - start - sent, st);
+                }
+                start = k;
+            }
+        }
+
+        if (mark) {
+            um_pipe_drop_deferred(mark->sock, mark->flow, st);
+            um_pipe_give_back(mark);
+        }
+
+        um_bell_ring(&bell_ret);
+        um_pipe_publish(st);
+    }
+
+    um_pipe_drop_deferred(-1, -1, st);
+    um_pipe_publish(st);
+
+    return NULL;
+}
+
+static void um_pipe_free(void)
+{
+    um_spsc_free(&pipe_xf);
+    um_spsc_free(&pipe_tx);
+    um_spsc_free(&pipe_ret);
+    free(pipe_flow_held);
+    pipe_flow_held = NULL;
+}
+
+// Start the transform and send threads. The tunnels' masks are read from
+// the transform thread from here on.
+static int um_pipe_start(void)
+{
+    sigset_t all, old;
+    int err;
+
+    pipe_flow_held = calloc(max_client, sizeof(*pipe_flow_held));
+    if (!pipe_flow_held ||
+        um_spsc_init(&pipe_xf, UM_PIPE_RING) < 0 ||
+        um_spsc_init(&pipe_tx, UM_PIPE_RING) < 0 ||
+        um_spsc_init(&pipe_ret, UM_PIPE_RING) < 0) {
+        um_pipe_free();
+        return -1;
+    }
+
+    if (um_bell_init(&bell_xf) < 0) {
+        um_pipe_free();
+        return -1;
+    }
+    if (um_bell_init(&bell_tx) < 0) {
+        um_bell_destroy(&bell_xf);
+        um_pipe_free();
+        return -1;
+    }
+    if (um_bell_init(&bell_ret) < 0) {
+        um_bell_destroy(&bell_xf);
+        um_bell_destroy(&bell_tx);
+        um_pipe_free();
+        return -1;
+    }
+
+    pipe_stop = 0;
+    pipe_inflight = 0;
+    pipe_held = 0;
+    memset(pipe_st, 0, sizeof(pipe_st));
+
+    // Signals are for the event loop
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+
+    err = pthread_create(&pipe_thr[0], NULL, &um_pipe_xf_main, NULL);
+    if (err == 0) {
+        err = pthread_create(&pipe_thr[1], NULL, &um_pipe_tx_main, NULL);
+        if (err != 0) {
+            __atomic_store_n(&pipe_stop, 1, __ATOMIC_RELAXED);
+            um_bell_wake(&bell_xf);
+            pthread_join(pipe_thr[0], NULL);
+        }
+    }
+
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (err != 0) {
+        um_bell_destroy(&bell_xf);
+        um_bell_destroy(&bell_tx);
+        um_bell_destroy(&bell_ret);
+        um_pipe_free();
+        errno = err;
+        return -1;
+    }
+
+    return 0;
+}
+
+static void um_pipe_stop(void)
+{
+    __atomic_store_n(&pipe_stop, 1, __ATOMIC_RELAXED);
+    um_bell_wake(&bell_xf);
+    um_bell_wake(&bell_tx);
+
+    pthread_join(pipe_thr[0], NULL);
+    pthread_join(pipe_thr[1], NULL);
+    um_pipe_reclaim();
+
+    um_bell_destroy(&bell_xf);
+    um_bell_destroy(&bell_tx);
+    um_bell_destroy(&bell_ret);
+    um_pipe_free();
+}
+
+#endif /* UM_HAVE_PIPELINE */
+
+// Transform the datagram at rx slot k with op under ctx and queue the
+// result at tx slots from *tx_n on, on behalf of map entry flow. A GRO
+// coalesced datagram is split into its segments first. Returns the number
+// of datagrams queued.
+static inline int um_batch_transform(struct um_batch *b, int k,
+                                     enum um_transform_op op,
+                                     struct um_transform *ctx, int sock,
+                                     int flow, union um_sockaddr *to,
+                                     int *tx_n, struct um_dir_stats *st)
+{
+#ifdef UM_HAVE_PIPELINE
+    if (use_pipeline) {
+        return um_pipe_rx(b, k, op, ctx, sock, flow, to, st);
+    }
+#endif
+
+    // op is fixed per tunnel, the branch predicts well while one is busy
+    switch (op) {
+    case UM_OP_MASK:
+        return um_batch_transform_op(b, k, UM_OP_MASK, ctx, sock, flow,
+                                     to, tx_n, st);
+    case UM_OP_UNMASK:
+        return um_batch_transform_op(b, k, UM_OP_UNMASK, ctx, sock, flow,
+                                     to, tx_n, st);
+    default:
+        return um_batch_transform_op(b, k, UM_OP_NOOP, ctx, sock, flow,
+                                     to, tx_n, st);
+    }
+}
+
+// Flush tx slots [0, n), one send call per run of datagrams on the same
+// socket. What a full socket doesn't take waits in its tx queue, and a
+// socket with datagrams waiting already gets the rest queued behind them.
+static void um_batch_flush(struct um_batch *b, int n,
+                           struct um_dir_stats *st)
+{
+    int start = 0;
+
+#ifdef UM_HAVE_PIPELINE
+    if (use_pipeline) {
+        um_bell_ring(&bell_xf);
+        return;
+    }
+#endif
+
+#ifdef UM_HAVE_URING
+    if (use_uring) {
+        um_uring_flush(b, n, st);
+        return;
+    }
+#endif
+
+    for (int k = 1; k <= n; k++) {
+        if (k == n || b->tx_sock[k] != b->tx_sock[start]) {
+            int sock = b->tx_sock[start];
+            struct um_txq *q = um_txq_of(sock, b->tx_flow[start]);
+            int sent = 0;
+
+            if (um_txq_send(q) == 0) {
+#ifdef UM_HAVE_GSO
+                if (use_gso) {
+                    sent = um_batch_send_gso(b, sock, start, k - start, st);
+                } else
+#endif
+                {
+                    sent = um_batch_send(sock, b->tx + start, k - start, st);
+                }
+            }
+
+            if (start + sent < k) {
+                um_txq_defer(b, q, start + sent, k);
+            }
+            start = k;
+        }
+    }
+}
+
+/////////////////////////////////////////////////////////////////////
+
+static void sighanlder(int signum)
+{
+    if (signum == SIGHUP || signum == SIGINT || signum == SIGTERM) {
+        signal_term = 1;
+    } else if (signum == SIGUSR1) {
+        signal_dump = 1;
+    }
+}
+
+// Like signal(), but without SA_RESTART so blocking calls see EINTR
+static void set_signal(int signum, void (*handler)(int))
+{
+    struct sigaction sa;
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = handler;
+    sigemptyset(&sa.sa_mask);
+    sigaction(signum, &sa, NULL);
+}
+
+/////////////////////////////////////////////////////////////////////
+// Forwarding
+/////////////////////////////////////////////////////////////////////
+
+static time_t time_last_clean = 0;
+
+static struct um_resolver resolver = {
+    .sock = -1,
+    .pid = -1,
+};
+
+static void set_conn_addr(struct um_tunnel *tn, const union um_sockaddr *addr)
+{
+    tn->conn_addr = *addr;
+    um_sockaddr_set_port(&tn->conn_addr, tn->conf.port_conn);
+    um_flow_key_of(&tn->conn_key, &tn->conn_addr);
+}
+
+// Refresh the remote address of tunnel t once it is missing (at most once
+// per second) or older than UM_HOST_TIMEOUT. The lookup runs in the
+// resolver process, packets keep going to the last known address until the
+// reply comes back.
+static void update_conn_addr(int t, time_t time_val)
+{
+    struct um_tunnel *tn = &tunnels[t];
+    int conn_addr_missing = tn->conn_key.family == 0;
+    union um_sockaddr addr;
+    int conn_addr_expired =
+        !conn_addr_missing &&
+        time_val - tn->time_conn_addr >= UM_HOST_TIMEOUT;
+
+    if (!(conn_addr_missing && time_val != tn->time_conn_addr) &&
+        !conn_addr_expired) {
+        return;
+    }
+
+    // A lookup that hangs gets another try after UM_HOST_TIMEOUT
+    if (tn->resolve_inflight &&
+        time_val - tn->time_conn_addr < UM_HOST_TIMEOUT) {
+        return;
+    }
+
+    tn->time_conn_addr = time_val;
+
+    if (resolver.sock >= 0) {
+        if (resolver_request(&resolver, (uint32_t) t,
+                             tn->conn_addr.sa.sa_family,
+                             tn->conf.host) == 0) {
+            tn->resolve_inflight = 1;
+        } else {
+            log_warn("Failed to queue lookup: %s", strerror(errno));
+        }
+    } else if (resolver_lookup(tn->conf.host, tn->conn_addr.sa.sa_family,
+                               &addr) < 0) {
+        log_warn("Failed to resolve [%s]", tn->conf.host);
+    } else {
+        set_conn_addr(tn, &addr);
+    }
+}
+
+static void handle_resolver(time_t time_val)
+{
+    struct um_resolve_rep rep;
+    struct um_flow_key key;
+    char addr[UM_ADDR_STRLEN];
+    int r;
+
+    // Replies are tagged with the tunnel
+    while ((r = resolver_reply(&resolver, &rep)) > 0) {
+        if (rep.tag >= (uint32_t) n_tunnels) {
+            continue;
+        }
+
+        struct um_tunnel *tn = &tunnels[rep.tag];
+
+        tn->resolve_inflight = 0;
+
+        if (!rep.ok) {
+            log_warn("Failed to resolve [%s]", tn->conf.host);
+            continue;
+        }
+
+        um_sockaddr_set_port(&rep.addr, tn->conf.port_conn);
+        um_flow_key_of(&key, &rep.addr);
+        if (!um_flow_key_eq(&key, &tn->conn_key)) {
+            log_info("Remote address [%s] resolved to [%s]", tn->conf.host,
+                     um_sockaddr_str(&rep.addr, addr, sizeof(addr)));
+        }
+
+        set_conn_addr(tn, &rep.addr);
+        tn->time_conn_addr = time_val;
+    }
+
+    if (r < 0) {
+        // Fall back to blocking lookups
+        log_err("Resolver process exited");
+        um_event_del(resolver.sock, UM_EVENT_RESOLVER);
+        resolver_stop(&resolver);
+        for (int t = 0; t < n_tunnels; t++) {
+            tunnels[t].resolve_inflight = 0;
+        }
+    }
+}
+
+#define UM_STATS_REPLY      65536
+
+// The counters as they stand, the send thread's included
+static const struct um_stats *stats_now(void)
+{
+#ifdef UM_HAVE_PIPELINE
+    static struct um_stats sum;
+
+    sum = stats;
+    um_pipe_add_stats(&sum);
+
+    return &sum;
+#else
+    return &stats;
+#endif
+}
+
+// Answer every query on the stats socket with the counters, and the flow
+// table too if the query starts with "flows"
+static void handle_stats(time_t time_val)
+{
+    static char reply[UM_STATS_REPLY];
+    struct sockaddr_un from;
+    socklen_t from_len;
+    char req[16];
+    ssize_t len;
+    size_t n;
+
+    for (;;) {
+        from_len = sizeof(from);
+        len = recvfrom(stats_sock, req, sizeof(req), 0,
+                       (struct sockaddr *) &from, &from_len);
+        if (len < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+
+        // An unbound sender can't be answered
+        if (from_len <= sizeof(sa_family_t)) {
+            continue;
+        }
+
+        n = um_stats_format(reply, sizeof(reply), stats_now(), &map, time_val,
+                            len >= 5 && memcmp(req, "flows", 5) == 0);
+        sendto(stats_sock, reply, n, 0, (struct sockaddr *) &from, from_len);
+    }
+}
+
+// Write the counters to the log on SIGUSR1
+static void dump_stats(time_t time_val)
+{
+    static char reply[UM_STATS_REPLY];
+    char *line, *save;
+
+    signal_dump = 0;
+
+    um_stats_format(reply, sizeof(reply), stats_now(), &map, time_val, 0);
+
+    for (line = strtok_r(reply, "\n", &save); line;
+         line = strtok_r(NULL, "\n", &save)) {
+        // Many lines from one call site, past the rate limit
+        mylog(LOG_INFO, "Stats: %s", line);
+    }
+}
+
+// Whether our tunnel t is the one a new process configured as want,
+// the port included
+static int handoff_tunnel_matches(int t, const union um_sockaddr *want)
+{
+    const struct um_tunnel *tn = &tunnels[t];
+    struct um_flow_key kh, kw;
+
+    // "*", sin_port and sin6_port sit at the same offset
+    if (want->sa.sa_family == AF_UNSPEC) {
+        return tn->listen_any &&
+               want->v4.sin_port == tn->conf.listen.v4.sin_port;
+    }
+
+    um_flow_key_of(&kh, &tn->conf.listen);
+    um_flow_key_of(&kw, want);
+    return !tn->listen_any && um_flow_key_eq(&kh, &kw);
+}
+
+// Drop what q still holds, the socket had no room for it in time
+static int handoff_txq_drop(struct um_txq *q)
+{
+    struct um_dir_stats *st = &stats.dir[q->dir];
+    struct um_pkt *pkt;
+    int n = 0;
+
+    while ((pkt = um_txq_pop(q))) {
+        if (pkt->flow >= 0) {
+            map.ent[pkt->flow].stats.queued[q->dir]--;
+        }
+        st->queued--;
+        st->drop_eagain++;
+        um_pool_put(&pool, pkt);
+        n++;
+    }
+
+    if (n > 0) {
+        um_event_want_write(q->sock, q->idx, 0);
+    }
+
+    return n;
+}
+
+// Push out what waits to be sent before the sockets change hands. Full
+// sockets get up to UM_HANDOFF_FLUSH_MS to take the rest, what they still
+// hold then is dropped and counted.
+static void handoff_flush(void)
+{
+    int64_t deadline;
+    int left, dropped = 0;
+
+#ifdef UM_HAVE_PIPELINE
+    if (use_pipeline) {
+        um_pipe_forget(-1, -1);
+    }
+#endif
+#ifdef UM_HAVE_URING
+    if (use_uring) {
+        um_uring_submit(&uring, 0);
+    }
+#endif
+
+    deadline = um_clock_update() + UM_HANDOFF_FLUSH_MS;
+
+    for (;;) {
+        left = 0;
+
+        for (int t = 0; t < n_tunnels; t++) {
+            left += um_txq_send(&tunnels[t].bind_txq);
+        }
+
+        for (int i = 0; i < map.cap; i++) {
+            if (map.ent[i].in_use) {
+                left += um_txq_send(&map.ent[i].txq);
+                if (map.ent[i].reply_sock >= 0) {
+                    left += um_txq_send(&map.ent[i].reply_txq);
+                }
+            }
+        }
+
+        if (left == 0 || um_clock_update() >= deadline) {
+            break;
+        }
+        poll(NULL, 0, 1);
+    }
+
+    if (left == 0) {
+        return;
+    }
+
+    for (int t = 0; t < n_tunnels; t++) {
+        dropped += handoff_txq_drop(&tunnels[t].bind_txq);
+    }
+
+    for (int i = 0; i < map.cap; i++) {
+        if (map.ent[i].in_use) {
+            dropped += handoff_txq_drop(&map.ent[i].txq);
+            dropped += handoff_txq_drop(&map.ent[i].reply_txq);
+        }
+    }
+
+    log_warn("Handoff: dropped %d datagrams full sockets had no room for",
+             dropped);
+}
+
+// Send every tunnel's listening socket and every flow, with its sockets
+static int handoff_send_state(int sock)
+{
+    int n = n_tunnels + map.used;
+    struct um_handoff_rec *rec = calloc(n, sizeof(*rec));
+    int *fds = malloc(sizeof(*fds) * 2 * n);
+    int k = 0, nfd = 0;
+    int r = -1;
+
+    if (!rec || !fds) {
+        goto exit;
+    }
+
+    for (int t = 0; t < n_tunnels; t++, k++) {
+        rec[k].tunnel = t;
+        rec[k].nfd = 1;
+        rec[k].last_use = TIME_INVALID;
+        rec[k].from = tunnels[t].conf.listen;
+        fds[nfd++] = tunnels[t].bind_sock;
+    }
+
+    for (int i = 0; i < map.cap; i++) {
+        const struct um_sockmap *e = &map.ent[i];
+
+        if (!e->in_use) {
+            continue;
+        }
+
+        rec[k].tunnel = e->tunnel;
+        rec[k].nfd = e->reply_sock >= 0 ? 2 : 1;
+        rec[k].last_use = e->last_use;
+        rec[k].from = e->from;
+        rec[k].conn = e->conn;
+        fds[nfd++] = e->sock;
+        if (e->reply_sock >= 0) {
+            fds[nfd++] = e->reply_sock;
+        }
+        k++;
+    }
+
+    r = um_handoff_send(sock, 0, rec, n_tunnels, map.used, fds);
+
+exit:
+    free(rec);
+    free(fds);
+    return r;
+}
+
+// A new process connected to the handoff socket. What it wants is read
+// once it arrives, from the event loop; a newer connection replaces one
+// that has not said anything yet.
+static void handle_handoff(void)
+{
+    int sock;
+
+    while (!signal_term) {
+        sock = um_handoff_accept(handoff_sock);
+        if (sock < 0) {
+            if (errno == EPERM) {
+                log_warn("Handoff refused to another user");
+            } else if (errno != EINTR) {
+                return;
+            }
+            continue;
+        }
+
+        if (handoff_conn >= 0) {
+            um_event_del(handoff_conn, UM_EVENT_HANDOFF_CONN);
+            close(handoff_conn);
+            handoff_conn = -1;
+        }
+
+        if (um_event_add(sock, UM_EVENT_HANDOFF_CONN) < 0) {
+            log_warn("Handoff: %s", strerror(errno));
+            close(sock);
+            continue;
+        }
+        handoff_conn = sock;
+    }
+}
+
+// The new process sent the tunnels it wants. If they are ours, hand
+// everything over and stop once it has acknowledged; until then, whatever
+// goes wrong leaves us serving.
+static void handle_handoff_conn(void)
+{
+    struct um_handoff_rec *rec;
+    int *fds;
+    int n_t, n_f;
+    int sock = handoff_conn;
+    int ok;
+
+    um_event_del(sock, UM_EVENT_HANDOFF_CONN);
+    handoff_conn = -1;
+
+    if (um_handoff_recv(sock, &rec, &n_t, &n_f, &fds) < 0) {
+        log_warn("Handoff: %s", strerror(errno));
+        close(sock);
+        return;
+    }
+
+    ok = n_t == n_tunnels && n_f == 0;
+    for (int t = 0; ok && t < n_tunnels; t++) {
+        ok = handoff_tunnel_matches(t, &rec[t].from);
+    }
+
+    for (int i = 0; i < um_handoff_nfd(rec, n_t + n_f); i++) {
+        close(fds[i]);
+    }
+    free(rec);
+    free(fds);
+
+    if (!ok) {
+        log_warn("Handoff refused, the new process has other tunnels");
+        um_handoff_send(sock, EINVAL, NULL, 0, 0, NULL);
+        close(sock);
+        return;
+    }
+
+    handoff_flush();
+
+    if (handoff_send_state(sock) < 0 ||
+        um_handoff_recv(sock, &rec, &n_t, &n_f, &fds) < 0) {
+        log_warn("Handoff failed, still serving: %s", strerror(errno));
+        close(sock);
+        return;
+    }
+    free(rec);
+    free(fds);
+    close(sock);
+
+    log_info("Handed %d flows over to the new process", map.used);
+    handoff_done = 1;
+    signal_term = 1;
+}
+
+// Point the socket of map entry i at its tunnel's current remote address,
+// so that sends skip the route lookup and only the remote's replies get
+// through. Sends fall back to naming the address if that fails.
+static void connect_flow(int i)
+{
+    struct um_sockmap *e = &map.ent[i];
+    struct um_tunnel *tn = &tunnels[e->tunnel];
+
+    if (connect(e->sock, &tn->conn_addr.sa,
+                um_sockaddr_len(&tn->conn_addr)) < 0) {
+        log_warn("connect(): %s", strerror(errno));
+        memset(&e->conn, 0, sizeof(e->conn));
+        return;
+    }
+
+    e->conn = tn->conn_key;
+}
+
+/////////////////////////////////////////////////////////////////////
+// Spare flow sockets
+/////////////////////////////////////////////////////////////////////
+
+static time_t spare_hold;   // no refill before then, after a failure
+static int spare_total;     // spares of all tunnels
+static int fd_limit;        // descriptors the loop may have open
+static int fd_base;         // open before the first flow
+
+// Descriptors open now, of the first limit
+static int count_open_fds(int limit)
+{
+    int n = 0;
+
+    for (int fd = 0; fd < limit; fd++) {
+        n += fcntl(fd, F_GETFD) >= 0;
+    }
+
+    return n;
+}
+
+// Note the descriptors left for flows and spares, once the loop has
+// opened its own
+static void spare_init(void)
+{
+    struct rlimit rl;
+
+    fd_limit = 65536;
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < 65536) {
+        fd_limit = (int) rl.rlim_cur;
+    }
+#ifndef UM_HAVE_EPOLL
+    // select() can't watch any higher
+    if (fd_limit > FD_SETSIZE) {
+        fd_limit = FD_SETSIZE;
+    }
+#endif
+
+    // Flows handed over are counted as they come and go
+    fd_base = count_open_fds(fd_limit) - map.used * (use_reply_sock ? 2 : 1);
+    spare_total = 0;
+    spare_hold = 0;
+}
+
+// How many spares there may be: no more than flows can still come, and
+// never so many that new clients, reply sockets and the handoff socket
+// would run out of descriptors
+static int spare_limit(void)
+{
+    int per_flow = use_reply_sock ? 2 : 1;
+    int room = fd_limit - UM_FD_RESERVE - fd_base - map.used * per_flow;
+    int limit = max_client - map.used;
+
+    if (limit > UM_SPARE_MAX) {
+        limit = UM_SPARE_MAX;
+    }
+    if (limit > room) {
+        limit = room;
+    }
+
+    return limit < 0 ? 0 : limit;
+}
+
+static void spare_drop(struct um_tunnel *tn)
+{
+    spare_total -= tn->spare_n;
+    while (tn->spare_n > 0) {
+        close(tn->spare[--tn->spare_n]);
+    }
+}
+
+// Give tunnel tn one more spare. Returns -1 if that failed.
+static int spare_add(struct um_tunnel *tn)
+{
+    int sock = new_sock_nonblocking(tn->conn_addr.sa.sa_family);
+
+    if (sock < 0) {
+        return -1;
+    }
+    if (connect(sock, &tn->conn_addr.sa,
+                um_sockaddr_len(&tn->conn_addr)) < 0) {
+        close(sock);
+        return -1;
+    }
+
+    tn->spare[tn->spare_n++] = sock;
+    spare_total++;
+
+    return 0;
+}
+
+// Top up the spare sockets of the tunnels, one round at a time so that
+// they share what spare_limit() allows. Called when the loop is about to
+// wait, so that a burst of new clients finds them ready.
+static void spare_refill(time_t time_val)
+{
+    int limit;
+
+    for (int t = 0; t < n_tunnels; t++) {
+        struct um_tunnel *tn = &tunnels[t];
+
+        // The remote moved, the spares point at the old one
+        if (!um_flow_key_eq(&tn->spare_conn, &tn->conn_key)) {
+            spare_drop(tn);
+            tn->spare_conn = tn->conn_key;
+        }
+    }
+
+    limit = spare_limit();
+
+    // Over the limit as flows came, close some
+    for (int t = n_tunnels - 1; spare_total > limit && t >= 0; t--) {
+        struct um_tunnel *tn = &tunnels[t];
+
+        while (spare_total > limit && tn->spare_n > 0) {
+            close(tn->spare[--tn->spare_n]);
+            spare_total--;
+        }
+    }
+
+    if (spare_total >= limit || time_val < spare_hold) {
+        return;
+    }
+
+    for (int round = 1; round <= UM_SPARE_SOCKS; round++) {
+        for (int t = 0; t < n_tunnels; t++) {
+            struct um_tunnel *tn = &tunnels[t];
+
+            if (tn->conn_key.family == 0 || tn->spare_n >= round) {
+                continue;
+            }
+            if (spare_total >= limit) {
+                return;
+            }
+            if (spare_add(tn) < 0) {
+                // Leave what is left to new clients for a while
+                spare_hold = time_val + 1;
+                return;
+            }
+        }
+    }
+}
+
+// A socket for a new flow of tunnel tn. conn is what it is connected to,
+// zero if it isn't.
+static int spare_take(struct um_tunnel *tn, struct um_flow_key *conn)
+{
+    if (tn->spare_n > 0 && um_flow_key_eq(&tn->spare_conn, &tn->conn_key)) {
+        *conn = tn->spare_conn;
+        stats.flows_spare++;
+        spare_total--;
+        return tn->spare[--tn->spare_n];
+    }
+
+    memset(conn, 0, sizeof(*conn));
+
+    return new_sock_nonblocking(tn->conn_addr.sa.sa_family);
+}
+
+// Open a socket bound to the listening address and connected to the client
+// of map entry i. The kernel then hands the client's datagrams to it rather
+// than the tunnel's listening socket, and replies through it skip the route
+// lookup.
+static void open_reply_sock(int i)
+{
+    struct um_sockmap *e = &map.ent[i];
+    union um_sockaddr *listen_addr = &tunnels[e->tunnel].conf.listen;
+    int on = 1;
+    int sock = new_sock_nonblocking(listen_addr->sa.sa_family);
+
+    if (sock < 0) {
+        log_warn("socket()/fcntl(): %s", strerror(errno));
+        return;
+    }
+
+    if (setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0 ||
+        bind(sock, &listen_addr->sa, um_sockaddr_len(listen_addr)) < 0 ||
+        connect(sock, &e->from.sa, um_sockaddr_len(&e->from)) < 0) {
+        log_warn("Failed to open reply socket: %s", strerror(errno));
+        close(sock);
+        return;
+    }
+
+    if (use_gso) {
+        set_sock_gro(sock);
+    }
+
+    e->reply_sock = sock;
+    e->reply_pending = 0;
+
+    if (um_event_add(sock, UM_EVENT_REPLY(i)) < 0) {
+        log_warn("Failed to watch reply socket: %s", strerror(errno));
+        e->reply_sock = -1;
+        close(sock);
+        return;
+    }
+
+    um_txq_init(&e->reply_txq, sock, UM_EVENT_REPLY(i), UM_DIR_DOWN);
+}
+
+// Queue datagram k towards the remote on behalf of map entry i
+static inline void forward_up(struct um_batch *b, int k, int i, int *tx_n,
+                              time_t time_val)
+{
+    struct um_sockmap *e = &map.ent[i];
+    struct um_tunnel *tn = &tunnels[e->tunnel];
+    int queued;
+
+    update_conn_addr(e->tunnel, time_val);
+
+    if (tn->conn_key.family == 0) {
+        stats.drop_no_addr++;
+        return;
+    }
+
+    if (!um_flow_key_eq(&e->conn, &tn->conn_key)) {
+        connect_flow(i);
+    }
+
+    queued = um_batch_transform(b, k, tn->snd_op, &tn->tran, e->sock, i,
+                                e->conn.family ? NULL : &tn->conn_addr, tx_n,
+                                &stats.dir[UM_DIR_UP]);
+    if (queued > 0) {
+        UPDATE_LAST_USE(i, time_val);
+        e->stats.up_pkts += queued;
+        e->stats.up_bytes += b->rx[k].msg_len;
+    }
+}
+
+// Forward datagrams in rx slots [0, rcvd) received on the "listening"
+// socket of tunnel t
+static void forward_bind(int t, struct um_batch *b, int rcvd,
+                         time_t time_val)
+{
+    struct um_tunnel *tn = &tunnels[t];
+    struct um_dir_stats *st = &stats.dir[UM_DIR_UP];
+    union um_sockaddr *recv_addr;
+    struct um_flow_key key, conn;
+    char addr[UM_ADDR_STRLEN];
+    int sock_idx, sock;
+    int tmp_sock;
+    int tx_n;
+
+    tx_n = 0;
+
+    for (int k = 0; k < rcvd; k++) {
+        if (b->rx[k].msg_len == 0) {
+            continue;
+        }
+
+        recv_addr = &b->addr[k];
+
+        // Try to locate existing connection from map
+        um_flow_key_of(&key, recv_addr);
+        key.tunnel = (uint8_t) t;
+        sock_idx = um_sockmap_find(&map, &key, &sock);
+
+        if (sock_idx < 0) {
+            // The remote's family decides that of the flow's socket
+            update_conn_addr(t, time_val);
+            if (tn->conn_key.family == 0) {
+                stats.drop_no_addr++;
+                continue;
+            }
+
+            log_info("New connection from [%s] on tunnel %d",
+                     um_sockaddr_str(recv_addr, addr, sizeof(addr)), t);
+
+            tmp_sock = spare_take(tn, &conn);
+            if (tmp_sock < 0) {
+                log_err("socket()/fcntl(): %s", strerror(errno));
+                stats.drop_sock_err++;
+            } else {
+                if (time_val - time_last_clean >= 1) {
+                    // Flush first, clean up may close queued sockets
+                    um_batch_flush(b, tx_n, st);
+                    tx_n = 0;
+
+                    um_sockmap_clean(time_val);
+                    time_last_clean = time_val;
+                }
+
+                sock_idx = um_sockmap_ins(&map, tmp_sock, t, recv_addr,
+                                          time_val);
+                sock = tmp_sock;
+                if (sock_idx >= 0 && um_event_add(tmp_sock, sock_idx) < 0) {
+                    log_err("Failed to watch socket: %s", strerror(errno));
+                    um_sockmap_del(&map, sock_idx);
+                    sock_idx = -1;
+                    close(tmp_sock);
+                    stats.drop_sock_err++;
+                } else if (sock_idx < 0) {
+                    // Failed to insert newly created socket into sockmap
+                    log_warn("Max clients reached. "
+                             "Dropping new connection [%s] on tunnel %d",
+                             um_sockaddr_str(recv_addr, addr, sizeof(addr)),
+                             t);
+                    close(tmp_sock);
+                    stats.drop_max_client++;
+                } else {
+                    map.ent[sock_idx].conn = conn;
+                    um_txq_init(&map.ent[sock_idx].txq, tmp_sock, sock_idx,
+                                UM_DIR_UP);
+                    um_txq_init(&map.ent[sock_idx].reply_txq, -1,
+                                UM_EVENT_REPLY(sock_idx), UM_DIR_DOWN);
+                    stats.flows_new++;
+                    if (use_reply_sock) {
+                        open_reply_sock(sock_idx);
+                    }
+                }
+            }
+        }
+
+        // Check sock_idx again to deal with new connection
+        if (sock_idx >= 0) {
+            forward_up(b, k, sock_idx, &tx_n, time_val);
+        }
+    }
+
+    um_batch_flush(b, tx_n, st);
+}
+
+// Forward datagrams in rx slots [0, rcvd) received on the reply socket of
+// map entry i
+static void forward_reply(int i, struct um_batch *b, int rcvd,
+                          time_t time_val)
+{
+    int tx_n = 0;
+
+    for (int k = 0; k < rcvd; k++) {
+        if (b->rx[k].msg_len != 0) {
+            forward_up(b, k, i, &tx_n, time_val);
+        }
+    }
+
+    um_batch_flush(b, tx_n, &stats.dir[UM_DIR_UP]);
+}
+
+// Forward replies in rx slots [0, rcvd) received on the socket of map
+// entry i
+static void forward_map(int i, struct um_batch *b, int rcvd, time_t time_val)
+{
+    struct um_dir_stats *st = &stats.dir[UM_DIR_DOWN];
+    struct um_flow_stats *fst = &map.ent[i].stats;
+    struct um_tunnel *tn = &tunnels[map.ent[i].tunnel];
+    int reply_sock = map.ent[i].reply_sock;
+    union um_sockaddr *to = NULL;
+    int tx_n;
+
+    // The reply socket is connected to the client
+    if (reply_sock < 0) {
+        reply_sock = tn->bind_sock;
+        to = &map.ent[i].from;
+    }
+
+    UPDATE_LAST_USE(i, time_val);
+
+    tx_n = 0;
+
+    for (int k = 0; k < rcvd; k++) {
+        if (b->rx[k].msg_len == 0) {
+            continue;
+        }
+
+        fst->down_pkts += um_batch_transform(b, k, tn->rcv_op, &tn->tran,
+                                             reply_sock, i, to, &tx_n, st);
+        fst->down_bytes += b->rx[k].msg_len;
+    }
+
+    um_batch_flush(b, tx_n, st);
+}
+
+// Deal with packets from the "listening" socket of tunnel t. Returns 1 once
+// the socket is drained, 0 if the per-wakeup budget ran out first.
+static int drain_bind_sock(int t, struct um_batch *b, time_t time_val)
+{
+    int rcvd;
+
+    for (int drained = 0; drained < UM_DRAIN_BATCH; drained += rcvd) {
+        if (signal_term) {
+            return 1;
+        }
+
+        rcvd = um_batch_recv(tunnels[t].bind_sock, b, 1);
+        if (rcvd <= 0) {
+            return 1;
+        }
+
+        forward_bind(t, b, rcvd, time_val);
+
+        if (rcvd < mmsg_batch) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Deal with replies on the socket of map entry i, same return as
+// drain_bind_sock()
+static int drain_map_sock(int i, struct um_batch *b, time_t time_val)
+{
+    int rcvd;
+
+    for (int drained = 0; drained < UM_DRAIN_BATCH; drained += rcvd) {
+        if (signal_term) {
+            return 1;
+        }
+
+        rcvd = um_batch_recv(map.ent[i].sock, b, 0);
+        if (rcvd <= 0) {
+            return 1;
+        }
+
+        forward_map(i, b, rcvd, time_val);
+
+        if (rcvd < mmsg_batch) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// Deal with packets on the reply socket of map entry i, same return as
+// drain_bind_sock()
+static int drain_reply_sock(int i, struct um_batch *b, time_t time_val)
+{
+    int rcvd;
+
+    for (int drained = 0; drained < UM_DRAIN_BATCH; drained += rcvd) {
+        if (signal_term) {
+            return 1;
+        }
+
+        rcvd = um_batch_recv(map.ent[i].reply_sock, b, 0);
+        if (rcvd <= 0) {
+            return 1;
+        }
+
+        forward_reply(i, b, rcvd, time_val);
+
+        if (rcvd < mmsg_batch) {
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+#ifdef UM_HAVE_EPOLL
+
+#define UM_EPOLL_EVENTS     64
+
+// The tx queue of the socket at event index idx, NULL if it is gone
+static struct um_txq *um_txq_of_idx(int idx)
+{
+    int i = idx >= max_client ? idx - max_client : idx;
+
+    if (UM_EVENT_IS_BIND(idx)) {
+        return &tunnels[UM_EVENT_TUNNEL(idx)].bind_txq;
+    }
+    if (!map.ent[i].in_use) {
+        return NULL;
+    }
+
+    return idx >= max_client ? &map.ent[i].reply_txq : &map.ent[i].txq;
+}
+
+static void run_loop(struct um_batch *b)
+{
+    struct epoll_event events[UM_EPOLL_EVENTS];
+    time_t time_val;
+    int nfds;
+
+    // Sockets left with queued datagrams once their budget ran out. Edge
+    // triggered epoll won't report them again, so poll them ourselves.
+    int *pend = malloc(sizeof(*pend) *
+                       (UM_EVENT_REPLY(max_client) + n_tunnels));
+    int pend_n = 0;
+
+    if (!pend) {
+        log_err("Failed to allocate pending list");
+        return;
+    }
+
+#define PENDING_FLAG(idx)                                               \
+    (*(UM_EVENT_IS_BIND(idx) ?                                          \
+       &tunnels[UM_EVENT_TUNNEL(idx)].bind_pending :                    \
+       (idx) >= max_client ? &map.ent[(idx) - max_client].reply_pending : \
+       &map.ent[idx].pending))
+
+    time_val = um_clock_sec();
+
+    while (!signal_term) {
+        // Write queued log lines and make spare sockets only while there
+        // is nothing else to do
+        if (pend_n == 0) {
+            log_flush(UM_LOG_FLUSH);
+            spare_refill(time_val);
+        }
+
+        nfds = epoll_wait(epoll_fd, events, UM_EPOLL_EVENTS,
+                          pend_n > 0 ? 0 : -1);
+        if (nfds < 0) {
+            log_debug("epoll_wait() returns %d", nfds);
+            if (signal_dump) {
+                dump_stats(um_clock_sec());
+            }
+            continue;
+        }
+
+        // One clock read per wakeup, however many datagrams it brings
+        um_clock_update();
+        time_val = um_clock_sec();
+
+        if (signal_dump) {
+            dump_stats(time_val);
+        }
+
+        for (int e = 0; e < nfds; e++) {
+            int idx = (int) events[e].data.u32;
+
+            if (idx == UM_EVENT_RESOLVER) {
+                handle_resolver(time_val);
+                continue;
+            }
+
+            if (idx == UM_EVENT_STATS) {
+                handle_stats(time_val);
+                continue;
+            }
+
+            if (idx == UM_EVENT_HANDOFF) {
+                handle_handoff();
+                continue;
+            }
+
+            if (idx == UM_EVENT_HANDOFF_CONN) {
+                handle_handoff_conn();
+                continue;
+            }
+
+            if (events[e].events & EPOLLOUT) {
+                struct um_txq *q = um_txq_of_idx(idx);
+                if (q) {
+                    um_txq_send(q);
+                }
+                if (!(events[e].events & ~EPOLLOUT)) {
+                    continue;
+                }
+            }
+
+            if (!PENDING_FLAG(idx)) {
+                PENDING_FLAG(idx) = 1;
+                pend[pend_n++] = idx;
+            }
+        }
+
+        int kept = 0;
+
+        for (int p = 0; p < pend_n; p++) {
+            int idx = pend[p];
+            int done;
+
+            if (UM_EVENT_IS_BIND(idx)) {
+                done = drain_bind_sock(UM_EVENT_TUNNEL(idx), b, time_val);
+            } else if (idx >= max_client) {
+                int i = idx - max_client;
+                done = !map.ent[i].in_use || map.ent[i].reply_sock < 0 ||
+                       drain_reply_sock(i, b, time_val);
+            } else if (map.ent[idx].in_use) {
+                done = drain_map_sock(idx, b, time_val);
+            } else {
+                done = 1;
+            }
+
+            if (done) {
+                PENDING_FLAG(idx) = 0;
+            } else {
+                pend[kept++] = idx;
+            }
+        }
+
+        pend_n = kept;
+
+        if (time_val - time_last_clean >= 1) {
+            um_sockmap_clean(time_val);
+            time_last_clean = time_val;
+            // Busy or not, once a second
+            log_flush(UM_LOG_FLUSH);
+        }
+    }
+
+#undef PENDING_FLAG
+
+    free(pend);
+}
+
+#else
+
+static void run_loop(struct um_batch *b)
+{
+    fd_set read_fd_set, write_fd_set;
+    time_t time_val;
+    int select_ret;
+
+    time_val = um_clock_sec();
+
+    while (!signal_term) {
+        read_fd_set = active_fd_set;
+        write_fd_set = active_wr_fd_set;
+
+        log_flush(UM_LOG_FLUSH);
+        spare_refill(time_val);
+
+        select_ret = select(sock_fd_max + 1, &read_fd_set, &write_fd_set,
+                            NULL, NULL);
+        if (select_ret <= 0) {
+            log_debug("select() returns %d", select_ret);
+            if (signal_dump) {
+                dump_stats(um_clock_sec());
+            }
+            continue;
+        }
+
+        // One clock read per wakeup, however many datagrams it brings
+        um_clock_update();
+        time_val = um_clock_sec();
+
+        if (signal_dump) {
+            dump_stats(time_val);
+        }
+
+        if (resolver.sock >= 0 && FD_ISSET(resolver.sock, &read_fd_set)) {
+            handle_resolver(time_val);
+        }
+
+        if (stats_sock >= 0 && FD_ISSET(stats_sock, &read_fd_set)) {
+            handle_stats(time_val);
+        }
+
+        if (handoff_sock >= 0 && FD_ISSET(handoff_sock, &read_fd_set)) {
+            handle_handoff();
+        }
+
+        if (handoff_conn >= 0 && FD_ISSET(handoff_conn, &read_fd_set)) {
+            handle_handoff_conn();
+        }
+
+        for (int t = 0; t < n_tunnels; t++) {
+            if (FD_ISSET(tunnels[t].bind_sock, &write_fd_set)) {
+                um_txq_send(&tunnels[t].bind_txq);
+            }
+        }
+
+        for (int i = 0; i < map.cap; i++) {
+            struct um_sockmap *e = &map.ent[i];
+
+            if (e->in_use && FD_ISSET(e->sock, &write_fd_set)) {
+                um_txq_send(&e->txq);
+            }
+            if (e->in_use && e->reply_sock >= 0 &&
+                FD_ISSET(e->reply_sock, &write_fd_set)) {
+                um_txq_send(&e->reply_txq);
+            }
+        }
+
+        for (int t = 0; t < n_tunnels; t++) {
+            if (FD_ISSET(tunnels[t].bind_sock, &read_fd_set)) {
+                drain_bind_sock(t, b, time_val);
+            }
+        }
+
+        for (int i = 0; i < map.cap; i++) {
+            if (map.ent[i].in_use && FD_ISSET(map.ent[i].sock, &read_fd_set)) {
+                drain_map_sock(i, b, time_val);
+            }
+            if (map.ent[i].in_use && map.ent[i].reply_sock >= 0 &&
+                FD_ISSET(map.ent[i].reply_sock, &read_fd_set)) {
+                drain_reply_sock(i, b, time_val);
+            }
+        }
+
+        if (time_val - time_last_clean >= 1) {
+            um_sockmap_clean(time_val);
+            time_last_clean = time_val;
+        }
+    }
+}
+
+#endif /* UM_HAVE_EPOLL */
+
+#ifdef UM_HAVE_URING
+
+static inline int um_event_sock(int idx)
+{
+    if (UM_EVENT_IS_BIND(idx)) {
+        return tunnels[UM_EVENT_TUNNEL(idx)].bind_sock;
+    }
+
+    switch (idx) {
+    case UM_EVENT_RESOLVER:
+        return resolver.sock;
+    case UM_EVENT_STATS:
+        return stats_sock;
+    case UM_EVENT_HANDOFF:
+        return handoff_sock;
+    case UM_EVENT_HANDOFF_CONN:
+        return handoff_conn;
+    default:
+        return idx >= max_client ? map.ent[idx - max_client].reply_sock :
+                                   map.ent[idx].sock;
+    }
+}
+
+static void um_uring_sent(const struct io_uring_cqe *cqe)
+{
+    struct um_dir_stats *st = &stats.dir[(cqe->user_data >> 16) & 1];
+    uint16_t bid = (uint16_t) cqe->user_data;
+
+    if (cqe->res >= 0) {
+        st->tx_pkts++;
+        st->tx_bytes += (uint64_t) cqe->res;
+    } else if (cqe->res == -EAGAIN) {
+        st->drop_eagain++;
+    } else {
+        st->drop_send++;
+    }
+
+    if (--uring_refs[bid] == 0) {
+        um_uring_buf_put(&uring, bid);
+    }
+}
+
+// Forward rx slots [0, n) received on idx, then give back the buffers no
+// send is holding
+static void um_uring_forward(struct um_batch *b, int idx, int n,
+                             time_t time_val)
+{
+    if (UM_EVENT_IS_BIND(idx)) {
+        forward_bind(UM_EVENT_TUNNEL(idx), b, n, time_val);
+    } else if (idx >= max_client) {
+        forward_reply(idx - max_client, b, n, time_val);
+    } else {
+        forward_map(idx, b, n, time_val);
+    }
+
+    for (int k = 0; k < n; k++) {
+        if (uring_refs[b->rx_bid[k]] == 0) {
+            um_uring_buf_put(&uring, b->rx_bid[k]);
+        }
+    }
+}
+
+// Every socket has a multishot request armed, so a loop iteration is one
+// io_uring_enter() that submits the last round of sends and waits for the
+// next completions. Consecutive receives on the same socket are forwarded
+// as one batch.
+static void run_loop_uring(struct um_batch *b)
+{
+    struct io_uring_cqe *cqe;
+    unsigned int head, tail;
+    time_t time_val;
+    int cur = UM_EVENT_BIND(0);
+    int n;
+
+    time_val = um_clock_sec();
+
+    while (!signal_term) {
+        log_flush(UM_LOG_FLUSH);
+        spare_refill(time_val);
+
+        if (um_uring_submit(&uring, 1) < 0 && errno != EINTR) {
+            log_debug("io_uring_enter(): %s", strerror(errno));
+        }
+
+        // One clock read per wakeup, however many datagrams it brings
+        um_clock_update();
+        time_val = um_clock_sec();
+
+        if (signal_dump) {
+            dump_stats(time_val);
+        }
+
+        n = 0;
+        tail = um_uring_cq_ready(&uring, &head);
+
+        for (; head != tail; head++) {
+            cqe = um_uring_cqe(&uring, head);
+
+            if (UD_KIND(cqe->user_data) == UD_SEND) {
+                um_uring_sent(cqe);
+                continue;
+            }
+            if (UD_KIND(cqe->user_data) != UD_EVENT) {
+                continue;
+            }
+
+            int idx = (int) (uint32_t) cqe->user_data;
+            int live = ((cqe->user_data >> 32) & UD_GEN_MASK) ==
+                       (URING_GEN(idx) & UD_GEN_MASK);
+            int bid = cqe->flags & IORING_CQE_F_BUFFER ?
+                      (int) (cqe->flags >> IORING_CQE_BUFFER_SHIFT) : -1;
+
+            // Ran out of buffers or hit an error, start over
+            if (live && !(cqe->flags & IORING_CQE_F_MORE) &&
+                cqe->res != -ECANCELED &&
+                um_uring_arm(um_event_sock(idx), idx) < 0) {
+                log_err("Failed to rearm socket: %s", strerror(errno));
+            }
+
+            if (UM_EVENT_IS_CTL(idx)) {
+                if (live && cqe->res > 0) {
+                    if (idx == UM_EVENT_RESOLVER) {
+                        handle_resolver(time_val);
+                    } else if (idx == UM_EVENT_STATS) {
+                        handle_stats(time_val);
+                    } else if (idx == UM_EVENT_HANDOFF) {
+                        handle_handoff();
+                    } else {
+                        handle_handoff_conn();
+                    }
+                }
+                continue;
+            }
+
+            if (bid < 0) {
+                continue;
+            }
+
+            if (!live || cqe->res <= 0) {
+                um_uring_buf_put(&uring, (uint16_t) bid);
+                continue;
+            }
+
+            if (n > 0 && (idx != cur || n == b->size)) {
+                um_uring_forward(b, cur, n, time_val);
+                n = 0;
+            }
+
+            unsigned char *buf = um_uring_buf(&uring, (uint16_t) bid);
+            struct io_uring_recvmsg_out out;
+
+            memcpy(&out, buf, sizeof(out));
+            buf += sizeof(out);
+
+            memcpy(&b->addr[n], buf, sizeof(b->addr[n]));
+            buf += uring_recv_msg.msg_namelen;
+
+            b->rx[n].msg_hdr.msg_control = buf;
+            b->rx[n].msg_hdr.msg_controllen = out.controllen;
+            buf += uring_recv_msg.msg_controllen;
+
+            b->rx_iov[n].iov_base = buf;
+            b->rx[n].msg_len = out.payloadlen;
+            b->rx_bid[n] = (uint16_t) bid;
+
+            cur = idx;
+            n++;
+        }
+
+        if (n > 0) {
+            um_uring_forward(b, cur, n, time_val);
+        }
+
+        um_uring_cq_advance(&uring, head);
+
+        if (time_val - time_last_clean >= 1) {
+            um_sockmap_clean(time_val);
+            time_last_clean = time_val;
+        }
+    }
+}
+
+#endif /* UM_HAVE_URING */
+
+/////////////////////////////////////////////////////////////////////
+
+// Set up tunnel t for a run of the loop, its mask is new each time
+static int tunnel_init(int t)
+{
+    struct um_tunnel *tn = &tunnels[t];
+    union um_sockaddr addr;
+
+    memset(&tn->tran, 0, sizeof(tn->tran));
+    genmask(tn->tran.mask, MASK_LEN);
+
+    memset(&tn->conn_addr, 0, sizeof(tn->conn_addr));
+    memset(&tn->conn_key, 0, sizeof(tn->conn_key));
+    tn->resolve_inflight = 0;
+    tn->bind_pending = 0;
+    tn->spare_n = 0;
+    memset(&tn->spare_conn, 0, sizeof(tn->spare_conn));
+
+    switch (tn->conf.mode) {
+    case UM_MODE_SERVER:
+        tn->snd_op = UM_OP_UNMASK;
+        tn->rcv_op = UM_OP_MASK;
+        break;
+    case UM_MODE_CLIENT:
+        tn->snd_op = UM_OP_MASK;
+        tn->rcv_op = UM_OP_UNMASK;
+        break;
+    case UM_MODE_PASSTHROU:
+        tn->snd_op = UM_OP_NOOP;
+        tn->rcv_op = UM_OP_NOOP;
+        break;
+    default:
+        log_err("Unknown mode");
+        return -1;
+    }
+
+    // Blocking is fine before any flow exists, later lookups are async
+    tn->time_conn_addr = um_clock_sec();
+    if (resolver_lookup(tn->conf.host, AF_UNSPEC, &addr) < 0) {
+        log_warn("Failed to resolve [%s]", tn->conf.host);
+    } else {
+        set_conn_addr(tn, &addr);
+    }
+
+    return 0;
+}
+
+// Put the flows the previous process handed over back in the map, with
+// the sockets they had
+static void adopt_flows(void)
+{
+    const int *fds;
+    time_t now = um_clock_sec();
+    char addr[UM_ADDR_STRLEN];
+
+    if (!handoff_rec) {
+        return;
+    }
+
+    fds = handoff_fds + n_tunnels;
+    for (int f = 0; f < handoff_n_flows; f++) {
+        const struct um_handoff_rec *rec = &handoff_rec[n_tunnels + f];
+        int sock = fds[0];
+        int reply_sock = rec->nfd > 1 ? fds[1] : -1;
+        int i = -1;
+
+        fds += rec->nfd;
+
+        if (set_sock_nonblocking(sock) == 0) {
+            i = um_sockmap_ins(&map, sock, rec->tunnel, &rec->from, now);
+        }
+        if (i >= 0 && um_event_add(sock, i) < 0) {
+            um_sockmap_del(&map, i);
+            i = -1;
+        }
+        if (i < 0) {
+            log_warn("Dropped handed over connection from [%s] on tunnel %d",
+                     um_sockaddr_str(&rec->from, addr, sizeof(addr)),
+                     rec->tunnel);
+            close(sock);
+            if (reply_sock >= 0) {
+                close(reply_sock);
+            }
+            continue;
+        }
+
+        struct um_sockmap *e = &map.ent[i];
+
+        // The predecessor runs on the same monotonic clock, a time ahead
+        // of ours is bogus and would keep the flow from ever expiring
+        e->last_use = rec->last_use > now ? now : (time_t) rec->last_use;
+        e->conn = rec->conn;
+        um_txq_init(&e->txq, sock, i, UM_DIR_UP);
+        um_txq_init(&e->reply_txq, -1, UM_EVENT_REPLY(i), UM_DIR_DOWN);
+
+        if (reply_sock >= 0 && use_reply_sock &&
+            set_sock_nonblocking(reply_sock) == 0 &&
+            um_event_add(reply_sock, UM_EVENT_REPLY(i)) == 0) {
+            e->reply_sock = reply_sock;
+            e->reply_pending = 0;
+            um_txq_init(&e->reply_txq, reply_sock, UM_EVENT_REPLY(i),
+                        UM_DIR_DOWN);
+        } else {
+            // Without it the client's datagrams come in on bind_sock
+            if (reply_sock >= 0) {
+                close(reply_sock);
+            }
+            if (use_reply_sock) {
+                open_reply_sock(i);
+            }
+        }
+    }
+
+    if (handoff_n_flows > 0) {
+        log_info("Adopted %d of %d handed over connections", map.used,
+                 handoff_n_flows);
+    }
+
+    free(handoff_rec);
+    free(handoff_fds);
+    handoff_rec = NULL;
+    handoff_fds = NULL;
+    handoff_n_flows = 0;
+}
+
+// Main loop
+int start(void)
+{
+    struct um_batch batch;
+    int r = 0;
+
+    // Flows expire and names are looked up again by the monotonic clock,
+    // steps of the wall clock leave them alone
+    um_clock_update();
+    memset(&stats, 0, sizeof(stats));
+    stats.start = um_clock_sec();
+
+    for (int t = 0; t < n_tunnels; t++) {
+        if (tunnel_init(t) < 0) {
+            return 1;
+        }
+    }
+
+    // Fork before allocating anything the child would inherit
+    if (resolver_start(&resolver) < 0) {
+        log_warn("Failed to start resolver process, lookups will block");
+    }
+
+    if (um_sockmap_init(&map, max_client, timeout) < 0) {
+        log_err("Failed to allocate sockmap");
+        resolver_stop(&resolver);
+        return 1;
+    }
+
+    if (um_batch_init(&batch, mmsg_batch) < 0 ||
+        um_pool_init(&pool, UM_POOL_SMALL_N, UM_POOL_LARGE_N) < 0) {
+        log_err("Failed to allocate %d receive buffers", mmsg_batch);
+        resolver_stop(&resolver);
+        um_batch_free(&batch);
+        um_pool_free(&pool);
+        um_sockmap_free(&map);
+        return 1;
+    }
+
+    r = um_event_init();
+    for (int t = 0; r == 0 && t < n_tunnels; t++) {
+        um_txq_init(&tunnels[t].bind_txq, tunnels[t].bind_sock,
+                    UM_EVENT_BIND(t), UM_DIR_DOWN);
+        r = um_event_add(tunnels[t].bind_sock, UM_EVENT_BIND(t));
+    }
+
+    if (r < 0 || (resolver.sock >= 0 &&
+                  um_event_add(resolver.sock, UM_EVENT_RESOLVER) < 0)) {
+        log_err("Failed to set up event loop: %s", strerror(errno));
+        resolver_stop(&resolver);
+        um_event_fini();
+        um_batch_free(&batch);
+        um_pool_free(&pool);
+        um_sockmap_free(&map);
+        return 1;
+    }
+
+    if (stats_path) {
+        stats_sock = um_stats_open(stats_path);
+        if (stats_sock < 0 || um_event_add(stats_sock, UM_EVENT_STATS) < 0) {
+            log_warn("Failed to open stats socket [%s]: %s",
+                     stats_path, strerror(errno));
+            um_stats_close(stats_sock, stats_path);
+            stats_sock = -1;
+        } else {
+            log_info("Stats socket [%s]", stats_path);
+        }
+    }
+
+    if (handoff_path) {
+        handoff_sock = um_handoff_listen(handoff_path);
+        if (handoff_sock < 0 ||
+            um_event_add(handoff_sock, UM_EVENT_HANDOFF) < 0) {
+            log_warn("Failed to open handoff socket [%s]: %s",
+                     handoff_path, strerror(errno));
+            um_handoff_close(handoff_sock, handoff_path);
+            handoff_sock = -1;
+        } else {
+            log_info("Handoff socket [%s]", handoff_path);
+        }
+    }
+
+    adopt_flows();
 
-    for (i = 0; i < ARRAY_SIZE(map); i++) {
-        if (!map[i].in_use) {
-            map[i].in_use = 1;
-            map[i].sock = sock;
-            map[i].last_use = TIME_INVALID;
-            map[i].from = *addr;
-            break;
+    log_info("Connection timeout %ds", timeout);
+    log_info("Max clients %d", max_client);
+    log_info("Datagrams per batch %d", mmsg_batch);
+    log_info("Datagrams queued per flow %d", txq_max);
+
+    if (use_gso) {
+        for (int t = 0; t < n_tunnels; t++) {
+            set_sock_gro(tunnels[t].bind_sock);
         }
+        log_info("UDP GSO/GRO enabled");
     }
 
-    if (i >= ARRAY_SIZE(map)) {
-        return -1;
+    if (use_reply_sock) {
+        log_info("Connected reply sockets enabled");
     }
 
-    return i;
-}
+#ifdef UM_HAVE_PIPELINE
+#ifdef UM_HAVE_URING
+    if (use_pipeline && use_uring) {
+        log_warn("Pipeline threads not used with io_uring");
+        use_pipeline = 0;
+    }
+#endif
+    if (use_pipeline && um_pipe_start() < 0) {
+        log_warn("Failed to start pipeline threads: %s", strerror(errno));
+        use_pipeline = 0;
+    }
+    if (use_pipeline) {
+        log_info("Pipelined receive, transform and send threads");
+    }
+#endif
 
-static inline int um_sockmap_find(const struct sockaddr_in *addr)
-{
-    for (int i = 0; i < ARRAY_SIZE(map); i++) {
-        if (map[i].in_use && sockaddr_in_cmp(addr, &(map[i].from)) == 0) {
-            return i;
-        }
+#ifdef UM_HAVE_URING
+    if (use_uring) {
+        log_info("Event loop io_uring");
     }
+#endif
 
-    return -1;
-}
+    spare_init();
 
-static inline int um_sockmap_clean(fd_set *active_set, time_t time_val)
-{
-    int purged = 0;
+    // Nothing in the loop waits for the log
+    log_set_async(1);
 
-    if (timeout <= 0) {
-        return purged;
+#ifdef UM_HAVE_URING
+    if (use_uring) {
+        run_loop_uring(&batch);
+    } else
+#endif
+    {
+        run_loop(&batch);
     }
 
-    for (int i = 0; i < ARRAY_SIZE(map); i++) {
-        if (map[i].in_use && (map[i].last_use == TIME_INVALID ||
-            time_val - map[i].last_use >= timeout)) {
-            map[i].in_use = 0;
-            close(map[i].sock);
-            FD_CLR(map[i].sock, active_set);
+    log_set_async(0);
 
-            UPDATE_SOCK_FD_MAX_RM(map[i].sock);
+    // Clean up
+#ifdef UM_HAVE_PIPELINE
+    if (use_pipeline) {
+        um_pipe_stop();
+    }
+#endif
 
-            log_info("Purged connection from [%s:%hu]",
-                     inet_ntoa(map[i].from.sin_addr),
-                     ntohs(map[i].from.sin_port));
+    for (int t = 0; t < n_tunnels; t++) {
+        spare_drop(&tunnels[t]);
+    }
 
-            if (!purged) {
-                purged = 1;
+    for (int i = 0; i < map.cap; i++) {
+        if (map.ent[i].in_use) {
+            close(map.ent[i].sock);
+            if (map.ent[i].reply_sock >= 0) {
+                close(map.ent[i].reply_sock);
             }
         }
     }
 
-    return purged;
+    // After a handoff the new process has opened its own at the paths
+    um_stats_close(stats_sock, handoff_done ? NULL : stats_path);
+    stats_sock = -1;
+    if (handoff_conn >= 0) {
+        um_event_del(handoff_conn, UM_EVENT_HANDOFF_CONN);
+        close(handoff_conn);
+        handoff_conn = -1;
+    }
+    um_handoff_close(handoff_sock, handoff_done ? NULL : handoff_path);
+    handoff_sock = -1;
+
+    resolver_stop(&resolver);
+    um_event_fini();
+    um_batch_free(&batch);
+    um_pool_free(&pool);
+    um_sockmap_free(&map);
+
+    return 0;
 }
 
 /////////////////////////////////////////////////////////////////////
+// Workers
+/////////////////////////////////////////////////////////////////////
+
+static int set_reuseaddr(int sock)
+{
+    int on = 1;
+    return setsockopt(sock, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+}
+
+static int set_reuseport(int sock)
+{
+#ifdef SO_REUSEPORT
+    int on = 1;
+    return setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on));
+#else
+    errno = ENOPROTOOPT;
+    return -1;
+#endif
+}
 
-static inline int sockaddr_in_cmp(const struct sockaddr_in *a,
-                                  const struct sockaddr_in *b)
+// Steer each client to worker hash(source address, source port) % n, so a
+// flow sticks to the same worker no matter how the kernel orders the group.
+// IPv6 hashes the low word of the address, extension headers aren't looked
+// at.
+static void attach_reuseport_cbpf(int sock, int n)
 {
-    int af_cmp = a->sin_family - b->sin_family;
-    if (af_cmp != 0) {
-        return af_cmp;
+#ifdef SO_ATTACH_REUSEPORT_CBPF
+    struct sock_filter code[] = {
+        // IP version
+        { BPF_LD | BPF_B | BPF_ABS, 0, 0, SKF_NET_OFF },
+        { BPF_ALU | BPF_RSH | BPF_K, 0, 0, 4 },
+        { BPF_JMP | BPF_JEQ | BPF_K, 0, 4, 6 },
+        // IPv6: X = UDP source port, A = low word of the source address
+        { BPF_LD | BPF_H | BPF_ABS, 0, 0, SKF_NET_OFF + 40 },
+        { BPF_MISC | BPF_TAX, 0, 0, 0 },
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 20 },
+        { BPF_JMP | BPF_JA, 0, 0, 4 },
+        // IPv4: X = header length
+        { BPF_LDX | BPF_B | BPF_MSH, 0, 0, SKF_NET_OFF },
+        // A = UDP source port
+        { BPF_LD | BPF_H | BPF_IND, 0, 0, SKF_NET_OFF },
+        { BPF_MISC | BPF_TAX, 0, 0, 0 },
+        // A = source address
+        { BPF_LD | BPF_W | BPF_ABS, 0, 0, SKF_NET_OFF + 12 },
+        // A = A + X, hashed
+        { BPF_ALU | BPF_ADD | BPF_X, 0, 0, 0 },
+        { BPF_ALU | BPF_MUL | BPF_K, 0, 0, 0x9E3779B1 },
+        { BPF_ALU | BPF_RSH | BPF_K, 0, 0, 16 },
+        { BPF_ALU | BPF_MOD | BPF_K, 0, 0, (uint32_t) n },
+        { BPF_RET | BPF_A, 0, 0, 0 },
+    };
+    struct sock_fprog prog = {
+        .len = ARRAY_SIZE(code),
+        .filter = code,
+    };
+
+    if (setsockopt(sock, SOL_SOCKET, SO_ATTACH_REUSEPORT_CBPF,
+                   &prog, sizeof(prog)) < 0) {
+        log_warn("SO_ATTACH_REUSEPORT_CBPF: %s", strerror(errno));
     }
+#endif
+}
 
-    int port_cmp = a->sin_port - b->sin_port;
-    if (port_cmp != 0) {
-        return port_cmp;
+// socks holds each worker's listening socket of every tunnel in turn
+static pid_t spawn_worker(const int *socks, int i)
+{
+    pid_t pid = fork();
+    if (pid != 0) {
+        if (pid < 0) {
+            log_err("fork(): %s", strerror(errno));
+        }
+        return pid;
     }
 
-    long in_addr_cmp = a->sin_addr.s_addr - b->sin_addr.s_addr;
-    if (in_addr_cmp != 0) {
-        return (int) in_addr_cmp;
+    for (int j = 0; j < workers * n_tunnels; j++) {
+        if (j / n_tunnels != i) {
+            close(socks[j]);
+        }
     }
 
-    return 0;
-}
+    for (int t = 0; t < n_tunnels; t++) {
+        tunnels[t].bind_sock = socks[i * n_tunnels + t];
+    }
+    genmask_seed();
+
+    // One stats socket per worker, path.N
+    if (stats_path) {
+        char *path = malloc(strlen(stats_path) + 16);
+        if (path) {
+            sprintf(path, "%s.%d", stats_path, i);
+            stats_path = path;
+        }
+    }
 
-static void sighanlder(int signum)
-{
-    if (signum == SIGHUP || signum == SIGINT || signum == SIGTERM) {
-        signal_term = 1;
+    log_info("Worker %d started", i);
+
+    int ret = start();
+
+    for (int t = 0; t < n_tunnels; t++) {
+        close(tunnels[t].bind_sock);
     }
+    endlog();
+    exit(ret);
 }
 
-// Main loop
-int start(enum um_mode mode)
+// Bind one more SO_REUSEPORT socket per worker next to each tunnel's, fork
+// a worker for each and restart any that dies until we are told to stop
+static int run_workers(void)
 {
-    struct um_transform tran;
+    int socks[workers * n_tunnels];
+    pid_t pids[workers];
+    int ret = 0;
+    int n;
 
-    memset(&tran, 0, sizeof(tran));
-    genmask(tran.mask, MASK_LEN);
+    for (n = 0; n < n_tunnels; n++) {
+        socks[n] = tunnels[n].bind_sock;
+    }
 
-    ssize_t ret;
-    int select_ret;
-    int sock_idx;
-    int tmp_sock = -1;
+    for (; n < workers * n_tunnels; n++) {
+        union um_sockaddr *addr = &tunnels[n % n_tunnels].conf.listen;
+
+        socks[n] = new_sock_nonblocking(addr->sa.sa_family);
+        if (socks[n] < 0 || set_reuseport(socks[n]) < 0 ||
+            (use_reply_sock && set_reuseaddr(socks[n]) < 0) ||
+            bind(socks[n], &addr->sa, um_sockaddr_len(addr)) < 0) {
+            log_err("Failed to bind worker %d: %s", n / n_tunnels,
+                    strerror(errno));
+            if (socks[n] >= 0) {
+                close(socks[n]);
+            }
+            ret = 1;
+            goto exit;
+        }
+    }
 
-    struct hostent *rh;
-    struct in_addr conn_addr_in = {
-        .s_addr = 0,
-    };
-    struct sockaddr_in conn_addr = {
-        .sin_family = AF_INET,
-        .sin_port = htons(port_conn),
-        .sin_addr = {
-            .s_addr = 0,
-        },
-    };
-    time_t time_conn_addr = 0;
+    for (int t = 0; t < n_tunnels; t++) {
+        attach_reuseport_cbpf(tunnels[t].bind_sock, workers);
+    }
 
-    struct sockaddr_in recv_addr;
-    socklen_t recv_addr_len = sizeof(recv_addr);
+    for (int i = 0; i < workers; i++) {
+        pids[i] = spawn_worker(socks, i);
+    }
 
-    unsigned char buf[UM_BUFFER];
-    size_t buflen;
+    while (!signal_term) {
+        int status;
+        pid_t pid = waitpid(-1, &status, 0);
 
-    buf_func snd_buf_func;
-    buf_func rcv_buf_func;
+        if (pid < 0) {
+            if (errno == EINTR) {
+                if (signal_dump) {
+                    signal_dump = 0;
+                    for (int i = 0; i < workers; i++) {
+                        if (pids[i] > 0) {
+                            kill(pids[i], SIGUSR1);
+                        }
+                    }
+                }
+                continue;
+            }
+            log_err("waitpid(): %s", strerror(errno));
+            ret = 1;
+            break;
+        }
 
-    switch (mode) {
-    case UM_MODE_SERVER:
-        snd_buf_func = &unmaskbuf;
-        rcv_buf_func = &maskbuf;
-        break;
-    case UM_MODE_CLIENT:
-        snd_buf_func = &maskbuf;
-        rcv_buf_func = &unmaskbuf;
-        break;
-    case UM_MODE_PASSTHROU:
-        snd_buf_func = &masknoop;
-        rcv_buf_func = &masknoop;
-        break;
-    default:
-        log_err("Unknown mode");
-        return 1;
+        for (int i = 0; i < workers; i++) {
+            if (pids[i] == pid) {
+                log_warn("Worker %d [%d] exited, restarting", i, (int) pid);
+                sleep(1);
+                pids[i] = signal_term ? -1 : spawn_worker(socks, i);
+            }
+        }
     }
 
-    fd_set active_fd_set, read_fd_set;
-    FD_ZERO(&active_fd_set);
-    FD_SET(bind_sock, &active_fd_set);
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0) {
+            kill(pids[i], SIGTERM);
+        }
+    }
 
-    log_info("Connection timeout %ds", timeout);
+    for (int i = 0; i < workers; i++) {
+        if (pids[i] > 0) {
+            waitpid(pids[i], NULL, 0);
+        }
+    }
 
-    time_t time_last_clean = 0;
-    time_t time_val;
+exit:
+    // The tunnels' own sockets are closed by main()
+    for (int i = n_tunnels; i < n; i++) {
+        close(socks[i]);
+    }
 
-    update_sock_fd_max();
+    return ret;
+}
 
-    while (!signal_term) {
-        read_fd_set = active_fd_set;
+/////////////////////////////////////////////////////////////////////
+// Tunnels
+/////////////////////////////////////////////////////////////////////
 
-        select_ret = select(sock_fd_max + 1, &read_fd_set, NULL, NULL, NULL);
-        if (select_ret <= 0) {
-            log_debug("select() returns %d", select_ret);
-            continue;
+// Open and bind the listening socket of tunnel t. Without a listening
+// address it takes both families where the kernel has IPv6.
+static int open_tunnel(int t)
+{
+    struct um_tunnel *tn = &tunnels[t];
+    union um_sockaddr *addr = &tn->conf.listen;
+    char buf[UM_ADDR_STRLEN];
+
+    if (addr->sa.sa_family == AF_UNSPEC) {
+        tn->listen_any = 1;
+        tn->bind_sock = new_sock_nonblocking(AF_INET6);
+        if (tn->bind_sock >= 0) {
+            addr->v6.sin6_family = AF_INET6;
+            addr->v6.sin6_addr = in6addr_any;
+        } else {
+            addr->v4.sin_family = AF_INET;
+            addr->v4.sin_addr.s_addr = htonl(INADDR_ANY);
         }
+    }
 
-        time_val = time(NULL);
-
-        if (FD_ISSET(bind_sock, &read_fd_set)) {
-            // Deal with packets from "listening" socket
-            for (int drained = 0;
-                 drained < UM_DRAIN_BATCH && !signal_term;
-                 drained++) {
-                recv_addr_len = sizeof(recv_addr);
-                ret = recvfrom(bind_sock, (void *) buf, UM_BUFFER, 0,
-                               (struct sockaddr *) &recv_addr,
-                               &recv_addr_len);
+    if (tn->bind_sock < 0) {
+        tn->bind_sock = new_sock_nonblocking(addr->sa.sa_family);
+    }
+    if (tn->bind_sock < 0) {
+        log_err("socket()/fcntl(): %s", strerror(errno));
+        return -1;
+    }
 
-                if (ret < 0) {
-                    if (would_block()) {
-                        break;
-                    }
-                    if (errno == EINTR) {
-                        continue;
-                    }
-                    log_warn("recvfrom(): %s", strerror(errno));
-                    break;
-                }
-                if (ret == 0) {
-                    continue;
-                }
+    um_sockaddr_set_port(addr, tn->conf.port);
 
-                buflen = (size_t) ret;
+    log_info("Tunnel %d: %s, bind to [%s], remote address [%s:%hu]", t,
+             um_mode_name(tn->conf.mode), um_sockaddr_str(addr, buf,
+             sizeof(buf)), tn->conf.host, tn->conf.port_conn);
 
-                // Try to locate existing connection from map
-                sock_idx = um_sockmap_find(&recv_addr);
+    if (workers > 1 && set_reuseport(tn->bind_sock) < 0) {
+        log_err("SO_REUSEPORT: %s", strerror(errno));
+        return -1;
+    }
 
-                if (sock_idx < 0) {
-                    log_info("New connection from [%s:%hu]",
-                             inet_ntoa(recv_addr.sin_addr),
-                             ntohs(recv_addr.sin_port));
+    // Reply sockets share the listening address
+    if (use_reply_sock && set_reuseaddr(tn->bind_sock) < 0) {
+        log_err("SO_REUSEADDR: %s", strerror(errno));
+        return -1;
+    }
 
-                    tmp_sock = new_sock_nonblocking();
-                    if (tmp_sock < 0) {
-                        log_err("socket()/fcntl(): %s", strerror(errno));
-                    } else {
-                        if (time_val - time_last_clean >= 1) {
-                            um_sockmap_clean(&active_fd_set, time_val);
-                            time_last_clean = time_val;
-                        }
+    if (bind(tn->bind_sock, &addr->sa, um_sockaddr_len(addr)) < 0) {
+        log_err("bind(): %s", strerror(errno));
+        return -1;
+    }
 
-                        sock_idx = um_sockmap_ins(tmp_sock, &recv_addr);
-                        if (sock_idx >= 0) {
-                            // Inserted newly created socket into sockmap
-                            FD_SET(tmp_sock, &active_fd_set);
-                            UPDATE_SOCK_FD_MAX_ADD(tmp_sock);
-                        } else {
-                            // Failed to insert newly created socket into sockmap
-                            log_warn("Max clients reached. "
-                                     "Dropping new connection [%s:%hu]",
-                                     inet_ntoa(recv_addr.sin_addr),
-                                     ntohs(recv_addr.sin_port));
-                            close(tmp_sock);
-                        }
-                    }
-                } 
-                
-                // Check sock_idx again to deal with new connection
-                if (sock_idx >= 0) {
-                    int conn_addr_missing = conn_addr.sin_addr.s_addr == 0;
-                    int conn_addr_expired =
-                        !conn_addr_missing &&
-                        time_val - time_conn_addr >= UM_HOST_TIMEOUT;
-
-                    if ((conn_addr_missing && time_val != time_conn_addr) ||
-                        conn_addr_expired) {
-                        rh = gethostbyname2(host_conn, AF_INET);
-                        time_conn_addr = time_val;
-                        if (!rh) {
-                            herror("gethostbyname2()");
-                        } else {
-                            memcpy(&conn_addr_in, rh->h_addr_list[0],
-                                   rh->h_length);
-                            conn_addr.sin_addr = conn_addr_in;
-                        }
-                    }
+    return 0;
+}
 
-                    if (conn_addr.sin_addr.s_addr == 0) {
-                        continue;
-                    }
+// Take the listening sockets and flows over from the process serving at
+// handoff_path, which stops once we have them. Returns 1 if it handed
+// them over, 0 if nothing serves there, -1 if it or we gave up.
+static int take_over(void)
+{
+    struct um_handoff_rec *rec;
+    int *fds;
+    int n_t, n_f, nfd;
+    int sock, r, ok;
+    char buf[UM_ADDR_STRLEN];
 
-                    buflen = (*snd_buf_func)(&tran, buf, buflen);
-                    if (buflen > 0) {
-                        sendto(map[sock_idx].sock, (void *) buf, buflen, 0,
-                               (struct sockaddr *) &conn_addr,
-                               sizeof(conn_addr));
-                        UPDATE_LAST_USE(sock_idx, time_val);
-                    }
-                }
-            }
+    sock = um_handoff_connect(handoff_path);
+    if (sock < 0) {
+        if (errno == ENOENT || errno == ECONNREFUSED) {
+            return 0;
         }
+        log_err("Handoff [%s]: %s", handoff_path, strerror(errno));
+        return -1;
+    }
 
-        for (int i = 0; i < ARRAY_SIZE(map); i++) {
-            if (map[i].in_use && FD_ISSET(map[i].sock, &read_fd_set)) {
-                for (int drained = 0;
-                     drained < UM_DRAIN_BATCH && !signal_term;
-                     drained++) {
-                    ret = recv(map[i].sock, (void *) buf, UM_BUFFER, 0);
-
-                    if (ret < 0) {
-                        if (would_block()) {
-                            break;
-                        }
-                        if (errno == EINTR) {
-                            continue;
-                        }
-                        log_warn("recv(): %s", strerror(errno));
-                        break;
-                    }
-                    if (ret == 0) {
-                        continue;
-                    }
+    // Our tunnels as configured, the old process checks they are its own
+    rec = calloc(n_tunnels, sizeof(*rec));
+    if (!rec) {
+        log_err("calloc(): %s", strerror(errno));
+        close(sock);
+        return -1;
+    }
 
-                    UPDATE_LAST_USE(i, time_val);
+    for (int t = 0; t < n_tunnels; t++) {
+        rec[t].tunnel = t;
+        rec[t].from = tunnels[t].conf.listen;
+        um_sockaddr_set_port(&rec[t].from, tunnels[t].conf.port);
+    }
 
-                    buflen = (size_t) ret;
+    r = um_handoff_send(sock, 0, rec, n_tunnels, 0, NULL);
+    free(rec);
 
-                    buflen = (*rcv_buf_func)(&tran, buf, buflen);
-                    if (buflen > 0) {
-                        sendto(bind_sock, (void *) buf, buflen, 0,
-                               (struct sockaddr *) &map[i].from,
-                               sizeof(map[i].from));
-                    }
-                }
-            }
+    if (r < 0 || um_handoff_recv(sock, &rec, &n_t, &n_f, &fds) < 0) {
+        if (errno == EINVAL) {
+            log_err("Handoff from [%s] refused, it has other tunnels",
+                    handoff_path);
+        } else {
+            log_err("Handoff from [%s] failed: %s", handoff_path,
+                    strerror(errno));
         }
+        close(sock);
+        return -1;
+    }
 
-        if (time_val - time_last_clean >= 1) {
-            um_sockmap_clean(&active_fd_set, time_val);
-            time_last_clean = time_val;
+    nfd = um_handoff_nfd(rec, n_t + n_f);
+    ok = n_t == n_tunnels;
+    for (int i = 0; ok && i < n_t + n_f; i++) {
+        ok = i < n_t ? rec[i].tunnel == i && rec[i].nfd == 1 :
+                       rec[i].tunnel >= 0 && rec[i].tunnel < n_tunnels &&
+                       rec[i].nfd >= 1;
+    }
+
+    // Once it has our answer the old process stops serving, or carries on
+    if (!ok) {
+        um_handoff_send(sock, EPROTO, NULL, 0, 0, NULL);
+        errno = EPROTO;
+    }
+    if (!ok || um_handoff_send(sock, 0, NULL, 0, 0, NULL) < 0) {
+        log_err("Handoff from [%s] failed: %s", handoff_path,
+                strerror(errno));
+        for (int i = 0; i < nfd; i++) {
+            close(fds[i]);
         }
+        free(rec);
+        free(fds);
+        close(sock);
+        return -1;
     }
 
-    // Clean up
-    for (int i = 0; i < ARRAY_SIZE(map); i++) {
-        if (map[i].in_use) {
-            map[i].in_use = 0;
-            close(map[i].sock);
+    close(sock);
+
+    for (int t = 0; t < n_tunnels; t++) {
+        struct um_tunnel *tn = &tunnels[t];
+
+        tn->listen_any = tn->conf.listen.sa.sa_family == AF_UNSPEC;
+        tn->conf.listen = rec[t].from;
+        tn->bind_sock = fds[t];
+
+        // Sockets keep their options, our own -R needs this one
+        set_sock_nonblocking(tn->bind_sock);
+        if (use_reply_sock) {
+            set_reuseaddr(tn->bind_sock);
         }
+
+        log_info("Tunnel %d: %s, taken over [%s], remote address [%s:%hu]",
+                 t, um_mode_name(tn->conf.mode),
+                 um_sockaddr_str(&tn->conf.listen, buf, sizeof(buf)),
+                 tn->conf.host, tn->conf.port_conn);
     }
 
-    return 0;
+    handoff_rec = rec;
+    handoff_fds = fds;
+    handoff_n_flows = n_f;
+
+    log_info("Took over %d connections from [%s]", n_f, handoff_path);
+
+    return 1;
 }
 
+/////////////////////////////////////////////////////////////////////
+
 int main(int argc, char **argv)
 {
-    srand(time(0));
+    genmask_seed();
 
     int ret = 0;
 
-    memset((void *) host_conn, '\0', sizeof(host_conn));
-    memset((void *) map, 0, sizeof(map));
-
-    enum um_mode mode = UM_MODE_NONE;
-    struct in_addr addr = { .s_addr = INADDR_ANY };
-    uint16_t port = 0;
+    struct um_tunnel_conf cli;      // -m, -l, -p, -c and -o
+    struct um_tunnel_conf *conf = NULL;
+    const char *config_path = NULL;
+    int n_conf = 0;
 
-    struct sockaddr_in bind_addr;
-    memset((void *) &bind_addr, 0, sizeof(bind_addr));
+    memset(&cli, 0, sizeof(cli));
+    cli.mode = UM_MODE_NONE;
 
     const char *pidfile = 0;
     int show_usage = 0, daemonize = 0;
     int c;
     int r;
 
-    while ((c = getopt(argc, argv, "m:p:l:s:c:o:t:dP:L:h")) != -1) {
+    while ((c = getopt(argc, argv, "m:p:l:s:c:o:f:t:n:b:gq:w:TRS:H:dP:L:vh")) != -1) {
         switch (c) {
         case 'm':
-            if (strcmp(optarg, "server") == 0) {
-                mode = UM_MODE_SERVER;
-            } else if (strcmp(optarg, "client") == 0) {
-                mode = UM_MODE_CLIENT;
-            } else if (strcmp(optarg, "passthrough") == 0) {
-                mode = UM_MODE_PASSTHROU;
-            } else {
+            cli.mode = um_mode_parse(optarg);
+            if (cli.mode == UM_MODE_NONE) {
                 show_usage = 1;
             }
             break;
 
         case 'l':
-            r = inet_pton(AF_INET, optarg, (void *) &addr);
-            if (r == 0) {
+            if (um_sockaddr_parse(&cli.listen, optarg) < 0) {
                 show_usage = 1;
-            } else if (r < 0) {
-                perror("inet_pton()");
-                ret = 1;
-                goto exit;
             }
             break;
 
         case 'p':
-            port = (uint16_t) atoi(optarg);
+            cli.port = (uint16_t) atoi(optarg);
             break;
 
         case 'c':
-            memcpy(host_conn, optarg, strlen(optarg));
+            snprintf(cli.host, sizeof(cli.host), "%s", optarg);
             break;
 
         case 'o':
-            port_conn = (uint16_t) atoi(optarg);
+            cli.port_conn = (uint16_t) atoi(optarg);
+            break;
+
+        case 'f':
+            config_path = optarg;
             break;
 
         case 't':
@@ -510,6 +3815,70 @@ int main(int argc, char **argv)
             }
             break;
 
+        case 'n':
+            r = atoi(optarg);
+            if (r >= 1) {
+                max_client = r;
+            } else {
+                show_usage = 1;
+            }
+            break;
+
+        case 'b':
+            r = atoi(optarg);
+            if (r >= 1 && r <= UM_MMSG_MAX) {
+                mmsg_batch = r;
+            } else {
+                show_usage = 1;
+            }
+            break;
+
+        case 'g':
+#ifdef UM_HAVE_GSO
+            use_gso = 1;
+#else
+            fprintf(stderr, "UDP GSO/GRO not supported by this build\n");
+#endif
+            break;
+
+        case 'q':
+            r = atoi(optarg);
+            if (r >= 0) {
+                txq_max = r;
+            } else {
+                show_usage = 1;
+            }
+            break;
+
+        case 'w':
+            r = atoi(optarg);
+            if (r >= 1) {
+                workers = r;
+            } else {
+                show_usage = 1;
+            }
+            break;
+
+        case 'T':
+#ifdef UM_HAVE_PIPELINE
+            use_pipeline = 1;
+#else
+            fprintf(stderr, "Pipeline threads not supported by this build\n");
+#endif
+            break;
+
+        case 'R':
+            use_reply_sock = 1;
+            break;
+
+        case 'S':
+            stats_path = optarg;
+            break;
+
+        case 'H':
+            handoff_path = optarg;
+            break;
+
         case 'd':
             daemonize = 1;
             break;
@@ -518,6 +3887,10 @@ int main(int argc, char **argv)
             pidfile = optarg;
             break;
 
+        case 'v':
+            log_level = LOG_DEBUG;
+            break;
+
         case 'h':
         case '?':
         default:
@@ -526,39 +3899,51 @@ int main(int argc, char **argv)
         }
     }
 
-    if (port_conn == 0 || strlen(host_conn) == 0) {
+    // -m makes the first tunnel, -f adds the rest
+    if (cli.mode != UM_MODE_NONE) {
+        if (cli.port == 0) {
+            cli.port = cli.mode == UM_MODE_CLIENT ? UM_CLIENT_PORT
+                                                  : UM_SERVER_PORT;
+        }
+        if (cli.port_conn == 0 || strlen(cli.host) == 0) {
+            show_usage = 1;
+        } else {
+            conf = malloc(sizeof(*conf));
+            if (!conf) {
+                perror("malloc()");
+                ret = 1;
+                goto exit;
+            }
+            conf[n_conf++] = cli;
+        }
+    } else if (!config_path) {
         show_usage = 1;
     }
 
-    bind_sock = new_sock_nonblocking();
-    if (bind_sock < 0) {
-        perror("socket()/fcntl()");
+    if (config_path && !show_usage) {
+        r = um_config_load(config_path, &conf, &n_conf);
+        if (r < 0) {
+            fprintf(stderr, "%s: %s\n", config_path, strerror(errno));
+            ret = 1;
+            goto exit;
+        } else if (r > 0) {
+            fprintf(stderr, "%s:%d: bad tunnel\n", config_path, r);
+            ret = 1;
+            goto exit;
+        }
+    }
+
+    if (handoff_path && workers > 1) {
+        fprintf(stderr, "-H works with a single process only, not -w\n");
         ret = 1;
         goto exit;
     }
 
-    switch (mode) {
-    case UM_MODE_SERVER:
-        if (port == 0) {
-            port = UM_SERVER_PORT;
-        }
-        break;
-
-    case UM_MODE_CLIENT:
-        if (port == 0) {
-            port = UM_CLIENT_PORT;
-        }
-        break;
-
-    case UM_MODE_PASSTHROU:
-        if (port == 0) {
-            port = UM_SERVER_PORT;
-        }
-        break;
-
-    default:
-        show_usage = 1;
-        break;
+    if (!show_usage && (n_conf == 0 || n_conf > UM_MAX_TUNNEL)) {
+        fprintf(stderr, "Need 1 to %d tunnels, have %d\n", UM_MAX_TUNNEL,
+                n_conf);
+        ret = 1;
+        goto exit;
     }
 
     if (show_usage) {
@@ -566,9 +3951,10 @@ int main(int argc, char **argv)
         goto exit;
     }
 
-    signal(SIGHUP, sighanlder);
-    signal(SIGINT, sighanlder);
-    signal(SIGTERM, sighanlder);
+    set_signal(SIGHUP, sighanlder);
+    set_signal(SIGINT, sighanlder);
+    set_signal(SIGTERM, sighanlder);
+    set_signal(SIGUSR1, sighanlder);
 
     if (daemonize) {
         use_syslog = 1;
@@ -615,25 +4001,46 @@ int main(int argc, char **argv)
 
     startlog(basename(argv[0]));
 
-    bind_addr.sin_family = AF_INET;
-    bind_addr.sin_addr = addr;
-    bind_addr.sin_port = htons(port);
+    log_info("Transform kernel %s", transform_init());
 
-    log_info("Bind to [%s:%hu]", inet_ntoa(addr), port);
+    tunnels = calloc(n_conf, sizeof(*tunnels));
+    if (!tunnels) {
+        log_err("calloc(): %s", strerror(errno));
+        ret = 1;
+        goto exit;
+    }
 
-    r = bind(bind_sock, (struct sockaddr *) &bind_addr, sizeof(bind_addr));
-    if (r != 0) {
-        log_err("bind(): %s", strerror(errno));
+    for (int t = 0; t < n_conf; t++) {
+        tunnels[t].conf = conf[t];
+        tunnels[t].bind_sock = -1;
+    }
+    n_tunnels = n_conf;
+
+    if (handoff_path && take_over() < 0) {
         ret = 1;
         goto exit;
     }
 
-    log_info("Remote address [%s:%hu]", host_conn, port_conn);
+    for (int t = 0; t < n_tunnels; t++) {
+        if (tunnels[t].bind_sock < 0 && open_tunnel(t) < 0) {
+            ret = 1;
+            goto exit;
+        }
+    }
 
-    ret = start(mode);
+    if (workers > 1) {
+        log_info("Starting %d workers", workers);
+        ret = run_workers();
+    } else {
+        ret = start();
+    }
 
 exit:
-    close(bind_sock);
+    for (int t = 0; t < n_tunnels; t++) {
+        close(tunnels[t].bind_sock);
+    }
+    free(tunnels);
+    free(conf);
     endlog();
     return ret;
 }
@@ -6,15 +6,58 @@
 
 #define UM_SERVER_PORT  51194
 #define UM_CLIENT_PORT  61194
-#define UM_MAX_CLIENT   16
+#define UM_MAX_CLIENT   1024
+#define UM_MAX_TUNNEL   256     // the flow key has a byte for it
 #define UM_BUFFER       65507
 #define UM_TIMEOUT      300     // socket clean up timeout
 #define UM_HOST_TIMEOUT 60      // dns lookup cache timeout
+#define UM_MMSG_BATCH   16      // datagrams per recvmmsg()/sendmmsg() call
+#define UM_MMSG_MAX     64
+#define UM_TXQ_MAX      256     // datagrams a flow may have waiting to be sent
 
 #define TIME_INVALID    (time_t) -1
 
 #define ARRAY_SIZE(a)   (int) (sizeof(a) / sizeof(a[0]))
-#define NEW_SOCK()      socket(AF_INET, SOCK_DGRAM, 0)
+#define NEW_SOCK(af)    socket(af, SOCK_DGRAM, 0)
+
+// Batched datagram I/O, build with -DUM_NO_MMSG for libcs without it
+#if defined(__linux__) && !defined(UM_NO_MMSG)
+#define UM_HAVE_MMSG
+#else
+#include <sys/socket.h>
+
+#define mmsghdr         um_mmsghdr
+
+struct um_mmsghdr {
+    struct msghdr   msg_hdr;
+    unsigned int    msg_len;
+};
+#endif
+
+// UDP GSO/GRO (-g), needs batched I/O, build with -DUM_NO_GSO to leave out
+#if defined(UM_HAVE_MMSG) && !defined(UM_NO_GSO)
+#include <netinet/udp.h>
+#ifdef UDP_SEGMENT
+#define UM_HAVE_GSO
+#endif
+#endif
+
+// epoll event loop, build with -DUM_NO_EPOLL to use select() instead
+#if defined(__linux__) && !defined(UM_NO_EPOLL)
+#define UM_HAVE_EPOLL
+#endif
+
+// io_uring event loop, opt in with -DUM_IO_URING. Falls back to the loop
+// above when the kernel refuses it.
+#if defined(__linux__) && defined(UM_IO_URING)
+#define UM_HAVE_URING
+#endif
+
+// Receive, transform and send on threads of their own (-T), opt in with
+// -DUM_PIPELINE and build with -pthread
+#if defined(UM_PIPELINE)
+#define UM_HAVE_PIPELINE
+#endif
 
 enum um_mode {
     UM_MODE_NONE = -1,
@@ -23,11 +66,4 @@ enum um_mode {
     UM_MODE_PASSTHROU
 };
 
-struct um_sockmap {
-    int                 in_use;
-    int                 sock;
-    time_t              last_use;
-    struct sockaddr_in  from;
-};
-
 #endif /* _incl_UDPMASK_H */
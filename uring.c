@@ -0,0 +1,266 @@
+#include "uring.h"
+
+#ifdef UM_HAVE_URING
+
+#include <errno.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+static int sys_io_uring_setup(unsigned int entries, struct io_uring_params *p)
+{
+    return (int) syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int sys_io_uring_enter(int fd, unsigned int to_submit,
+                              unsigned int min_complete, unsigned int flags)
+{
+    return (int) syscall(__NR_io_uring_enter, fd, to_submit, min_complete,
+                         flags, NULL, 0);
+}
+
+static int sys_io_uring_register(int fd, unsigned int opcode, void *arg,
+                                 unsigned int nr_args)
+{
+    return (int) syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+int um_uring_init(struct um_uring *r, unsigned int entries)
+{
+    struct io_uring_params p;
+    unsigned char *sq, *cq;
+    int saved_errno;
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+              IORING_SETUP_COOP_TASKRUN;
+    p.cq_entries = entries * 8;
+
+    r->fd = sys_io_uring_setup(entries, &p);
+    if (r->fd < 0 && errno == EINVAL) {
+        // Older kernel, take the defaults
+        memset(&p, 0, sizeof(p));
+        r->fd = sys_io_uring_setup(entries, &p);
+    }
+    if (r->fd < 0) {
+        return -1;
+    }
+
+    // SQEs are reused as soon as they are submitted
+    if (!(p.features & IORING_FEAT_SUBMIT_STABLE)) {
+        errno = ENOSYS;
+        goto fail;
+    }
+
+    r->features = p.features;
+    r->sq_ring_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    r->cq_ring_size = p.cq_off.cqes +
+                      p.cq_entries * sizeof(struct io_uring_cqe);
+
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_size > r->sq_ring_size) {
+            r->sq_ring_size = r->cq_ring_size;
+        }
+        r->cq_ring_size = 0;
+    }
+
+    r->sq_ring = mmap(NULL, r->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQ_RING);
+    if (r->sq_ring == MAP_FAILED) {
+        r->sq_ring = NULL;
+        goto fail;
+    }
+
+    if (r->cq_ring_size) {
+        r->cq_ring = mmap(NULL, r->cq_ring_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_POPULATE, r->fd,
+                          IORING_OFF_CQ_RING);
+        if (r->cq_ring == MAP_FAILED) {
+            r->cq_ring = NULL;
+            goto fail;
+        }
+    } else {
+        r->cq_ring = r->sq_ring;
+    }
+
+    r->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    r->sqes = mmap(NULL, r->sqes_size, PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, r->fd, IORING_OFF_SQES);
+    if (r->sqes == MAP_FAILED) {
+        r->sqes = NULL;
+        goto fail;
+    }
+
+    sq = r->sq_ring;
+    r->sq_head = (unsigned int *) (sq + p.sq_off.head);
+    r->sq_tail = (unsigned int *) (sq + p.sq_off.tail);
+    r->sq_array = (unsigned int *) (sq + p.sq_off.array);
+    r->sq_mask = *(unsigned int *) (sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_local_tail = *r->sq_tail;
+
+    for (unsigned int i = 0; i < r->sq_entries; i++) {
+        r->sq_array[i] = i;
+    }
+
+    cq = r->cq_ring;
+    r->cq_head = (unsigned int *) (cq + p.cq_off.head);
+    r->cq_tail = (unsigned int *) (cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned int *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    return 0;
+
+fail:
+    saved_errno = errno;
+    um_uring_free(r);
+    errno = saved_errno;
+    return -1;
+}
+
+void um_uring_free(struct um_uring *r)
+{
+    if (r->br) {
+        munmap(r->br, r->br_size);
+    }
+    free(r->bufs);
+
+    if (r->sqes) {
+        munmap(r->sqes, r->sqes_size);
+    }
+    if (r->cq_ring && r->cq_ring != r->sq_ring) {
+        munmap(r->cq_ring, r->cq_ring_size);
+    }
+    if (r->sq_ring) {
+        munmap(r->sq_ring, r->sq_ring_size);
+    }
+    if (r->fd >= 0) {
+        close(r->fd);
+    }
+
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+// Next free SQE, cleared. A full queue is submitted first. Returns NULL if
+// that fails.
+struct io_uring_sqe *um_uring_sqe(struct um_uring *r, unsigned int *slot)
+{
+    struct io_uring_sqe *sqe;
+    unsigned int head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+
+    if (r->sq_local_tail - head >= r->sq_entries) {
+        if (um_uring_submit(r, 0) < 0) {
+            return NULL;
+        }
+        head = __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+        if (r->sq_local_tail - head >= r->sq_entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    *slot = r->sq_local_tail & r->sq_mask;
+    sqe = &r->sqes[*slot];
+    memset(sqe, 0, sizeof(*sqe));
+    r->sq_local_tail++;
+
+    return sqe;
+}
+
+// Submit everything queued and wait for at least wait completions.
+// Returns 0, or -1 with errno set (EINTR if a signal came in).
+int um_uring_submit(struct um_uring *r, unsigned int wait)
+{
+    unsigned int to_submit;
+    int ret;
+
+    __atomic_store_n(r->sq_tail, r->sq_local_tail, __ATOMIC_RELEASE);
+
+    to_submit = r->sq_local_tail -
+                __atomic_load_n(r->sq_head, __ATOMIC_ACQUIRE);
+    if (to_submit == 0 && wait == 0) {
+        return 0;
+    }
+
+    ret = sys_io_uring_enter(r->fd, to_submit, wait,
+                             wait ? IORING_ENTER_GETEVENTS : 0);
+    if (ret < 0) {
+        // Completions must be reaped first, whatever is left goes with the
+        // next call
+        if (wait == 0 && (errno == EBUSY || errno == EAGAIN)) {
+            return 0;
+        }
+        return -1;
+    }
+
+    return 0;
+}
+
+// Register n buffers of stride bytes each as group bgid, the kernel fills
+// at most len bytes of each
+int um_uring_bufs_init(struct um_uring *r, uint16_t bgid, unsigned int n,
+                       unsigned int len, size_t stride)
+{
+    struct io_uring_buf_reg reg;
+
+    if (n == 0 || (n & (n - 1)) || n > 32768) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    r->br_size = n * sizeof(struct io_uring_buf);
+    r->br = mmap(NULL, r->br_size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (r->br == MAP_FAILED) {
+        r->br = NULL;
+        return -1;
+    }
+
+    if (posix_memalign((void **) &r->bufs, 64, n * stride) != 0) {
+        r->bufs = NULL;
+        errno = ENOMEM;
+        return -1;
+    }
+
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t) (uintptr_t) r->br;
+    reg.ring_entries = n;
+    reg.bgid = bgid;
+
+    if (sys_io_uring_register(r->fd, IORING_REGISTER_PBUF_RING,
+                              &reg, 1) < 0) {
+        return -1;
+    }
+
+    r->br_mask = n - 1;
+    r->br_tail = 0;
+    r->bgid = bgid;
+    r->buf_stride = stride;
+    r->buf_len = len;
+
+    for (unsigned int i = 0; i < n; i++) {
+        um_uring_buf_put(r, (uint16_t) i);
+    }
+
+    return 0;
+}
+
+// Hand buffer bid back to the kernel
+void um_uring_buf_put(struct um_uring *r, uint16_t bid)
+{
+    struct io_uring_buf *buf = &r->br->bufs[r->br_tail & r->br_mask];
+
+    buf->addr = (uint64_t) (uintptr_t) um_uring_buf(r, bid);
+    buf->len = r->buf_len;
+    buf->bid = bid;
+
+    r->br_tail++;
+    __atomic_store_n(&r->br->tail, r->br_tail, __ATOMIC_RELEASE);
+}
+
+#endif /* UM_HAVE_URING */
@@ -0,0 +1,131 @@
+#ifndef _incl_URING_H
+#define _incl_URING_H
+
+#include "udpmask.h"
+
+#ifdef UM_HAVE_URING
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <linux/io_uring.h>
+
+// Just enough io_uring over the raw system calls for the event loop: one
+// ring, and one group of provided buffers for multishot receives
+
+struct um_uring {
+    int                     fd;     // -1 if not set up
+    unsigned int            features;
+
+    // Submission queue, SQE i always sits at array slot i
+    unsigned int           *sq_head;
+    unsigned int           *sq_tail;
+    unsigned int           *sq_array;
+    unsigned int            sq_mask;
+    unsigned int            sq_entries;
+    unsigned int            sq_local_tail;  // SQEs handed out so far
+    struct io_uring_sqe    *sqes;
+
+    // Completion queue
+    unsigned int           *cq_head;
+    unsigned int           *cq_tail;
+    unsigned int            cq_mask;
+    struct io_uring_cqe    *cqes;
+
+    void                   *sq_ring;
+    size_t                  sq_ring_size;
+    void                   *cq_ring;
+    size_t                  cq_ring_size;
+    size_t                  sqes_size;
+
+    // Provided buffers
+    struct io_uring_buf_ring *br;
+    size_t                  br_size;
+    unsigned int            br_mask;
+    uint16_t                br_tail;
+    uint16_t                bgid;
+    unsigned char          *bufs;
+    size_t                  buf_stride;
+    unsigned int            buf_len;    // what the kernel may fill
+};
+
+int um_uring_init(struct um_uring *r, unsigned int entries);
+void um_uring_free(struct um_uring *r);
+struct io_uring_sqe *um_uring_sqe(struct um_uring *r, unsigned int *slot);
+int um_uring_submit(struct um_uring *r, unsigned int wait);
+int um_uring_bufs_init(struct um_uring *r, uint16_t bgid, unsigned int n,
+                       unsigned int len, size_t stride);
+void um_uring_buf_put(struct um_uring *r, uint16_t bid);
+
+static inline unsigned char *um_uring_buf(const struct um_uring *r,
+                                          uint16_t bid)
+{
+    return r->bufs + (size_t) bid * r->buf_stride;
+}
+
+// Completions [*head, tail) are ready, hand them back with
+// um_uring_cq_advance()
+static inline unsigned int um_uring_cq_ready(const struct um_uring *r,
+                                             unsigned int *head)
+{
+    *head = *r->cq_head;
+    return __atomic_load_n(r->cq_tail, __ATOMIC_ACQUIRE);
+}
+
+static inline struct io_uring_cqe *um_uring_cqe(const struct um_uring *r,
+                                                unsigned int i)
+{
+    return &r->cqes[i & r->cq_mask];
+}
+
+static inline void um_uring_cq_advance(struct um_uring *r, unsigned int head)
+{
+    __atomic_store_n(r->cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Receive into provided buffers until cancelled, each completion carries
+// a struct io_uring_recvmsg_out followed by name, control and payload
+// sized after msg
+static inline void um_uring_prep_recvmsg_multi(struct io_uring_sqe *sqe,
+                                               int fd,
+                                               const struct msghdr *msg,
+                                               uint16_t bgid)
+{
+    sqe->opcode = IORING_OP_RECVMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) msg;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = bgid;
+}
+
+static inline void um_uring_prep_poll_multi(struct io_uring_sqe *sqe, int fd,
+                                            uint32_t events)
+{
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = fd;
+    sqe->len = IORING_POLL_ADD_MULTI;
+    sqe->poll32_events = events;
+}
+
+static inline void um_uring_prep_sendmsg(struct io_uring_sqe *sqe, int fd,
+                                         const struct msghdr *msg)
+{
+    sqe->opcode = IORING_OP_SENDMSG;
+    sqe->fd = fd;
+    sqe->addr = (uint64_t) (uintptr_t) msg;
+    sqe->len = 1;
+}
+
+static inline void um_uring_prep_cancel(struct io_uring_sqe *sqe,
+                                        uint64_t user_data)
+{
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = user_data;
+}
+
+#endif /* UM_HAVE_URING */
+
+#endif /* _incl_URING_H */